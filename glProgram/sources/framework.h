@@ -8,6 +8,11 @@
 #include <math.h>
 #include <vector>
 #include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <exception>
 
 #define GLUT 1
 #define GLFW 2
@@ -390,38 +395,171 @@ public:
 	}
 };
 
+//---------------------------
+class WorkStealingPool {	// runs a batch of jobs on worker threads, a worker that runs out of jobs takes them from the others
+//---------------------------
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> jobs;
+	};
+	std::vector<Queue> queues;
+
+	bool next(size_t worker, size_t& job) {	// from the front of its own queue, else from the back of another one
+		for (size_t i = 0; i < queues.size(); i++) {
+			Queue& queue = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.jobs.empty()) continue;
+			if (i == 0) { job = queue.jobs.front(); queue.jobs.pop_front(); }
+			else { job = queue.jobs.back(); queue.jobs.pop_back(); }
+			return true;
+		}
+		return false;
+	}
+
+	void clear() {	// drops the jobs that are left, so that the workers stop
+		for (Queue& queue : queues) {
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.jobs.clear();
+		}
+	}
+public:
+	WorkStealingPool(unsigned int threads = 0) {	// 0: one thread per core
+		if (threads == 0) threads = std::thread::hardware_concurrency();
+		queues = std::vector<Queue>(threads > 0 ? threads : 1);
+	}
+
+	size_t size() const { return queues.size(); }
+
+	// calls job(0) ... job(count - 1), on the calling thread and size() - 1 other threads, and returns when all are done.
+	// If a job throws, the jobs that didn't start yet are dropped, and the first exception is rethrown when all threads are done
+	void run(size_t count, const std::function<void(size_t)>& job) {
+		for (size_t i = 0; i < count; i++) queues[i * queues.size() / count].jobs.push_back(i);	// neighbouring jobs to the same worker
+		std::exception_ptr failure;
+		std::mutex failureMutex;
+		auto work = [&](size_t worker) {
+			size_t i;
+			try {
+				while (next(worker, i)) job(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(failureMutex);
+				if (!failure) failure = std::current_exception();
+				clear();
+			}
+		};
+		{
+			std::vector<std::thread> workers;
+			struct Joiner {	// destroying a joinable thread terminates the program, so join them also if starting one throws
+				WorkStealingPool& pool;
+				std::vector<std::thread>& threads;
+				~Joiner() {
+					for (std::thread& thread : threads) thread.join();
+					pool.clear();	// jobs that no thread ran if starting the first one threw
+				}
+			} joiner{ *this, workers };
+			for (size_t worker = 1; worker < queues.size() && worker < count; worker++) workers.emplace_back(work, worker);
+			work(0);
+		}
+		if (failure) std::rethrow_exception(failure);
+	}
+};
+
 //---------------------------
 class Texture {
 //---------------------------
 	unsigned int textureId = 0;
 public:
 #ifdef FILE_OPERATIONS
+	// an image decoded on the CPU, that the GL thread uploads to a texture later
+	struct Image {
+		fs::path pathname;
+		unsigned int width = 0, height = 0, error = 0;
+		bool transparent = false;
+		std::vector<unsigned char> pixels;
+
+		void decode(const fs::path& path, bool transparentImage) {	// can run on any thread, every call decodes with its own state
+			pathname = path;
+			transparent = transparentImage;
+			pixels.clear();	// lodepng::decode appends to the vector
+			error = lodepng::decode(pixels, width, height, pathname.string(), transparent ? LCT_RGBA : LCT_RGB, 8);
+			if (transparent && !error) alphaFromColor(pixels.data(), width, height);
+		}
+	};
+
 	Texture(const fs::path pathname, bool transparent = false, int sampling = GL_LINEAR) {
 		if (textureId == 0) glGenTextures(1, &textureId);  				// azonos�t� gener�l�s
 		glBindTexture(GL_TEXTURE_2D, textureId);    // k�t�s
 		unsigned int width, height;
+		// reused by the textures loaded on this thread, so that decodePixels only resizes it for a larger image
+		static thread_local std::vector<unsigned char> buffer;
 		unsigned char* pixels;
 		if (transparent) {
-			lodepng_decode32_file(&pixels, &width, &height, pathname.string().c_str());
-			for (unsigned int y = 0; y < height; ++y) {
-				for (unsigned int x = 0; x < width; ++x) {
-					float sum = 0;
-					for (int c = 0; c < 3; ++c) {
-						sum += pixels[4 * (x + y * width) + c];
-					}
-					pixels[4 * (x + y * width) + 3] = (unsigned char)(sum / 6);
-				}
-			}
-
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels); // GPU-ra
+			pixels = decodePixels(pathname, LCT_RGBA, 4, buffer, width, height);
+			if (pixels) alphaFromColor(pixels, width, height);
 		}
 		else {
-			lodepng_decode24_file(&pixels, &width, &height, pathname.string().c_str());
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels); // GPU-ra
+			pixels = decodePixels(pathname, LCT_RGB, 3, buffer, width, height);
 		}
+		upload(pixels, width, height, transparent, sampling);
+		printf("%s, w: %d, h: %d\n", pathname.string().c_str(), width, height);
+	}
+
+	Texture(const Image& image, int sampling = GL_LINEAR) {
+		glGenTextures(1, &textureId);
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		if (image.error) printf("%s: %s\n", image.pathname.string().c_str(), lodepng_error_text(image.error));
+		upload(image.pixels.data(), image.width, image.height, image.transparent, sampling);
+		printf("%s, w: %d, h: %d\n", image.pathname.string().c_str(), image.width, image.height);
+	}
+
+	// decodes the files on a pool of worker threads, then uploads them on the calling GL thread
+	static std::vector<Texture*> load(const std::vector<fs::path>& pathnames, bool transparent = false,
+		int sampling = GL_LINEAR, unsigned int threads = 0) {
+		std::vector<Image> images(pathnames.size());
+		WorkStealingPool pool(threads);
+		pool.run(images.size(), [&](size_t i) { images[i].decode(pathnames[i], transparent); });
+		std::vector<Texture*> textures;
+		for (const Image& image : images) textures.push_back(new Texture(image, sampling));
+		return textures;
+	}
+
+	// the alpha of every RGBA pixel from the sum of its colors
+	static void alphaFromColor(unsigned char* pixels, unsigned int width, unsigned int height) {
+		for (unsigned int y = 0; y < height; ++y) {
+			for (unsigned int x = 0; x < width; ++x) {
+				float sum = 0;
+				for (int c = 0; c < 3; ++c) {
+					sum += pixels[4 * (x + y * width) + c];
+				}
+				pixels[4 * (x + y * width) + 3] = (unsigned char)(sum / 6);
+			}
+		}
+	}
+
+	void upload(const unsigned char* pixels, unsigned int width, unsigned int height, bool transparent, int sampling) {
+		if (transparent) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels); // GPU-ra
+		else glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels); // GPU-ra
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling); // sz�r�s
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
-		printf("%s, w: %d, h: %d\n", pathname.string().c_str(), width, height);
+	}
+
+	// decodes into pixels, which only grows when the image doesn't fit, so that a caller can reuse it for many files.
+	// Returns nullptr and a size of 0 on error
+	static unsigned char* decodePixels(const fs::path& pathname, LodePNGColorType colortype, unsigned int channels,
+		std::vector<unsigned char>& pixels, unsigned int& width, unsigned int& height) {
+		unsigned int error = lodepng_decode_file_into(pixels.data(), pixels.size(), 0, &width, &height,
+			pathname.string().c_str(), colortype, 8);
+		if (error == 117) {	// too small, but the size of the image is known now
+			pixels.resize((size_t)width * height * channels);
+			error = lodepng_decode_file_into(pixels.data(), pixels.size(), 0, &width, &height,
+				pathname.string().c_str(), colortype, 8);
+		}
+		if (error) {
+			printf("%s: %s\n", pathname.string().c_str(), lodepng_error_text(error));
+			width = height = 0;
+			return nullptr;
+		}
+		return pixels.data();
 	}
 #endif
 	Texture(int width, int height) {
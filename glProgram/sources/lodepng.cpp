@@ -39,6 +39,32 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+#ifdef LODEPNG_COMPILE_THREADS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif /* WIN32_LEAN_AND_MEAN */
+#include <windows.h> /* CreateThread, critical sections */
+#else /* _WIN32 */
+#include <pthread.h> /* threads, mutexes */
+#include <unistd.h> /* sysconf */
+#endif /* _WIN32 */
+#endif /* LODEPNG_COMPILE_THREADS */
+
+#if defined(LODEPNG_COMPILE_DISK) && defined(LODEPNG_COMPILE_MMAP)
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif /* WIN32_LEAN_AND_MEAN */
+#include <windows.h> /* CreateFileMapping, MapViewOfFile */
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap, madvise */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h> /* close */
+#endif /* _WIN32 */
+#endif /* LODEPNG_COMPILE_DISK && LODEPNG_COMPILE_MMAP */
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -113,6 +139,76 @@ void lodepng_free(void* ptr);
 #define LODEPNG_RESTRICT /* not available */
 #endif
 
+#ifdef LODEPNG_COMPILE_SIMD
+/* SIMD intrinsics. NEON and SSE2 are only used when the compiler targets them anyway, SSSE3 and AVX2 code is
+compiled for those instructions separately and only used after checking at runtime that the CPU has them. */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define LODEPNG_SIMD_NEON
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> /*SSE2*/
+#include <tmmintrin.h> /*SSSE3*/
+#include <immintrin.h> /*AVX2*/
+#ifdef _MSC_VER
+#include <intrin.h> /*__cpuid*/
+#endif /*_MSC_VER*/
+#define LODEPNG_SIMD_X86
+#endif
+#if defined(__ARM_FEATURE_CRC32) && !defined(_MSC_VER)
+#include <arm_acle.h> /*ARMv8 CRC32 instructions*/
+#define LODEPNG_CRC_ARM
+#endif
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+#ifdef LODEPNG_SIMD_X86
+/* GCC and clang only allow instructions of the target in a function, Visual Studio allows all of them anywhere */
+#if defined(__GNUC__) || defined(__clang__)
+#define LODEPNG_TARGET(name) __attribute__((target(name)))
+#else
+#define LODEPNG_TARGET(name) /* not needed */
+#endif
+
+#define LODEPNG_CPU_SSSE3 1u
+#define LODEPNG_CPU_AVX2 2u
+#define LODEPNG_CPU_PCLMUL 4u
+
+/* Returns which of the LODEPNG_CPU_ instruction sets the CPU and OS support. The result is cached in a static
+variable that is loaded and stored atomically, since this is called from every thread that filters or checksums:
+threads that race on the first call all compute and store the same value. */
+static unsigned lodepng_cpu_features(void) {
+#ifdef _MSC_VER
+  static volatile __int32 features = -1;
+  unsigned result = (unsigned)__iso_volatile_load32(&features);
+#else /*_MSC_VER*/
+  static unsigned features = 0xffffffffu;
+  unsigned result = __atomic_load_n(&features, __ATOMIC_RELAXED);
+#endif /*_MSC_VER*/
+  if(result == 0xffffffffu) {
+#ifdef _MSC_VER
+    int info[4];
+    result = 0;
+    __cpuid(info, 1);
+    if(info[2] & (1 << 9)) result |= LODEPNG_CPU_SSSE3;
+    if(info[2] & (1 << 1)) result |= LODEPNG_CPU_PCLMUL;
+    /*AVX2 also needs the OS to save the YMM registers, which OSXSAVE and XGETBV tell*/
+    if((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      if(info[1] & (1 << 5)) result |= LODEPNG_CPU_AVX2;
+    }
+    __iso_volatile_store32(&features, (__int32)result);
+#else /*_MSC_VER*/
+    result = 0;
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) result |= LODEPNG_CPU_SSSE3;
+    if(__builtin_cpu_supports("avx2")) result |= LODEPNG_CPU_AVX2;
+    if(__builtin_cpu_supports("pclmul")) result |= LODEPNG_CPU_PCLMUL;
+    __atomic_store_n(&features, result, __ATOMIC_RELAXED);
+#endif /*_MSC_VER*/
+  }
+  return result;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
 /* Replacements for C library functions such as memcpy and strlen, to support platforms
 where a full C library is not available. The compiler can recognize them and compile
 to something as fast. */
@@ -339,6 +435,155 @@ static void lodepng_set32bitInt(unsigned char* buffer, unsigned value) {
 }
 #endif /*defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ENCODER)*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/* integer binary logarithm, max return value is 31 */
+static size_t ilog2(size_t i) {
+  size_t result = 0;
+  if(i >= 65536) { result += 16; i >>= 16; }
+  if(i >= 256) { result += 8; i >>= 8; }
+  if(i >= 16) { result += 4; i >>= 4; }
+  if(i >= 4) { result += 2; i >>= 2; }
+  if(i >= 2) { result += 1; /*i >>= 1;*/ }
+  return result;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Threads                                                                / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ZLIB) && \
+    (defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER))
+#define LODEPNG_USE_THREADS
+
+#ifdef _WIN32
+typedef HANDLE TaskThread;
+#else /*_WIN32*/
+typedef pthread_t TaskThread;
+#endif /*_WIN32*/
+
+/*the tasks of lodepng_run_tasks, which each thread takes the next one of until all are taken*/
+typedef struct TaskQueue {
+  void (*task)(void* context, size_t index);
+  void* context;
+  size_t count;
+  size_t next; /*the index of the next task to take, only used with the mutex locked*/
+#ifdef _WIN32
+  CRITICAL_SECTION mutex;
+#else /*_WIN32*/
+  pthread_mutex_t mutex;
+#endif /*_WIN32*/
+} TaskQueue;
+
+/*returns the index of the next task to run, or count if all are taken*/
+static size_t TaskQueue_take(TaskQueue* queue) {
+  size_t index;
+#ifdef _WIN32
+  EnterCriticalSection(&queue->mutex);
+#else /*_WIN32*/
+  pthread_mutex_lock(&queue->mutex);
+#endif /*_WIN32*/
+  index = queue->next;
+  if(index != queue->count) ++queue->next;
+#ifdef _WIN32
+  LeaveCriticalSection(&queue->mutex);
+#else /*_WIN32*/
+  pthread_mutex_unlock(&queue->mutex);
+#endif /*_WIN32*/
+  return index;
+}
+
+static void TaskQueue_work(TaskQueue* queue) {
+  size_t index;
+  while((index = TaskQueue_take(queue)) != queue->count) queue->task(queue->context, index);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI TaskQueue_thread(LPVOID queue) {
+  TaskQueue_work((TaskQueue*)queue);
+  return 0;
+}
+#else /*_WIN32*/
+static void* TaskQueue_thread(void* queue) {
+  TaskQueue_work((TaskQueue*)queue);
+  return 0;
+}
+#endif /*_WIN32*/
+
+/*the amount of threads to use for a num_threads setting, where 0 means one per processor*/
+static unsigned lodepng_get_num_threads(unsigned setting) {
+  if(setting == 0) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    setting = (unsigned)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long amount = sysconf(_SC_NPROCESSORS_ONLN);
+    setting = amount > 0 ? (unsigned)amount : 1u;
+#else
+    setting = 1;
+#endif
+  }
+  return setting ? setting : 1u;
+}
+
+/*
+Runs task(context, index) for each index from 0 to count - 1 on up to num_threads threads, of which the calling
+thread is one, and returns once all are done. Each thread takes the next task when it is done with the previous one.
+If threads can't be created, the ones that could, or else the calling thread alone, run all tasks. The tasks give
+their errors through the context.
+*/
+static void lodepng_run_tasks(size_t count, unsigned num_threads,
+                              void (*task)(void* context, size_t index), void* context) {
+  TaskQueue queue;
+  TaskThread* threads = 0;
+  size_t num_extra = 0, i;
+
+  queue.task = task;
+  queue.context = context;
+  queue.count = count;
+  queue.next = 0;
+#ifdef _WIN32
+  InitializeCriticalSection(&queue.mutex);
+#else /*_WIN32*/
+  if(pthread_mutex_init(&queue.mutex, 0)) {
+    for(i = 0; i != count; ++i) task(context, i);
+    return;
+  }
+#endif /*_WIN32*/
+
+  if(num_threads > count) num_threads = (unsigned)count;
+  if(num_threads > 1) threads = (TaskThread*)lodepng_malloc((num_threads - 1u) * sizeof(*threads));
+  if(threads) {
+    for(num_extra = 0; num_extra + 1u < num_threads; ++num_extra) {
+#ifdef _WIN32
+      threads[num_extra] = CreateThread(NULL, 0, TaskQueue_thread, &queue, 0, NULL);
+      if(!threads[num_extra]) break;
+#else /*_WIN32*/
+      if(pthread_create(&threads[num_extra], 0, TaskQueue_thread, &queue)) break;
+#endif /*_WIN32*/
+    }
+  }
+
+  TaskQueue_work(&queue);
+
+  for(i = 0; i != num_extra; ++i) {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else /*_WIN32*/
+    pthread_join(threads[i], 0);
+#endif /*_WIN32*/
+  }
+  lodepng_free(threads);
+#ifdef _WIN32
+  DeleteCriticalSection(&queue.mutex);
+#else /*_WIN32*/
+  pthread_mutex_destroy(&queue.mutex);
+#endif /*_WIN32*/
+}
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ZLIB && (LODEPNG_COMPILE_DECODER || LODEPNG_COMPILE_ENCODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / File IO                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -400,6 +645,69 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   return 0;
 }
 
+#if defined(LODEPNG_COMPILE_MMAP) && defined(LODEPNG_COMPILE_DECODER)\
+    && (defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#define LODEPNG_USE_MMAP
+
+/*
+Maps the whole file read-only into memory, to decode it without reading it into a buffer first, and sets *size to
+its size. Returns NULL if the file can't be mapped, such as pipes or empty files, which must then be read instead.
+The mapping must be released with lodepng_unmap_file.
+*/
+static const unsigned char* lodepng_map_file(size_t* size, const char* filename) {
+  const unsigned char* data = 0;
+#ifdef _WIN32
+  LARGE_INTEGER filesize;
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if(file == INVALID_HANDLE_VALUE) return 0;
+  if(GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &filesize) && filesize.QuadPart > 0
+     && (unsigned long long)filesize.QuadPart <= (size_t)(-1)) {
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if(mapping) {
+      /*the view keeps the mapping alive after its handle is closed*/
+      data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+      if(data) *size = (size_t)filesize.QuadPart;
+    }
+  }
+  CloseHandle(file);
+#else /*_WIN32*/
+  struct stat info;
+  int file = open(filename, O_RDONLY);
+  if(file < 0) return 0;
+  /*only regular files have a size to map, others like pipes are read*/
+  if(fstat(file, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0
+     && (off_t)(size_t)info.st_size == info.st_size) {
+    void* mapped = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if(mapped != MAP_FAILED) {
+      data = (const unsigned char*)mapped;
+      *size = (size_t)info.st_size;
+      /*the decoder goes through the file once from start to end*/
+#ifdef MADV_SEQUENTIAL
+      madvise(mapped, *size, MADV_SEQUENTIAL);
+#endif /*MADV_SEQUENTIAL*/
+#ifdef MADV_HUGEPAGE
+      /*files of at least a huge page (2 MiB) may use them, where the system supports that for files*/
+      if(*size >= 2097152u) madvise(mapped, *size, MADV_HUGEPAGE);
+#endif /*MADV_HUGEPAGE*/
+    }
+  }
+  /*the mapping stays valid after the file is closed*/
+  close(file);
+#endif /*_WIN32*/
+  return data;
+}
+
+static void lodepng_unmap_file(const unsigned char* data, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  UnmapViewOfFile(data);
+#else /*_WIN32*/
+  munmap((void*)data, size);
+#endif /*_WIN32*/
+}
+#endif /*LODEPNG_USE_MMAP*/
+
 #endif /*LODEPNG_COMPILE_DISK*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -413,45 +721,65 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 
 typedef struct {
   ucvector* data;
-  unsigned char bp; /*ok to overflow, indicates bit pos inside byte*/
+  size_t buffer; /*bits not yet appended to data, the first one in the LSB: 64 bits on 64-bit targets, else at least
+                 32 bits*/
+  size_t numbits; /*amount of bits in buffer, less than half of the bits of buffer between writes*/
+  unsigned error; /*out of memory while appending to data*/
 } LodePNGBitWriter;
 
 static void LodePNGBitWriter_init(LodePNGBitWriter* writer, ucvector* data) {
   writer->data = data;
-  writer->bp = 0;
-}
-
-/*TODO: this ignores potential out of memory errors*/
-#define WRITEBIT(writer, bit){\
-  /* append new byte */\
-  if(((writer->bp) & 7u) == 0) {\
-    if(!ucvector_resize(writer->data, writer->data->size + 1)) return;\
-    writer->data->data[writer->data->size - 1] = 0;\
-  }\
-  (writer->data->data[writer->data->size - 1]) |= (bit << ((writer->bp) & 7u));\
-  ++writer->bp;\
-}
-
-/* LSB of value is written first, and LSB of bytes is used first */
-static void writeBits(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
-  if(nbits == 1) { /* compiler should statically compile this case if nbits == 1 */
-    WRITEBIT(writer, value);
-  } else {
-    /* TODO: increase output size only once here rather than in each WRITEBIT */
+  writer->buffer = 0;
+  writer->numbits = 0;
+  writer->error = 0;
+}
+
+/*adds up to half of the bits of the buffer, and appends that half to the data once it is full*/
+static LODEPNG_INLINE void writeBitsHalf(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
+  const size_t half = sizeof(size_t) * 4u;
+  writer->buffer |= (size_t)value << writer->numbits;
+  writer->numbits += nbits;
+  if(writer->numbits >= half) {
+    ucvector* data = writer->data;
     size_t i;
-    for(i = 0; i != nbits; ++i) {
-      WRITEBIT(writer, (unsigned char)((value >> i) & 1));
+    if(data->size + half / 8u <= data->allocsize || ucvector_reserve(data, data->size + half / 8u)) {
+      unsigned char* p = data->data + data->size;
+      for(i = 0; i != half / 8u; ++i) p[i] = (unsigned char)(writer->buffer >> (i * 8u));
+      data->size += half / 8u;
+    } else {
+      writer->error = 83; /*alloc fail*/
     }
+    writer->buffer >>= half;
+    writer->numbits -= half;
   }
 }
 
-/* This one is to use for adding huffman symbol, the value bits are written MSB first */
-static void writeBitsReversed(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
-  size_t i;
-  for(i = 0; i != nbits; ++i) {
-    /* TODO: increase output size only once here rather than in each WRITEBIT */
-    WRITEBIT(writer, (unsigned char)((value >> (nbits - 1u - i)) & 1u));
+/*
+LSB of value is written first, and LSB of bytes is used first. Writes up to 32 bits, value must not have bits set above
+nbits. The bits are gathered in a size_t buffer, from which every half of its bits are appended to the data at once.
+With a 32-bit size_t, more than 16 bits are added in two parts.
+*/
+static LODEPNG_INLINE void writeBits(LodePNGBitWriter* writer, unsigned value, size_t nbits) {
+  if(nbits > sizeof(size_t) * 4u) {
+    writeBitsHalf(writer, value & 65535u, 16u);
+    value >>= 16u;
+    nbits -= 16u;
+  }
+  writeBitsHalf(writer, value, nbits);
+}
+
+/*pads the bits written so far with zeros to a byte boundary and appends them to the data. Returns error.*/
+static unsigned writeBitsFlush(LodePNGBitWriter* writer) {
+  ucvector* data = writer->data;
+  size_t numbytes = (writer->numbits + 7u) >> 3u, i;
+  if(!writer->error && ucvector_reserve(data, data->size + numbytes)) {
+    for(i = 0; i != numbytes; ++i) data->data[data->size++] = (unsigned char)(writer->buffer >> (i * 8u));
+  } else {
+    writer->error = 83; /*alloc fail*/
   }
+  writer->buffer = 0;
+  writer->numbits = 0;
+  return writer->error;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -462,7 +790,7 @@ typedef struct {
   size_t size; /*size of data in bytes*/
   size_t bitsize; /*size of data in bits, end of valid bp values, should be 8*size*/
   size_t bp;
-  unsigned buffer; /*buffer for reading bits. NOTE: 'unsigned' must support at least 32 bits*/
+  size_t buffer; /*buffer for reading bits: 64 bits on 64-bit targets, else at least 32 bits*/
 } LodePNGBitReader;
 
 /* data size argument is in bytes. Returns error if size too large causing overflow */
@@ -480,97 +808,62 @@ static unsigned LodePNGBitReader_init(LodePNGBitReader* reader, const unsigned c
   return 0; /*ok*/
 }
 
+/*reads sizeof(size_t) bytes as little endian integer. GCC, clang and MSVC on little endian targets compile this
+to a single unaligned load.*/
+static LODEPNG_INLINE size_t lodepng_readSizeLE(const unsigned char* buffer) {
+  size_t result = (size_t)buffer[0] | ((size_t)buffer[1] << 8u) |
+                  ((size_t)buffer[2] << 16u) | ((size_t)buffer[3] << 24u);
+  if(sizeof(size_t) >= 8u) {
+    /*shifted twice, since a single shift by 32 would be undefined for a 32-bit size_t even if this is never reached*/
+    result |= (((size_t)buffer[4] | ((size_t)buffer[5] << 8u) | ((size_t)buffer[6] << 16u) |
+               ((size_t)buffer[7] << 24u)) << 16u) << 16u;
+  }
+  return result;
+}
+
 /*
-ensureBits functions:
-Ensures the reader can at least read nbits bits in one or more readBits calls,
+Ensures the reader can at least read nbits bits, up to 32, in one or more readBits calls,
 safely even if not enough bits are available.
 The nbits parameter is unused but is given for documentation purposes, error
 checking for amount of bits must be done beforehand.
+Away from the end of the input this is one load of a size_t and a shift, without branching on the amount of bits that
+are still in the buffer. With a 64-bit size_t that gives at least 57 bits. A 32-bit size_t also gets the bits of
+the next byte that the shift made room for. Only the last bytes of the input take the slow path, which fills
+missing bytes with zeros.
 */
-
-/*See ensureBits documentation above. This one ensures up to 9 bits */
-static LODEPNG_INLINE void ensureBits9(LodePNGBitReader* reader, size_t nbits) {
-  size_t start = reader->bp >> 3u;
-  size_t size = reader->size;
-  if(start + 1u < size) {
-    reader->buffer = (unsigned)reader->data[start + 0] | ((unsigned)reader->data[start + 1] << 8u);
-    reader->buffer >>= (reader->bp & 7u);
-  } else {
-    reader->buffer = 0;
-    if(start + 0u < size) reader->buffer = reader->data[start + 0];
-    reader->buffer >>= (reader->bp & 7u);
-  }
-  (void)nbits;
-}
-
-/*See ensureBits documentation above. This one ensures up to 17 bits */
-static LODEPNG_INLINE void ensureBits17(LodePNGBitReader* reader, size_t nbits) {
-  size_t start = reader->bp >> 3u;
-  size_t size = reader->size;
-  if(start + 2u < size) {
-    reader->buffer = (unsigned)reader->data[start + 0] | ((unsigned)reader->data[start + 1] << 8u) |
-                     ((unsigned)reader->data[start + 2] << 16u);
-    reader->buffer >>= (reader->bp & 7u);
-  } else {
-    reader->buffer = 0;
-    if(start + 0u < size) reader->buffer |= reader->data[start + 0];
-    if(start + 1u < size) reader->buffer |= ((unsigned)reader->data[start + 1] << 8u);
-    reader->buffer >>= (reader->bp & 7u);
-  }
-  (void)nbits;
-}
-
-/*See ensureBits documentation above. This one ensures up to 25 bits */
-static LODEPNG_INLINE void ensureBits25(LodePNGBitReader* reader, size_t nbits) {
-  size_t start = reader->bp >> 3u;
-  size_t size = reader->size;
-  if(start + 3u < size) {
-    reader->buffer = (unsigned)reader->data[start + 0] | ((unsigned)reader->data[start + 1] << 8u) |
-                     ((unsigned)reader->data[start + 2] << 16u) | ((unsigned)reader->data[start + 3] << 24u);
-    reader->buffer >>= (reader->bp & 7u);
-  } else {
-    reader->buffer = 0;
-    if(start + 0u < size) reader->buffer |= reader->data[start + 0];
-    if(start + 1u < size) reader->buffer |= ((unsigned)reader->data[start + 1] << 8u);
-    if(start + 2u < size) reader->buffer |= ((unsigned)reader->data[start + 2] << 16u);
-    reader->buffer >>= (reader->bp & 7u);
-  }
-  (void)nbits;
-}
-
-/*See ensureBits documentation above. This one ensures up to 32 bits */
 static LODEPNG_INLINE void ensureBits32(LodePNGBitReader* reader, size_t nbits) {
   size_t start = reader->bp >> 3u;
   size_t size = reader->size;
-  if(start + 4u < size) {
-    reader->buffer = (unsigned)reader->data[start + 0] | ((unsigned)reader->data[start + 1] << 8u) |
-                     ((unsigned)reader->data[start + 2] << 16u) | ((unsigned)reader->data[start + 3] << 24u);
-    reader->buffer >>= (reader->bp & 7u);
-    reader->buffer |= (((unsigned)reader->data[start + 4] << 24u) << (8u - (reader->bp & 7u)));
+  size_t shift = reader->bp & 7u;
+  if(start + sizeof(size_t) <= size) {
+    reader->buffer = lodepng_readSizeLE(reader->data + start) >> shift;
+    if(sizeof(size_t) < 8u && shift && start + sizeof(size_t) < size) {
+      reader->buffer |= ((size_t)reader->data[start + sizeof(size_t)] << 24u) << (8u - shift);
+    }
   } else {
+    size_t i;
     reader->buffer = 0;
-    if(start + 0u < size) reader->buffer |= reader->data[start + 0];
-    if(start + 1u < size) reader->buffer |= ((unsigned)reader->data[start + 1] << 8u);
-    if(start + 2u < size) reader->buffer |= ((unsigned)reader->data[start + 2] << 16u);
-    if(start + 3u < size) reader->buffer |= ((unsigned)reader->data[start + 3] << 24u);
-    reader->buffer >>= (reader->bp & 7u);
+    for(i = 0; start + i < size && i < sizeof(size_t); ++i) {
+      reader->buffer |= ((size_t)reader->data[start + i] << (i * 8u));
+    }
+    reader->buffer >>= shift;
   }
   (void)nbits;
 }
 
-/* Get bits without advancing the bit pointer. Must have enough bits available with ensureBits. Max nbits is 31. */
+/* Get bits without advancing the bit pointer. Must have enough bits available with ensureBits32. Max nbits is 31. */
 static LODEPNG_INLINE unsigned peekBits(LodePNGBitReader* reader, size_t nbits) {
   /* The shift allows nbits to be only up to 31. */
-  return reader->buffer & ((1u << nbits) - 1u);
+  return (unsigned)reader->buffer & ((1u << nbits) - 1u);
 }
 
-/* Must have enough bits available with ensureBits */
+/* Must have enough bits available with ensureBits32 */
 static LODEPNG_INLINE void advanceBits(LodePNGBitReader* reader, size_t nbits) {
   reader->buffer >>= nbits;
   reader->bp += nbits;
 }
 
-/* Must have enough bits available with ensureBits */
+/* Must have enough bits available with ensureBits32 */
 static LODEPNG_INLINE unsigned readBits(LodePNGBitReader* reader, size_t nbits) {
   unsigned result = peekBits(reader, nbits);
   advanceBits(reader, nbits);
@@ -636,6 +929,8 @@ typedef struct HuffmanTree {
   /* for reading only */
   unsigned char* table_len; /*length of symbol from lookup table, or max length if secondary lookup needed*/
   unsigned short* table_value; /*value of symbol from lookup table, or pointer to secondary table if needed*/
+  /*for reading literal/length codes only: combined first table, see HuffmanTree_makeLitLenTable*/
+  unsigned* table_litlen;
 } HuffmanTree;
 
 static void HuffmanTree_init(HuffmanTree* tree) {
@@ -643,6 +938,7 @@ static void HuffmanTree_init(HuffmanTree* tree) {
   tree->lengths = 0;
   tree->table_len = 0;
   tree->table_value = 0;
+  tree->table_litlen = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree) {
@@ -650,6 +946,7 @@ static void HuffmanTree_cleanup(HuffmanTree* tree) {
   lodepng_free(tree->lengths);
   lodepng_free(tree->table_len);
   lodepng_free(tree->table_value);
+  lodepng_free(tree->table_litlen);
 }
 
 /* amount of bits for first huffman table lookup (aka root bits), see HuffmanTree_makeTable and huffmanDecodeSymbol.*/
@@ -939,6 +1236,124 @@ static void boundaryPM(BPMLists* lists, BPMNode* leaves, size_t numpresent, int
   }
 }
 
+/*whether symbol a sorts before symbol b: by frequency, and by index for equal frequencies*/
+static int huffman_symbol_less(unsigned a, unsigned b, const unsigned* frequencies) {
+  return frequencies[a] < frequencies[b] || (frequencies[a] == frequencies[b] && a < b);
+}
+
+/*moves the symbol at root down into the max-heap of size symbols below it*/
+static void huffman_sift_down(unsigned* symbols, size_t root, size_t size, const unsigned* frequencies) {
+  unsigned symbol = symbols[root];
+  for(;;) {
+    size_t child = 2u * root + 1u;
+    if(child >= size) break;
+    if(child + 1u < size && huffman_symbol_less(symbols[child], symbols[child + 1u], frequencies)) ++child;
+    if(!huffman_symbol_less(symbol, symbols[child], frequencies)) break;
+    symbols[root] = symbols[child];
+    root = child;
+  }
+  symbols[root] = symbol;
+}
+
+/*sorts the symbols with huffman_symbol_less using heapsort, which needs no extra memory*/
+static void huffman_sort_symbols(unsigned* symbols, size_t num, const unsigned* frequencies) {
+  size_t i;
+  for(i = num / 2u; i != 0; --i) huffman_sift_down(symbols, i - 1u, num, frequencies);
+  for(i = num; i > 1; --i) {
+    unsigned symbol = symbols[i - 1u];
+    symbols[i - 1u] = symbols[0];
+    symbols[0] = symbol;
+    huffman_sift_down(symbols, 0, i - 1u, frequencies);
+  }
+}
+
+/*
+In-place calculation of minimum-redundancy codes, see "In-Place Calculation of Minimum-Redundancy Codes", Alistair
+Moffat, Jyrki Katajainen, 1995. A holds num >= 2 weights in nondecreasing order, and receives their code lengths,
+which are nonincreasing. The first pass sets the weights and parents of the internal nodes, the second their depths
+and the third the depths of the leaves.
+*/
+static void huffman_lengths_in_place(unsigned* A, size_t num) {
+  size_t root, leaf, next, avbl, used, depth;
+  A[0] += A[1];
+  root = 0;
+  leaf = 2;
+  for(next = 1; next < num - 1; ++next) {
+    /*select the first item for a pairing*/
+    if(leaf >= num || A[root] < A[leaf]) {
+      A[next] = A[root];
+      A[root++] = (unsigned)next;
+    } else {
+      A[next] = A[leaf++];
+    }
+    /*add on the second item*/
+    if(leaf >= num || (root < next && A[root] < A[leaf])) {
+      A[next] += A[root];
+      A[root++] = (unsigned)next;
+    } else {
+      A[next] += A[leaf++];
+    }
+  }
+
+  A[num - 2] = 0;
+  for(next = num - 2; next != 0; --next) A[next - 1] = A[A[next - 1]] + 1u;
+
+  /*root and next count the internal nodes and leaves that are left, from the end*/
+  avbl = 1;
+  used = depth = 0;
+  root = num - 1;
+  next = num;
+  while(avbl > 0) {
+    while(root != 0 && A[root - 1] == depth) {
+      ++used;
+      --root;
+    }
+    while(avbl > used) {
+      A[--next] = (unsigned)depth;
+      --avbl;
+    }
+    avbl = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
+
+/*
+lodepng_huffman_code_lengths for alphabets of up to NUM_DEFLATE_CODE_SYMBOLS symbols, without allocating memory.
+Returns 0 without result if the minimum-redundancy code has lengths longer than maxbitlen, it's then up to package
+merge to find the best code within that limit. That's rare on deflate data, since the symbols would need very
+different frequencies.
+*/
+static unsigned huffman_code_lengths_in_place(unsigned* lengths, const unsigned* frequencies,
+                                              size_t numcodes, unsigned maxbitlen) {
+  unsigned weights[NUM_DEFLATE_CODE_SYMBOLS];
+  size_t i, numpresent = 0;
+  /*lengths holds the present symbols until the end*/
+  for(i = 0; i != numcodes; ++i) {
+    if(frequencies[i] > 0) lengths[numpresent++] = (unsigned)i;
+  }
+
+  if(numpresent < 2) {
+    /*see lodepng_huffman_code_lengths below for why there are two codes of 1 bit*/
+    unsigned present = numpresent ? lengths[0] : 0;
+    lodepng_memset(lengths, 0, numcodes * sizeof(*lengths));
+    lengths[present] = 1;
+    lengths[present == 0 ? 1 : 0] = 1;
+    return 1;
+  }
+
+  huffman_sort_symbols(lengths, numpresent, frequencies);
+  for(i = 0; i != numpresent; ++i) weights[i] = frequencies[lengths[i]];
+  huffman_lengths_in_place(weights, numpresent);
+  if(weights[0] > maxbitlen) return 0; /*the first symbol has the longest code*/
+
+  /*the code lengths fit in 5 bits since maxbitlen is below 32, put the symbols beside them*/
+  for(i = 0; i != numpresent; ++i) weights[i] |= lengths[i] << 5u;
+  lodepng_memset(lengths, 0, numcodes * sizeof(*lengths));
+  for(i = 0; i != numpresent; ++i) lengths[weights[i] >> 5u] = weights[i] & 31u;
+  return 1;
+}
+
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen) {
   unsigned error = 0;
@@ -949,6 +1364,10 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
   if((1u << maxbitlen) < (unsigned)numcodes) return 80; /*error: represent all symbols*/
 
+  if(numcodes <= NUM_DEFLATE_CODE_SYMBOLS && huffman_code_lengths_in_place(lengths, frequencies, numcodes, maxbitlen)) {
+    return 0;
+  }
+
   leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(*leaves));
   if(!leaves) return 83; /*alloc fail*/
 
@@ -1067,6 +1486,55 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree) {
 
 #ifdef LODEPNG_COMPILE_DECODER
 
+/*
+Kinds of entries in table_litlen. An entry has the amount of bits to advance in bits 0-3, the kind in bits 4-5,
+and depending on the kind:
+*) LITLEN_ONE_LITERAL: the literal in bits 8-15
+*) LITLEN_TWO_LITERALS: two short literal codes following each other, the first in bits 8-15, the second in 16-23
+*) LITLEN_LENGTH: the amount of extra bits in bits 8-15 and the base length in bits 16-24
+*) LITLEN_SLOW: end code, symbol longer than FIRSTBITS or invalid symbol, must use huffmanDecodeSymbol instead
+*/
+#define LITLEN_SLOW 0u
+#define LITLEN_ONE_LITERAL 1u
+#define LITLEN_TWO_LITERALS 2u
+#define LITLEN_LENGTH 3u
+
+/*
+Make the combined lookup table for literal/length codes. It is indexed with FIRSTBITS bits like the first table,
+but a single lookup gives the final literal or the length base with its amount of extra bits, and gives two
+literals at once if both their codes fit in FIRSTBITS bits together. The first table must already have been made.
+*/
+static unsigned HuffmanTree_makeLitLenTable(HuffmanTree* tree) {
+  static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
+  unsigned i;
+  tree->table_litlen = (unsigned*)lodepng_malloc(headsize * sizeof(*tree->table_litlen));
+  if(!tree->table_litlen) return 83; /*alloc fail*/
+
+  for(i = 0; i != headsize; ++i) {
+    unsigned l = tree->table_len[i];
+    unsigned value = tree->table_value[i];
+    unsigned entry = LITLEN_SLOW << 4u;
+    if(l > FIRSTBITS || value == INVALIDSYMBOL) {
+      /*keep the slow entry: needs secondary table lookup, or causes the error in huffmanDecodeSymbol*/
+    } else if(value <= 255) {
+      /*the remaining FIRSTBITS - l bits of the index are the start of the next symbol. Its first table
+      entry at index i >> l is only valid if the code of that symbol is short enough to fit in those bits*/
+      unsigned l2 = tree->table_len[i >> l];
+      unsigned value2 = tree->table_value[i >> l];
+      if(l + l2 <= FIRSTBITS && value2 <= 255) {
+        entry = (l + l2) | (LITLEN_TWO_LITERALS << 4u) | (value << 8u) | (value2 << 16u);
+      } else {
+        entry = l | (LITLEN_ONE_LITERAL << 4u) | (value << 8u);
+      }
+    } else if(value >= FIRST_LENGTH_CODE_INDEX && value <= LAST_LENGTH_CODE_INDEX) {
+      entry = l | (LITLEN_LENGTH << 4u) | (LENGTHEXTRA[value - FIRST_LENGTH_CODE_INDEX] << 8u)
+                | (LENGTHBASE[value - FIRST_LENGTH_CODE_INDEX] << 16u);
+    }
+    tree->table_litlen[i] = entry;
+  }
+  return 0;
+}
+
 /*
 returns the code. The bit reader must already have been ensured at least 15 bits
 */
@@ -1115,7 +1583,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
   if(reader->bitsize - reader->bp < 14) return 49; /*error: the bit pointer is or will go past the memory*/
-  ensureBits17(reader, 14);
+  ensureBits32(reader, 14);
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
   HLIT =  readBits(reader, 5) + 257;
@@ -1135,7 +1603,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       ERROR_BREAK(50); /*error: the bit pointer is or will go past the memory*/
     }
     for(i = 0; i != HCLEN; ++i) {
-      ensureBits9(reader, 3); /*out of bounds already checked above */
+      ensureBits32(reader, 3); /*out of bounds already checked above */
       bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
     }
     for(i = HCLEN; i != NUM_CODE_LENGTH_CODES; ++i) {
@@ -1156,7 +1624,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST) {
       unsigned code;
-      ensureBits25(reader, 22); /* up to 15 bits for huffman code, up to 7 extra bits below*/
+      ensureBits32(reader, 22); /* up to 15 bits for huffman code, up to 7 extra bits below*/
       code = huffmanDecodeSymbol(reader, &tree_cl);
       if(code <= 15) /*a length code*/ {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1234,57 +1702,161 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
-static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
-                                    unsigned btype, size_t max_output_size) {
+/*amount of bytes that must be allocated after the end of the output while inflating a huffman block: at least
+258 for max length, a few extra for adding a few extra literals, and 16 for the overshoot of inflateCopyMatch*/
+static const size_t INFLATE_RESERVED_SIZE = 276;
+
+/*
+copies the length bytes that start distance bytes before out into out, handling overlap as deflate requires
+(a match can repeat bytes that it produced itself). Copies in chunks of 16 bytes, so may write up to 15 bytes
+beyond out + length, the caller must have allocated those.
+*/
+static LODEPNG_INLINE void inflateCopyMatch(unsigned char* out, size_t distance, size_t length) {
+  const unsigned char* in = out - distance;
+  unsigned char* end = out + length;
+  if(distance == 1) {
+    /*run of a single byte: pattern fill*/
+    lodepng_memset(out, in[0], length);
+    return;
+  }
+  if(distance < 8) {
+    /*short distance: the pattern repeats with distance, so also with a multiple of distance of at least 8.
+    Produce that many bytes one by one, after that chunks can be copied from that multiple back*/
+    size_t period = distance * ((8u + distance - 1u) / distance);
+    size_t i;
+    for(i = 0; i < period && i < length; ++i) out[i] = in[i];
+    if(i == length) return;
+    out += period;
+    in = out - period;
+  }
+  /*source and destination of each 8-byte chunk don't overlap because the distance is at least 8, and chunks that
+  read bytes written by this match read them after they were written*/
+  while(out < end) {
+    lodepng_memcpy(out, in, 8);
+    lodepng_memcpy(out + 8, in + 8, 8);
+    out += 16;
+    in += 16;
+  }
+}
+
+/*the maximum amount of input bits that inflateHuffmanBlock uses for one symbol: up to FIRSTBITS bits of literals,
+a literal/length code with 5 extra bits and a distance code with 13 extra bits. Rounded up to a multiple of 8.*/
+static const size_t INFLATE_SYMBOL_MAX_BITS = 64;
+
+/*the maximum amount of input bits of a block header, including the code lengths of a dynamic block: 3 header bits,
+14 bits for HLIT, HDIST and HCLEN, 19 3-bit code length code lengths, then at most 320 code lengths of at most 7
+bits with at most 7 extra bits each. Also enough for the byte alignment and LEN and NLEN of a stored block.*/
+static const size_t INFLATE_HEADER_MAX_BITS = 4560;
+
+/*what an Inflater expects next*/
+#define INFLATE_BLOCK_START 0u /*the header of a block*/
+#define INFLATE_HUFFMAN 1u /*symbols of a block with fixed or dynamic huffman tree*/
+#define INFLATE_STORED 2u /*literal data of a stored block*/
+#define INFLATE_DONE 3u /*nothing: the last block is finished*/
+
+/*
+State of an inflate that can be paused when it runs out of input, and continued once more input is available.
+Used with inflateResume. The output must be kept between calls, or at least its last 32768 bytes which back
+references can refer to.
+*/
+typedef struct Inflater {
+  unsigned mode; /*one of the INFLATE_ values above*/
+  unsigned bfinal; /*whether the current block is the last one*/
+  size_t stored_left; /*amount of bytes still to come in a stored block*/
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes of the current block*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes of the current block*/
+  size_t pause_size; /*inflate pauses once the output reaches this size, to let the caller use it first*/
+  unsigned end_at_block; /*if 1, the input may also end at a block boundary, for a segment that ends with a flush*/
+} Inflater;
+
+static void Inflater_init(Inflater* inflater) {
+  inflater->mode = INFLATE_BLOCK_START;
+  inflater->bfinal = 0;
+  inflater->stored_left = 0;
+  inflater->pause_size = (size_t)(-1);
+  inflater->end_at_block = 0;
+  HuffmanTree_init(&inflater->tree_ll);
+  HuffmanTree_init(&inflater->tree_d);
+}
+
+static void Inflater_cleanup(Inflater* inflater) {
+  HuffmanTree_cleanup(&inflater->tree_ll);
+  HuffmanTree_cleanup(&inflater->tree_d);
+}
+
+/*
+inflate the symbols of a block with dynamic or fixed Huffman tree, until its end code, which sets *done to 1.
+If final is 0, the input is not complete yet: then this returns before a symbol for which possibly not enough
+input is available, leaving *done at 0, and can be continued from there once more input is available. It also
+returns early like that once the output reaches the pause size of the inflater.
+*/
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader, const Inflater* inflater,
+                                    size_t max_output_size, unsigned final, unsigned* done) {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  const size_t reserved_size = 260; /* must be at least 258 for max length, and a few extra for adding a few extra literals */
-  int done = 0;
+  const size_t reserved_size = INFLATE_RESERVED_SIZE;
+  const HuffmanTree* tree_ll = &inflater->tree_ll;
+  const HuffmanTree* tree_d = &inflater->tree_d;
 
   if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-
-  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
-  else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
-
-
-  while(!error && !done) /*decode all symbols until end reached, breaks at end code*/ {
-    /*code_ll is literal, length or end code*/
-    unsigned code_ll;
-    /* ensure enough bits for 2 huffman code reads (15 bits each): if the first is a literal, a second literal is read at once. This
-    appears to be slightly faster, than ensuring 20 bits here for 1 huffman symbol and the potential 5 extra bits for the length symbol.*/
-    ensureBits32(reader, 30);
-    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
-    if(code_ll <= 255) {
-      /*slightly faster code path if multiple literals in a row*/
-      out->data[out->size++] = (unsigned char)code_ll;
-      code_ll = huffmanDecodeSymbol(reader, &tree_ll);
-    }
-    if(code_ll <= 255) /*literal symbol*/ {
-      out->data[out->size++] = (unsigned char)code_ll;
-    } else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/ {
+  while(!error && !*done) /*decode all symbols until end reached, breaks at end code*/ {
+    unsigned entry, kind;
+    size_t length = 0;
+    unsigned numextrabits_l = 0; /*extra bits for length*/
+    if(!final && reader->bitsize - reader->bp < INFLATE_SYMBOL_MAX_BITS) break; /*wait for more input*/
+    if(out->size >= inflater->pause_size) break;
+    /* ensure enough bits for up to FIRSTBITS bits of literals, followed by a huffman code read (15 bits) and the
+    potential 5 extra bits of a length symbol, so that a run of literals followed by a length needs one refill*/
+    ensureBits32(reader, 29);
+    entry = tree_ll->table_litlen[peekBits(reader, FIRSTBITS)];
+    kind = (entry >> 4u) & 3u;
+    if(kind == LITLEN_ONE_LITERAL || kind == LITLEN_TWO_LITERALS) {
+      /*faster code path if multiple literals in a row. Writing the second byte even if only one literal is
+      decoded is fine thanks to the reserved size, it is overwritten later*/
+      out->data[out->size] = (unsigned char)(entry >> 8u);
+      out->data[out->size + 1] = (unsigned char)(entry >> 16u);
+      out->size += kind;
+      advanceBits(reader, entry & 15u);
+      entry = tree_ll->table_litlen[peekBits(reader, FIRSTBITS)];
+      kind = (entry >> 4u) & 3u;
+    }
+    if(kind == LITLEN_ONE_LITERAL || kind == LITLEN_TWO_LITERALS) {
+      out->data[out->size] = (unsigned char)(entry >> 8u);
+      out->data[out->size + 1] = (unsigned char)(entry >> 16u);
+      out->size += kind;
+      advanceBits(reader, entry & 15u);
+    } else if(kind == LITLEN_LENGTH) {
+      advanceBits(reader, entry & 15u);
+      length = entry >> 16u;
+      numextrabits_l = (entry >> 8u) & 255u;
+    } else {
+      /*code_ll is literal, length or end code*/
+      unsigned code_ll = huffmanDecodeSymbol(reader, tree_ll);
+      if(code_ll <= 255) /*literal symbol*/ {
+        out->data[out->size++] = (unsigned char)code_ll;
+      } else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/ {
+        length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+        numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
+      } else if(code_ll == 256) {
+        *done = 1; /*end code, finish the loop*/
+      } else /*if(code_ll == INVALIDSYMBOL)*/ {
+        ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
+      }
+    }
+    if(length) {
       unsigned code_d, distance;
-      unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, backward, length;
-
-      /*part 1: get length base*/
-      length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+      unsigned numextrabits_d; /*extra bits for distance*/
+      size_t start;
 
-      /*part 2: get extra bits and add the value of that to length*/
-      numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
+      /*part 1: get extra bits and add the value of that to length, the length base is already known*/
       if(numextrabits_l != 0) {
         /* bits already ensured above */
-        ensureBits25(reader, 5);
         length += readBits(reader, numextrabits_l);
       }
 
-      /*part 3: get distance code*/
+      /*part 2: get distance code*/
       ensureBits32(reader, 28); /* up to 15 for the huffman symbol, up to 13 for the extra bits */
-      code_d = huffmanDecodeSymbol(reader, &tree_d);
+      code_d = huffmanDecodeSymbol(reader, tree_d);
       if(code_d > 29) {
         if(code_d <= 31) {
           ERROR_BREAK(18); /*error: invalid distance code (30-31 are never used)*/
@@ -1294,33 +1866,19 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
       }
       distance = DISTANCEBASE[code_d];
 
-      /*part 4: get extra bits from distance*/
+      /*part 3: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
       if(numextrabits_d != 0) {
         /* bits already ensured above */
         distance += readBits(reader, numextrabits_d);
       }
 
-      /*part 5: fill in all the out[n] values based on the length and dist*/
+      /*part 4: fill in all the out[n] values based on the length and dist*/
       start = out->size;
       if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
 
       out->size += length;
-      if(distance < length) {
-        size_t forward;
-        lodepng_memcpy(out->data + start, out->data + backward, distance);
-        start += distance;
-        for(forward = distance; forward < length; ++forward) {
-          out->data[start++] = out->data[backward++];
-        }
-      } else {
-        lodepng_memcpy(out->data + start, out->data + backward, length);
-      }
-    } else if(code_ll == 256) {
-      done = 1; /*end code, finish the loop*/
-    } else /*if(code_ll == INVALIDSYMBOL)*/ {
-      ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
+      inflateCopyMatch(out->data + start, distance, length);
     }
     if(out->allocsize - out->size < reserved_size) {
       if(!ucvector_reserve(out, out->size + reserved_size)) ERROR_BREAK(83); /*alloc fail*/
@@ -1337,23 +1895,21 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader,
-                                     const LodePNGDecompressSettings* settings) {
+/*reads LEN and NLEN of a stored block, the 3 header bits must already have been read*/
+static unsigned inflateNoCompressionHeader(size_t* len, LodePNGBitReader* reader,
+                                           const LodePNGDecompressSettings* settings) {
   size_t bytepos;
   size_t size = reader->size;
-  unsigned LEN, NLEN, error = 0;
+  unsigned LEN, NLEN;
 
   /*go to first boundary of byte*/
   bytepos = (reader->bp + 7u) >> 3u;
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(bytepos + 4 >= size) return 52; /*error, bit pointer will jump past memory*/
+  if(bytepos + 4 > size) return 52; /*error, bit pointer will jump past memory*/
   LEN = (unsigned)reader->data[bytepos] + ((unsigned)reader->data[bytepos + 1] << 8u); bytepos += 2;
   NLEN = (unsigned)reader->data[bytepos] + ((unsigned)reader->data[bytepos + 1] << 8u); bytepos += 2;
 
@@ -1362,44 +1918,103 @@ static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader,
     return 21; /*error: NLEN is not one's complement of LEN*/
   }
 
-  if(!ucvector_resize(out, out->size + LEN)) return 83; /*alloc fail*/
+  *len = LEN;
+  reader->bp = bytepos << 3u;
+  return 0;
+}
+
+/*copies the literal data of a stored block, or if final is 0 and not all of it is available yet, the part
+that is, up to the pause size of the inflater. *len is the amount of bytes that is still to come.*/
+static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader, size_t* len,
+                                     size_t pause_size, unsigned final) {
+  size_t bytepos = reader->bp >> 3u;
+  size_t amount = *len;
+
+  if(bytepos + amount > reader->size) {
+    if(final) return 23; /*error: reading outside of in buffer*/
+    amount = reader->size - bytepos;
+  }
+  if(out->size + amount > pause_size) amount = out->size < pause_size ? pause_size - out->size : 0;
 
-  /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(bytepos + LEN > size) return 23; /*error: reading outside of in buffer*/
+  if(!ucvector_resize(out, out->size + amount)) return 83; /*alloc fail*/
 
   /*out->data can be NULL (when LEN is zero), and arithmetics on NULL ptr is undefined*/
-  if (LEN) {
-    lodepng_memcpy(out->data + out->size - LEN, reader->data + bytepos, LEN);
-    bytepos += LEN;
+  if(amount) {
+    lodepng_memcpy(out->data + out->size - amount, reader->data + bytepos, amount);
+    bytepos += amount;
   }
 
+  *len -= amount;
   reader->bp = bytepos << 3u;
 
+  return 0;
+}
+
+/*
+Inflates from the reader into out until the last block is finished, which sets inflater->mode to INFLATE_DONE.
+If final is 0, the input in the reader is not complete yet: then this may return without error before it's done,
+with the reader at the point from where to continue once more input is available. It also returns without
+error before it's done when the output reached inflater->pause_size, then it can be called again with the same
+input once the caller used the output.
+*/
+static unsigned inflateResume(Inflater* inflater, ucvector* out, LodePNGBitReader* reader,
+                              const LodePNGDecompressSettings* settings, unsigned final) {
+  unsigned error = 0;
+
+  while(!error && inflater->mode != INFLATE_DONE) {
+    if(inflater->mode == INFLATE_BLOCK_START) {
+      unsigned BTYPE;
+      if(inflater->end_at_block && reader->bp == reader->bitsize) break; /*the segment is done*/
+      if(!final && reader->bitsize - reader->bp < INFLATE_HEADER_MAX_BITS) break; /*wait for more input*/
+      if(reader->bitsize - reader->bp < 3) return 52; /*error, bit pointer will jump past memory*/
+      ensureBits32(reader, 3);
+      inflater->bfinal = readBits(reader, 1);
+      BTYPE = readBits(reader, 2);
+
+      if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+      else if(BTYPE == 0) {
+        /*no compression*/
+        error = inflateNoCompressionHeader(&inflater->stored_left, reader, settings);
+        inflater->mode = INFLATE_STORED;
+      } else {
+        /*compression, BTYPE 01 or 10*/
+        HuffmanTree_cleanup(&inflater->tree_ll);
+        HuffmanTree_cleanup(&inflater->tree_d);
+        HuffmanTree_init(&inflater->tree_ll);
+        HuffmanTree_init(&inflater->tree_d);
+        if(BTYPE == 1) error = getTreeInflateFixed(&inflater->tree_ll, &inflater->tree_d);
+        else /*if(BTYPE == 2)*/ error = getTreeInflateDynamic(&inflater->tree_ll, &inflater->tree_d, reader);
+        if(!error) error = HuffmanTree_makeLitLenTable(&inflater->tree_ll);
+        inflater->mode = INFLATE_HUFFMAN;
+      }
+    } else if(inflater->mode == INFLATE_HUFFMAN) {
+      unsigned done = 0;
+      error = inflateHuffmanBlock(out, reader, inflater, settings->max_output_size, final, &done);
+      if(!error && !done) break; /*wait for more input*/
+      inflater->mode = inflater->bfinal ? INFLATE_DONE : INFLATE_BLOCK_START;
+    } else /*if(inflater->mode == INFLATE_STORED)*/ {
+      error = inflateNoCompression(out, reader, &inflater->stored_left, inflater->pause_size, final);
+      if(!error && inflater->stored_left) break; /*wait for more input*/
+      inflater->mode = inflater->bfinal ? INFLATE_DONE : INFLATE_BLOCK_START;
+    }
+    if(!error && settings->max_output_size && out->size > settings->max_output_size) error = 109;
+  }
+
   return error;
 }
 
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings) {
-  unsigned BFINAL = 0;
+  Inflater inflater;
   LodePNGBitReader reader;
   unsigned error = LodePNGBitReader_init(&reader, in, insize);
 
   if(error) return error;
 
-  while(!BFINAL) {
-    unsigned BTYPE;
-    if(reader.bitsize - reader.bp < 3) return 52; /*error, bit pointer will jump past memory*/
-    ensureBits9(&reader, 3);
-    BFINAL = readBits(&reader, 1);
-    BTYPE = readBits(&reader, 2);
-
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, settings); /*no compression*/
-    else error = inflateHuffmanBlock(out, &reader, BTYPE, settings->max_output_size); /*compression, BTYPE 01 or 10*/
-    if(!error && settings->max_output_size && out->size > settings->max_output_size) error = 109;
-    if(error) break;
-  }
+  Inflater_init(&inflater);
+  error = inflateResume(&inflater, out, &reader, settings, 1);
+  Inflater_cleanup(&inflater);
 
   return error;
 }
@@ -1441,22 +2056,6 @@ static unsigned inflatev(ucvector* out, const unsigned char* in, size_t insize,
 
 static const unsigned MAX_SUPPORTED_DEFLATE_LENGTH = 258;
 
-/*search the index in the array, that has the largest value smaller than or equal to the given value,
-given array must be sorted (if no value is smaller, it returns the size of the given array)*/
-static size_t searchCodeIndex(const unsigned* array, size_t array_size, size_t value) {
-  /*binary search (only small gain over linear). TODO: use CPU log2 instruction for getting symbols instead*/
-  size_t left = 1;
-  size_t right = array_size - 1;
-
-  while(left <= right) {
-    size_t mid = (left + right) >> 1;
-    if(array[mid] >= value) right = mid - 1;
-    else left = mid + 1;
-  }
-  if(left >= array_size || array[left] > value) left--;
-  return left;
-}
-
 static void addLengthDistance(uivector* values, size_t length, size_t distance) {
   /*values in encoded vector are those used by deflate:
   0-255: literal bytes
@@ -1464,14 +2063,29 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
   257-285: length/distance pair (length code, followed by extra length bits, distance code, extra distance bits)
   286-287: invalid*/
 
-  unsigned length_code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
-  unsigned extra_length = (unsigned)(length - LENGTHBASE[length_code]);
-  unsigned dist_code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
-  unsigned extra_distance = (unsigned)(distance - DISTANCEBASE[dist_code]);
-
+  unsigned length_code, dist_code, extra_length, extra_distance, x, b;
   size_t pos = values->size;
   /*TODO: return error when this fails (out of memory)*/
   unsigned ok = uivector_resize(values, values->size + 4);
+
+  /*the codes from the binary logarithm instead of searching LENGTHBASE and DISTANCEBASE: past the first codes that
+  have no extra bits, each power of two has four length codes and two distance codes*/
+  if(length == 258) length_code = 28;
+  else if(length < 11) length_code = (unsigned)length - 3u;
+  else {
+    x = (unsigned)length - 3u;
+    b = (unsigned)ilog2(x);
+    length_code = 4u * (b - 1u) + ((x >> (b - 2u)) & 3u);
+  }
+  if(distance <= 4) dist_code = (unsigned)distance - 1u;
+  else {
+    x = (unsigned)distance - 1u;
+    b = (unsigned)ilog2(x);
+    dist_code = 2u * b + ((x >> (b - 1u)) & 1u);
+  }
+  extra_length = (unsigned)(length - LENGTHBASE[length_code]);
+  extra_distance = (unsigned)(distance - DISTANCEBASE[dist_code]);
+
   if(ok) {
     values->data[pos + 0] = length_code + FIRST_LENGTH_CODE_INDEX;
     values->data[pos + 1] = extra_length;
@@ -1586,11 +2200,9 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching) {
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching, unsigned maxchainlength) {
   size_t pos;
   unsigned i, error = 0;
-  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8u;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1733,52 +2345,224 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
-/* /////////////////////////////////////////////////////////////////////////// */
-
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
-  /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
-  2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
-
-  size_t i, numdeflateblocks = (datasize + 65534u) / 65535u;
-  size_t datapos = 0;
-  for(i = 0; i != numdeflateblocks; ++i) {
-    unsigned BFINAL, BTYPE, LEN, NLEN;
-    unsigned char firstbyte;
-    size_t pos = out->size;
+/*4 bytes of data get hashed to 16 bits for the single-probe match finder, multiplying mixes all of them in*/
+static LODEPNG_INLINE unsigned getHash4(const unsigned char* data) {
+  unsigned value = data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u);
+  return ((value * 2654435761u) & 0xffffffffu) >> 16u;
+}
 
-    BFINAL = (i == numdeflateblocks - 1);
-    BTYPE = 0;
+/*Finds a match at pos with the last earlier position with the same hash, and puts pos in its place in the table.
+The table has the positions modulo windowsize, so the offset may not be the right one if that position is older
+than the window, but the bytes are compared anyway.*/
+static LODEPNG_INLINE unsigned findMatchFast(int* head, const unsigned char* in, size_t pos, size_t insize,
+                                             unsigned windowsize, unsigned* offset) {
+  unsigned hashval, length = 0;
+  int candidate;
+  if(pos + 4 > insize) return 0;
+  hashval = getHash4(&in[pos]);
+  candidate = head[hashval];
+  head[hashval] = (int)(pos & (windowsize - 1));
+  if(candidate >= 0) {
+    unsigned distance = (unsigned)((pos - (size_t)candidate) & (windowsize - 1));
+    if(distance != 0 && distance <= pos) {
+      const unsigned char* fore = &in[pos];
+      const unsigned char* back = fore - distance;
+      unsigned max = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos) : MAX_SUPPORTED_DEFLATE_LENGTH;
+      while(length != max && back[length] == fore[length]) ++length;
+      *offset = distance;
+    }
+  }
+  return length;
+}
 
-    LEN = 65535;
-    if(datasize - datapos < 65535u) LEN = (unsigned)datasize - (unsigned)datapos;
-    NLEN = 65535 - LEN;
+/*
+LZ77 with a single-probe hash table and no chains, for the fastest compression levels: each position is only
+compared with the last earlier position of the same 4-byte hash, and its match is used as is, without lazy
+matching. Matches are at least 4 long, since a hash of 4 bytes can't find those of 3. The positions inside matches
+also go in the table, but only for matches up to nicematch long, since that takes time on the long runs of PNGs.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                               unsigned windowsize, unsigned nicematch) {
+  size_t pos = inpos, i;
+  unsigned length, offset = 0;
 
-    if(!ucvector_resize(out, out->size + LEN + 5)) return 83; /*alloc fail*/
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
-    firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1u) << 1u) + ((BTYPE & 2u) << 1u));
-    out->data[pos + 0] = firstbyte;
-    out->data[pos + 1] = (unsigned char)(LEN & 255);
-    out->data[pos + 2] = (unsigned char)(LEN >> 8u);
-    out->data[pos + 3] = (unsigned char)(NLEN & 255);
-    out->data[pos + 4] = (unsigned char)(NLEN >> 8u);
-    lodepng_memcpy(out->data + pos + 5, data + datapos, LEN);
-    datapos += LEN;
+  while(pos < insize) {
+    length = findMatchFast(hash->head, in, pos, insize, windowsize, &offset);
+    if(length < 4) {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    } else {
+      addLengthDistance(out, length, offset);
+      if(length <= nicematch) {
+        for(i = pos + 1; i != pos + length && i + 4 <= insize; ++i) {
+          hash->head[getHash4(&in[i])] = (int)(i & (windowsize - 1));
+        }
+      }
+      pos += length;
+    }
   }
+  return 0;
+}
 
+/*
+LZ77 that only looks for runs, for the rle setting: each position is only compared with the byte before it, a match
+at distance 1, and with the byte rowdistance before it if that isn't 0, such as the same byte of the scanline above
+in PNG data. That finds the runs of images with flat areas, such as screen captures, much faster than the hash
+search. The longer of the two matches is used if it's at least 3 long.
+*/
+static unsigned encodeLZ77RLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                              size_t rowdistance) {
+  size_t pos = inpos;
+  if(rowdistance > 32768 || rowdistance == 1) rowdistance = 0; /*too far back for deflate, or the same as a run*/
+
+  while(pos < insize) {
+    size_t max = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? insize - pos : MAX_SUPPORTED_DEFLATE_LENGTH;
+    size_t length = 0, rowlength = 0;
+    const unsigned char* fore = &in[pos];
+    if(pos != 0) {
+      unsigned char value = fore[-1];
+      while(length != max && fore[length] == value) ++length;
+    }
+    if(rowdistance != 0 && pos >= rowdistance && length != max) {
+      const unsigned char* back = fore - rowdistance;
+      while(rowlength != max && back[rowlength] == fore[rowlength]) ++rowlength;
+    }
+    if(rowlength > length && rowlength >= 3) {
+      addLengthDistance(out, rowlength, rowdistance);
+      pos += rowlength;
+    } else if(length >= 3) {
+      addLengthDistance(out, length, 1);
+      pos += length;
+    } else {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
   return 0;
 }
 
 /*
-write the lz77-encoded data, which has lit, len and dist codes, to compressed stream using huffman trees.
-tree_ll: the tree for lit and len codes.
-tree_d: the tree for distance codes.
+The zlib style compression levels 1-9 of LodePNGCompressSettings: windowsize, minmatch, nicematch, lazymatching
+and the maximum hash chain length. Level 1 has no chains but uses encodeLZ77Fast. Each level is slower and smaller
+than the one below it: on PNG data, following a longer chain gains more than lazy matching does for the same time,
+so lazy matching is only used where the chains are so long that they hardly gain more.
 */
-static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded,
-                          const HuffmanTree* tree_ll, const HuffmanTree* tree_d) {
+static const unsigned COMPRESSION_LEVELS[9][5] = {
+  {32768, 4, 258, 0, 0},
+  {32768, 4, 258, 0, 16},
+  {32768, 4, 258, 0, 32},
+  {32768, 4, 258, 0, 64},
+  {32768, 4, 258, 0, 128},
+  {32768, 4, 258, 0, 256},
+  {32768, 4, 258, 0, 512},
+  {32768, 4, 258, 1, 256},
+  {32768, 4, 258, 1, 1024}
+};
+
+/*LZ77-encodes with the settings, whose level, if not 0, already replaced the LZ77 settings with its own*/
+static unsigned encodeLZ77Settings(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                                   const LodePNGCompressSettings* settings) {
+  /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
+  unsigned maxchainlength = settings->windowsize >= 8192 ? settings->windowsize : settings->windowsize / 8u;
+  if(settings->rle) return encodeLZ77RLE(out, in, inpos, insize, settings->rle_distance);
+  if(settings->level) {
+    maxchainlength = COMPRESSION_LEVELS[settings->level - 1][4];
+    if(maxchainlength == 0) {
+      return encodeLZ77Fast(out, hash, in, inpos, insize, settings->windowsize, settings->nicematch);
+    }
+  }
+  return encodeLZ77(out, hash, in, inpos, insize, settings->windowsize, settings->minmatch, settings->nicematch,
+                    settings->lazymatching, maxchainlength);
+}
+
+/*puts the positions in[dictstart..inpos) in the hash the way the LZ77 encoder of the settings does, so that the
+data from inpos on can refer back to them*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t dictstart, size_t inpos, size_t insize,
+                       const LodePNGCompressSettings* settings) {
+  unsigned windowsize = settings->windowsize;
+  unsigned hashval, numzeros = 0;
+  size_t pos;
+
+  /*an invalid windowsize gives its error when encoding*/
+  if(windowsize == 0 || windowsize > 32768 || (windowsize & (windowsize - 1)) != 0) return;
+
+  if(settings->level && COMPRESSION_LEVELS[settings->level - 1][4] == 0) {
+    for(pos = dictstart; pos != inpos && pos + 4 <= insize; ++pos) {
+      hash->head[getHash4(&in[pos])] = (int)(pos & (windowsize - 1));
+    }
+    return;
+  }
+  for(pos = dictstart; pos != inpos; ++pos) {
+    hashval = getHash(in, insize, pos);
+    if(hashval == 0) {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    } else {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
+/* /////////////////////////////////////////////////////////////////////////// */
+
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final) {
+  /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
+  2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
+
+  size_t i, numdeflateblocks = (datasize + 65534u) / 65535u;
+  size_t datapos = 0;
+  if(numdeflateblocks == 0) numdeflateblocks = 1; /*empty data still needs a (final) block*/
+  for(i = 0; i != numdeflateblocks; ++i) {
+    unsigned BFINAL, BTYPE, LEN, NLEN;
+    unsigned char firstbyte;
+    size_t pos = out->size;
+
+    BFINAL = final && (i == numdeflateblocks - 1);
+    BTYPE = 0;
+
+    LEN = 65535;
+    if(datasize - datapos < 65535u) LEN = (unsigned)datasize - (unsigned)datapos;
+    NLEN = 65535 - LEN;
+
+    if(!ucvector_resize(out, out->size + LEN + 5)) return 83; /*alloc fail*/
+
+    firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1u) << 1u) + ((BTYPE & 2u) << 1u));
+    out->data[pos + 0] = firstbyte;
+    out->data[pos + 1] = (unsigned char)(LEN & 255);
+    out->data[pos + 2] = (unsigned char)(LEN >> 8u);
+    out->data[pos + 3] = (unsigned char)(NLEN & 255);
+    out->data[pos + 4] = (unsigned char)(NLEN >> 8u);
+    lodepng_memcpy(out->data + pos + 5, data + datapos, LEN);
+    datapos += LEN;
+  }
+
+  return 0;
+}
+
+/*
+Reverses the bits of the codes of a tree made for encoding. Deflate stores huffman codes MSB first, while writeBits
+writes LSB first, so reversed this way each code is written with a single writeBits.
+*/
+static void HuffmanTree_reverseCodes(HuffmanTree* tree) {
+  unsigned i;
+  for(i = 0; i != tree->numcodes; ++i) tree->codes[i] = reverseBits(tree->codes[i], tree->lengths[i]);
+}
+
+/*
+write the lz77-encoded data, which has lit, len and dist codes, to compressed stream using huffman trees.
+tree_ll: the tree for lit and len codes.
+tree_d: the tree for distance codes.
+The codes of both trees must be reversed with HuffmanTree_reverseCodes.
+*/
+static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded,
+                          const HuffmanTree* tree_ll, const HuffmanTree* tree_d) {
   size_t i = 0;
   for(i = 0; i != lz77_encoded->size; ++i) {
     unsigned val = lz77_encoded->data[i];
-    writeBitsReversed(writer, tree_ll->codes[val], tree_ll->lengths[val]);
     if(val > 256) /*for a length code, 3 more things have to be added*/ {
       unsigned length_index = val - FIRST_LENGTH_CODE_INDEX;
       unsigned n_length_extra_bits = LENGTHEXTRA[length_index];
@@ -1790,13 +2574,33 @@ static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded
       unsigned n_distance_extra_bits = DISTANCEEXTRA[distance_index];
       unsigned distance_extra_bits = lz77_encoded->data[++i];
 
-      writeBits(writer, length_extra_bits, n_length_extra_bits);
-      writeBitsReversed(writer, tree_d->codes[distance_code], tree_d->lengths[distance_code]);
-      writeBits(writer, distance_extra_bits, n_distance_extra_bits);
+      /*each code together with its extra bits, at most 15 + 5 and 15 + 13 bits*/
+      writeBits(writer, tree_ll->codes[val] | (length_extra_bits << tree_ll->lengths[val]),
+                tree_ll->lengths[val] + n_length_extra_bits);
+      writeBits(writer, tree_d->codes[distance_code] | (distance_extra_bits << tree_d->lengths[distance_code]),
+                tree_d->lengths[distance_code] + n_distance_extra_bits);
+    } else {
+      writeBits(writer, tree_ll->codes[val], tree_ll->lengths[val]);
     }
   }
 }
 
+/*
+the amount of bits writeLZ77data writes for the lz77-encoded data with these frequencies of lit, len and dist codes,
+to reserve the output for it at once
+*/
+static size_t lz77DataBits(const unsigned* frequencies_ll, const unsigned* frequencies_d,
+                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d) {
+  size_t i, result = 0;
+  /*the trees have no codes for the trimmed symbols with frequency 0 at the end*/
+  for(i = 0; i != tree_ll->numcodes; ++i) {
+    unsigned extra = i > 256 ? LENGTHEXTRA[i - FIRST_LENGTH_CODE_INDEX] : 0;
+    result += (size_t)frequencies_ll[i] * (tree_ll->lengths[i] + extra);
+  }
+  for(i = 0; i != tree_d->numcodes; ++i) result += (size_t)frequencies_d[i] * (tree_d->lengths[i] + DISTANCEEXTRA[i]);
+  return result;
+}
+
 /*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
 static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
                                const unsigned char* data, size_t datapos, size_t dataend,
@@ -1859,8 +2663,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
     if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77Settings(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     } else {
       if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
@@ -1885,6 +2688,8 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     /*2, not 1, is chosen for mincodes: some buggy PNG decoders require at least 2 symbols in the dist tree*/
     error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d, 2, 30, 15);
     if(error) break;
+    HuffmanTree_reverseCodes(&tree_ll);
+    HuffmanTree_reverseCodes(&tree_d);
 
     numcodes_ll = LODEPNG_MIN(tree_ll.numcodes, 286);
     numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
@@ -1946,6 +2751,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     error = HuffmanTree_makeFromFrequencies(&tree_cl, frequencies_cl,
                                             NUM_CODE_LENGTH_CODES, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
+    HuffmanTree_reverseCodes(&tree_cl);
 
     /*compute amount of code-length-code-lengths to output*/
     numcodes_cl = NUM_CODE_LENGTH_CODES;
@@ -1988,20 +2794,24 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
 
     /*write the lengths of the lit/len AND the dist alphabet*/
     for(i = 0; i != numcodes_lld_e; ++i) {
-      writeBitsReversed(writer, tree_cl.codes[bitlen_lld_e[i]], tree_cl.lengths[bitlen_lld_e[i]]);
+      writeBits(writer, tree_cl.codes[bitlen_lld_e[i]], tree_cl.lengths[bitlen_lld_e[i]]);
       /*extra bits of repeat codes*/
       if(bitlen_lld_e[i] == 16) writeBits(writer, bitlen_lld_e[++i], 2);
       else if(bitlen_lld_e[i] == 17) writeBits(writer, bitlen_lld_e[++i], 3);
       else if(bitlen_lld_e[i] == 18) writeBits(writer, bitlen_lld_e[++i], 7);
     }
 
-    /*write the compressed data symbols*/
+    /*write the compressed data symbols, with the output reserved for all of them*/
+    if(!ucvector_reserve(writer->data, writer->data->size +
+                         (lz77DataBits(frequencies_ll, frequencies_d, &tree_ll, &tree_d) >> 3u) + 8u)) {
+      ERROR_BREAK(83); /*alloc fail*/
+    }
     writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(tree_ll.lengths[256] == 0) ERROR_BREAK(64);
 
     /*write the end code*/
-    writeBitsReversed(writer, tree_ll.codes[256], tree_ll.lengths[256]);
+    writeBits(writer, tree_ll.codes[256], tree_ll.lengths[256]);
 
     break; /*end of error-while*/
   }
@@ -2038,6 +2848,8 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   if(!error) error = generateFixedDistanceTree(&tree_d);
 
   if(!error) {
+    HuffmanTree_reverseCodes(&tree_ll);
+    HuffmanTree_reverseCodes(&tree_d);
     writeBits(writer, BFINAL, 1);
     writeBits(writer, 1, 1); /*first bit of BTYPE*/
     writeBits(writer, 0, 1); /*second bit of BTYPE*/
@@ -2045,17 +2857,16 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     if(settings->use_lz77) /*LZ77 encoded*/ {
       uivector lz77_encoded;
       uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77Settings(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
       uivector_cleanup(&lz77_encoded);
     } else /*no LZ77, but still will be Huffman compressed*/ {
       for(i = datapos; i < dataend; ++i) {
-        writeBitsReversed(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
+        writeBits(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
       }
     }
     /*add END code*/
-    if(!error) writeBitsReversed(writer,tree_ll.codes[256], tree_ll.lengths[256]);
+    if(!error) writeBits(writer, tree_ll.codes[256], tree_ll.lengths[256]);
   }
 
   /*cleanup*/
@@ -2065,47 +2876,94 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*
+Ends deflate data that is not final with a full flush: an empty stored block, which pads to a byte boundary.
+Deflate data that follows it at that byte and doesn't refer back to earlier data can be inflated on its own.
+*/
+static unsigned writeFullFlush(LodePNGBitWriter* writer) {
+  ucvector* out = writer->data;
+  writeBits(writer, 0, 3); /*BFINAL 0 and BTYPE 00, the rest of the byte is padding*/
+  if(writeBitsFlush(writer)) return 83; /*alloc fail*/
+  if(!ucvector_resize(out, out->size + 4)) return 83; /*alloc fail*/
+  out->data[out->size - 4] = 0;
+  out->data[out->size - 3] = 0;
+  out->data[out->size - 2] = 255;
+  out->data[out->size - 1] = 255;
+  return 0;
+}
+
+/*
+deflates in[inpos..insize) and appends it to out. The bytes before inpos, of which up to windowsize are used, are the
+dictionary that LZ77 matches can refer back to. If final is 0, more deflate data comes after this, and it ends with
+an empty stored block, which pads it to a byte boundary, instead of with the final block.
+*/
+static unsigned deflateSegment(ucvector* out, const unsigned char* in, size_t inpos, size_t insize,
+                               const LodePNGCompressSettings* settings, unsigned final) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   Hash hash;
   LodePNGBitWriter writer;
+  LodePNGCompressSettings leveled;
 
   LodePNGBitWriter_init(&writer, out);
 
+  if(settings->level > 9) return 119;
+  if(settings->level) {
+    const unsigned* level = COMPRESSION_LEVELS[settings->level - 1];
+    leveled = *settings;
+    leveled.windowsize = level[0];
+    leveled.minmatch = level[1];
+    leveled.nicematch = level[2];
+    leveled.lazymatching = level[3];
+    settings = &leveled;
+  }
+
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  else if(settings->btype == 0) {
+    error = deflateNoCompression(out, in + inpos, insize - inpos, final);
+    if(!error && !final) error = writeFullFlush(&writer);
+    return error;
+  }
+  else if(settings->btype == 1) blocksize = insize > inpos ? insize - inpos : 1;
   else /*if(settings->btype == 2)*/ {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8u + 8;
+    blocksize = (insize - inpos) / 8u + 8;
     if(blocksize < 65536) blocksize = 65536;
     if(blocksize > 262144) blocksize = 262144;
   }
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
+  numdeflateblocks = (insize - inpos + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
   error = hash_init(&hash, settings->windowsize);
+  if(!error && inpos != 0 && !settings->rle) {
+    hash_prime(&hash, in, inpos > settings->windowsize ? inpos - settings->windowsize : 0, inpos, insize, settings);
+  }
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
+      unsigned BFINAL = final && (i == numdeflateblocks - 1);
+      size_t start = inpos + i * blocksize;
       size_t end = start + blocksize;
       if(end > insize) end = insize;
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, BFINAL);
+      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, BFINAL);
     }
   }
+  if(!error && !final) error = writeFullFlush(&writer);
+  else if(!error) error = writeBitsFlush(&writer);
 
   hash_cleanup(&hash);
 
   return error;
 }
 
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings) {
+  return deflateSegment(out, in, 0, insize, settings, 1);
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings) {
@@ -2134,10 +2992,128 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+/*The SIMD versions below add blocks of 32 bytes to the sums: s1 grows by the sum of the bytes, s2 by 32 times the
+old s1 plus the bytes weighted 32, 31, ..., 1. Up to 173 blocks (5552 bytes) fit before the sums must be reduced.*/
+#ifdef LODEPNG_SIMD_X86
+LODEPNG_TARGET("ssse3")
+static void adler32SSSE3(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned blocks) {
+  const __m128i weights0 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i weights1 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i zero = _mm_setzero_si128();
+  while(blocks != 0) {
+    unsigned n = blocks > 173u ? 173u : blocks;
+    /*the sum of the s1 values before each block, which is multiplied by 32 at the end*/
+    __m128i prev = _mm_cvtsi32_si128((int)(*s1 * n));
+    __m128i v1 = zero, v2 = _mm_cvtsi32_si128((int)*s2);
+    blocks -= n;
+    while(n--) {
+      __m128i a = _mm_loadu_si128((const __m128i*)data);
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + 16));
+      prev = _mm_add_epi32(prev, v1);
+      v1 = _mm_add_epi32(v1, _mm_add_epi32(_mm_sad_epu8(a, zero), _mm_sad_epu8(b, zero)));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(a, weights0), ones));
+      v2 = _mm_add_epi32(v2, _mm_madd_epi16(_mm_maddubs_epi16(b, weights1), ones));
+      data += 32;
+    }
+    v2 = _mm_add_epi32(v2, _mm_slli_epi32(prev, 5));
+    v1 = _mm_add_epi32(v1, _mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v2 = _mm_add_epi32(v2, _mm_shuffle_epi32(v2, _MM_SHUFFLE(1, 0, 3, 2)));
+    *s1 = (*s1 + (unsigned)_mm_cvtsi128_si32(v1)) % 65521u;
+    *s2 = (unsigned)_mm_cvtsi128_si32(v2) % 65521u;
+  }
+}
+
+LODEPNG_TARGET("avx2")
+static void adler32AVX2(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned blocks) {
+  const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                           16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i zero = _mm256_setzero_si256();
+  while(blocks != 0) {
+    unsigned n = blocks > 173u ? 173u : blocks;
+    __m256i prev = _mm256_setr_epi32((int)(*s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v1 = zero, v2 = _mm256_setr_epi32((int)*s2, 0, 0, 0, 0, 0, 0, 0);
+    __m128i h1, h2;
+    blocks -= n;
+    while(n--) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)data);
+      prev = _mm256_add_epi32(prev, v1);
+      v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(a, zero));
+      v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(a, weights), ones));
+      data += 32;
+    }
+    v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(prev, 5));
+    h1 = _mm_add_epi32(_mm256_castsi256_si128(v1), _mm256_extracti128_si256(v1, 1));
+    h2 = _mm_add_epi32(_mm256_castsi256_si128(v2), _mm256_extracti128_si256(v2, 1));
+    h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, _MM_SHUFFLE(1, 0, 3, 2)));
+    *s1 = (*s1 + (unsigned)_mm_cvtsi128_si32(h1)) % 65521u;
+    *s2 = (unsigned)_mm_cvtsi128_si32(h2) % 65521u;
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static void adler32NEON(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned blocks) {
+  static const unsigned short weights[32] = {
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+  };
+  while(blocks != 0) {
+    unsigned n = blocks > 173u ? 173u : blocks;
+    uint32x4_t prev = vsetq_lane_u32(*s1 * n, vdupq_n_u32(0), 0);
+    uint32x4_t v1 = vdupq_n_u32(0), v2;
+    /*per column sums of the bytes, which are weighted at the end. 173 * 255 fits in 16 bits.*/
+    uint16x8_t c0 = vdupq_n_u16(0), c1 = vdupq_n_u16(0), c2 = vdupq_n_u16(0), c3 = vdupq_n_u16(0);
+    uint32x2_t h;
+    blocks -= n;
+    while(n--) {
+      uint8x16_t a = vld1q_u8(data);
+      uint8x16_t b = vld1q_u8(data + 16);
+      prev = vaddq_u32(prev, v1);
+      v1 = vpadalq_u16(v1, vpadalq_u8(vpaddlq_u8(a), b));
+      c0 = vaddw_u8(c0, vget_low_u8(a));
+      c1 = vaddw_u8(c1, vget_high_u8(a));
+      c2 = vaddw_u8(c2, vget_low_u8(b));
+      c3 = vaddw_u8(c3, vget_high_u8(b));
+      data += 32;
+    }
+    v2 = vshlq_n_u32(prev, 5);
+    v2 = vmlal_u16(v2, vget_low_u16(c0), vld1_u16(weights));
+    v2 = vmlal_u16(v2, vget_high_u16(c0), vld1_u16(weights + 4));
+    v2 = vmlal_u16(v2, vget_low_u16(c1), vld1_u16(weights + 8));
+    v2 = vmlal_u16(v2, vget_high_u16(c1), vld1_u16(weights + 12));
+    v2 = vmlal_u16(v2, vget_low_u16(c2), vld1_u16(weights + 16));
+    v2 = vmlal_u16(v2, vget_high_u16(c2), vld1_u16(weights + 20));
+    v2 = vmlal_u16(v2, vget_low_u16(c3), vld1_u16(weights + 24));
+    v2 = vmlal_u16(v2, vget_high_u16(c3), vld1_u16(weights + 28));
+    h = vpadd_u32(vpadd_u32(vget_low_u32(v1), vget_high_u32(v1)), vpadd_u32(vget_low_u32(v2), vget_high_u32(v2)));
+    *s1 = (*s1 + vget_lane_u32(h, 0)) % 65521u;
+    *s2 = (*s2 + vget_lane_u32(h, 1)) % 65521u;
+  }
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
 static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
   unsigned s1 = adler & 0xffffu;
   unsigned s2 = (adler >> 16u) & 0xffffu;
 
+#ifdef LODEPNG_SIMD_X86
+  if(len >= 64u && (lodepng_cpu_features() & (LODEPNG_CPU_SSSE3 | LODEPNG_CPU_AVX2))) {
+    if(lodepng_cpu_features() & LODEPNG_CPU_AVX2) adler32AVX2(&s1, &s2, data, len / 32u);
+    else adler32SSSE3(&s1, &s2, data, len / 32u);
+    data += len & ~31u;
+    len &= 31u;
+  }
+#elif defined(LODEPNG_SIMD_NEON)
+  if(len >= 64u) {
+    adler32NEON(&s1, &s2, data, len / 32u);
+    data += len & ~31u;
+    len &= 31u;
+  }
+#endif
   while(len != 0u) {
     unsigned i;
     /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
@@ -2159,19 +3135,30 @@ static unsigned adler32(const unsigned char* data, unsigned len) {
   return update_adler32(1u, data, len);
 }
 
+#if defined(LODEPNG_USE_THREADS) || defined(LODEPNG_COMPILE_ENCODER)
+/*the adler32 of two pieces of data after each other, from the adler32 of each and the length of the second*/
+static unsigned combine_adler32(unsigned adler1, unsigned adler2, size_t len2) {
+  unsigned rem = (unsigned)(len2 % 65521u);
+  unsigned s1 = adler1 & 0xffffu;
+  unsigned s2 = (rem * s1) % 65521u; /*both are below 65521, so this doesn't overflow*/
+  /*the first sum is s1 of both minus the initial 1 of the second, the second sum also adds the first sum of the
+  first piece once per byte of the second piece*/
+  s1 += (adler2 & 0xffffu) + 65521u - 1u;
+  s2 += ((adler1 >> 16u) & 0xffffu) + ((adler2 >> 16u) & 0xffffu) + 65521u - rem;
+  return ((s2 % 65521u) << 16u) | (s1 % 65521u);
+}
+#endif /*defined(LODEPNG_USE_THREADS) || defined(LODEPNG_COMPILE_ENCODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-static unsigned lodepng_zlib_decompressv(ucvector* out,
-                                         const unsigned char* in, size_t insize,
-                                         const LodePNGDecompressSettings* settings) {
-  unsigned error = 0;
+/*checks the 2-byte zlib header at the start of in, returns error code if it can't be used for PNG*/
+static unsigned checkZlibHeader(const unsigned char* in) {
   unsigned CM, CINFO, FDICT;
 
-  if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
   if((in[0] * 256 + in[1]) % 31 != 0) {
     /*error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way*/
@@ -2194,6 +3181,18 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
     return 26;
   }
 
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out,
+                                         const unsigned char* in, size_t insize,
+                                         const LodePNGDecompressSettings* settings) {
+  unsigned error = 0;
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  error = checkZlibHeader(in);
+  if(error) return error;
+
   error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
@@ -2231,8 +3230,8 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
   } else {
     ucvector v = ucvector_init(*out, *outsize);
     if(expected_size) {
-      /*reserve the memory to avoid intermediate reallocations*/
-      ucvector_resize(&v, *outsize + expected_size);
+      /*reserve the memory to avoid intermediate reallocations, including the space inflate needs after the end*/
+      ucvector_resize(&v, *outsize + expected_size + INFLATE_RESERVED_SIZE);
       v.size = *outsize;
     }
     error = lodepng_zlib_decompressv(&v, in, insize, settings);
@@ -2246,6 +3245,124 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*writes the 2-byte zlib header*/
+static void writeZlibHeader(unsigned char* out) {
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  out[0] = (unsigned char)(CMFFLG >> 8);
+  out[1] = (unsigned char)(CMFFLG & 255);
+}
+
+/*the amount of input per segment when deflating on multiple threads with num_threads*/
+#define DEFLATE_THREAD_SEGMENT_SIZE 262144
+
+/*what the segments of zlib_compress_segmented share*/
+typedef struct SegmentDeflater {
+  const unsigned char* in;
+  size_t insize;
+  size_t segment_size;
+  unsigned use_dictionary; /*whether each segment refers back to the window of data before it*/
+  const LodePNGCompressSettings* settings;
+  ucvector* deflated; /*the deflate data of each segment*/
+  unsigned* adler; /*the adler32 of the input of each segment*/
+  unsigned* errors; /*the error of each segment*/
+} SegmentDeflater;
+
+/*deflates one segment*/
+static void deflateSegmentTask(void* context, size_t index) {
+  const SegmentDeflater* deflater = (const SegmentDeflater*)context;
+  size_t start = index * deflater->segment_size;
+  size_t size = deflater->insize - start < deflater->segment_size ? deflater->insize - start : deflater->segment_size;
+  /*the largest window deflate allows, deflateSegment uses only as much as the windowsize of the settings*/
+  size_t dictsize = !deflater->use_dictionary ? 0 : start < 32768u ? start : 32768u;
+  ucvector* out = &deflater->deflated[index];
+
+  *out = ucvector_init(NULL, 0);
+  deflater->errors[index] = deflateSegment(out, deflater->in + start - dictsize, dictsize, dictsize + size,
+                                           deflater->settings, start + size == deflater->insize);
+  deflater->adler[index] = adler32(deflater->in + start, (unsigned)size);
+}
+
+/*
+zlib compression in segments of segment_size bytes of the input (the last one can be smaller), which are deflated on
+their own, on multiple threads if num_threads in the settings allows it, and then joined. All but the last end with
+an empty stored block, which pads them to a byte boundary. Without use_dictionary the segments don't refer back to
+the ones before them, so they can also be decompressed in parallel, and offsets, if not NULL, receives the position
+of each segment in the zlib data, or nothing if that doesn't fit in 32 bits. With use_dictionary, each segment uses
+the last window of data before it, as one deflate stream would, which compresses almost as well.
+*/
+static unsigned zlib_compress_segmented(unsigned char** out, size_t* outsize, uivector* offsets,
+                                        const unsigned char* in, size_t insize, size_t segment_size,
+                                        unsigned use_dictionary, const LodePNGCompressSettings* settings) {
+  ucvector v = ucvector_init(NULL, 0);
+  unsigned error = 0, adler = 1;
+  size_t count = insize ? (insize + segment_size - 1u) / segment_size : 1u, i, size;
+  SegmentDeflater deflater;
+
+  deflater.in = in;
+  deflater.insize = insize;
+  deflater.segment_size = segment_size;
+  deflater.use_dictionary = use_dictionary;
+  deflater.settings = settings;
+  deflater.deflated = (ucvector*)lodepng_malloc(count * sizeof(ucvector));
+  deflater.adler = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+  deflater.errors = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+  if(!deflater.deflated || !deflater.adler || !deflater.errors) {
+    lodepng_free(deflater.deflated);
+    lodepng_free(deflater.adler);
+    lodepng_free(deflater.errors);
+    return 83; /*alloc fail*/
+  }
+
+#ifdef LODEPNG_USE_THREADS
+  lodepng_run_tasks(count, lodepng_get_num_threads(settings->num_threads), deflateSegmentTask, &deflater);
+#else /*LODEPNG_USE_THREADS*/
+  for(i = 0; i != count; ++i) deflateSegmentTask(&deflater, i);
+#endif /*LODEPNG_USE_THREADS*/
+
+  size = 2u + 4u;
+  for(i = 0; i != count && !error; ++i) {
+    error = deflater.errors[i];
+    size += deflater.deflated[i].size;
+  }
+  if(!error && !ucvector_reserve(&v, size)) error = 83; /*alloc fail*/
+  if(!error) {
+    v.size = 2;
+    writeZlibHeader(v.data);
+    for(i = 0; i != count && !error; ++i) {
+      if(offsets && !uivector_push_back(offsets, (unsigned)v.size)) error = 83; /*alloc fail*/
+      lodepng_memcpy(v.data + v.size, deflater.deflated[i].data, deflater.deflated[i].size);
+      v.size += deflater.deflated[i].size;
+      adler = i ? combine_adler32(adler, deflater.adler[i], i + 1u == count ? insize - i * segment_size
+                                                                            : segment_size) : deflater.adler[0];
+    }
+  }
+  if(!error) {
+    v.size += 4;
+    lodepng_set32bitInt(&v.data[v.size - 4], adler);
+    if(offsets && v.size != (unsigned)v.size) offsets->size = 0;
+  }
+
+  for(i = 0; i != count; ++i) lodepng_free(deflater.deflated[i].data);
+  lodepng_free(deflater.deflated);
+  lodepng_free(deflater.adler);
+  lodepng_free(deflater.errors);
+  if(error) {
+    lodepng_free(v.data);
+    v.data = 0;
+    v.size = 0;
+  }
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings) {
   size_t i;
@@ -2253,6 +3370,10 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
 
+  if(settings->num_threads != 1 && !settings->custom_deflate && insize > DEFLATE_THREAD_SEGMENT_SIZE) {
+    return zlib_compress_segmented(out, outsize, 0, in, insize, DEFLATE_THREAD_SEGMENT_SIZE, 1, settings);
+  }
+
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
   *out = NULL;
@@ -2265,16 +3386,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
 
   if(!error) {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-    unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-    unsigned FLEVEL = 0;
-    unsigned FDICT = 0;
-    unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-    unsigned FCHECK = 31 - CMFFLG % 31;
-    CMFFLG += FCHECK;
-
-    (*out)[0] = (unsigned char)(CMFFLG >> 8);
-    (*out)[1] = (unsigned char)(CMFFLG & 255);
+    writeZlibHeader(*out);
     for(i = 0; i != deflatesize; ++i) (*out)[i + 2] = deflatedata[i];
     lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
   }
@@ -2283,6 +3395,18 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
+/*
+zlib compression in independent segments of segment_size bytes of the input (the last one can be smaller), which can
+be decompressed in parallel: each is deflated without referring back to the ones before it, and all but the last end
+with a full flush. offsets receives the position of each segment in the zlib data, or nothing if that doesn't fit
+in 32 bits.
+*/
+static unsigned zlib_compress_segments(unsigned char** out, size_t* outsize, uivector* offsets,
+                                       const unsigned char* in, size_t insize, size_t segment_size,
+                                       const LodePNGCompressSettings* settings) {
+  return zlib_compress_segmented(out, outsize, offsets, in, insize, segment_size, 0, settings);
+}
+
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings) {
@@ -2332,13 +3456,17 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->level = 0;
+  settings->num_threads = 1;
+  settings->rle = 0;
+  settings->rle_distance = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 1, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2654,10 +3782,91 @@ static const unsigned lodepng_crc32_table7[256] = {
   0x2c8e0fffu, 0xe0240f61u, 0x6eab0882u, 0xa201081cu, 0xa8c40105u, 0x646e019bu, 0xeae10678u, 0x264b06e6u
 };
 
-/* Computes the cyclic redundancy check as used by PNG chunks*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length) {
-  /*Using the Slicing by Eight algorithm*/
-  unsigned r = 0xffffffffu;
+#ifdef LODEPNG_SIMD_X86
+/*The CRC register r updated with length bytes, where length is a multiple of 16 and at least 64. Folds 512 bits
+at a time with carry-less multiplications, then 128 bits, then reduces to 32 bits with the Barrett method, as in
+Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction". The constants are the powers
+of x modulo the bit-reflected CRC polynomial from that paper.*/
+LODEPNG_TARGET("pclmul")
+static unsigned crc32PCLMUL(unsigned r, const unsigned char* data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi32(1, (int)0xc6e41596u, 1, 0x54442bd4);
+  const __m128i k3k4 = _mm_set_epi32(0, (int)0xccaa009eu, 1, 0x751997d0);
+  const __m128i k5 = _mm_set_epi32(0, 0, 1, 0x63cd6124);
+  const __m128i poly = _mm_set_epi32(1, (int)0xf7011641u, 1, (int)0xdb710641u);
+  const __m128i mask = _mm_set_epi32(0, -1, 0, -1);
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 16));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 32));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+
+  /*four independent folds hide the latency of the multiplications*/
+  while(length >= 64) {
+    x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, k1k2, 0x00), _mm_clmulepi64_si128(x0, k1k2, 0x11)),
+                       _mm_loadu_si128((const __m128i*)data));
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), _mm_clmulepi64_si128(x1, k1k2, 0x11)),
+                       _mm_loadu_si128((const __m128i*)(data + 16)));
+    x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), _mm_clmulepi64_si128(x2, k1k2, 0x11)),
+                       _mm_loadu_si128((const __m128i*)(data + 32)));
+    x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), _mm_clmulepi64_si128(x3, k1k2, 0x11)),
+                       _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the four into one, then the remaining 16-byte blocks into that*/
+  x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x00), _mm_clmulepi64_si128(x0, k3k4, 0x11)), x1);
+  x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x00), _mm_clmulepi64_si128(x0, k3k4, 0x11)), x2);
+  x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x00), _mm_clmulepi64_si128(x0, k3k4, 0x11)), x3);
+  while(length >= 16) {
+    x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x00), _mm_clmulepi64_si128(x0, k3k4, 0x11)),
+                       _mm_loadu_si128((const __m128i*)data));
+    data += 16;
+    length -= 16;
+  }
+
+  /*128 to 64 bits, then 64 to 32 bits*/
+  x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), _mm_clmulepi64_si128(x0, k3k4, 0x10));
+  x0 = _mm_xor_si128(_mm_srli_si128(x0, 4), _mm_clmulepi64_si128(_mm_and_si128(x0, mask), k5, 0x00));
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask), poly, 0x10);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x00);
+  x0 = _mm_xor_si128(x0, x1);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_CRC_ARM
+/*The CRC register r updated with the CRC32 instructions of ARMv8, 8 bytes at a time.*/
+static unsigned crc32ARM(unsigned r, const unsigned char* data, size_t length) {
+  while(length >= 8) {
+    uint64_t word = 0;
+    unsigned i;
+    for(i = 0; i != 8; ++i) word |= (uint64_t)data[i] << (8u * i);
+    r = __crc32d(r, word);
+    data += 8;
+    length -= 8;
+  }
+  while(length--) r = __crc32b(r, *data++);
+  return r;
+}
+#endif /*LODEPNG_CRC_ARM*/
+
+/*Continues the CRC of earlier data with the next length bytes of data. Start with crc 0.*/
+static unsigned update_crc32(unsigned crc, const unsigned char* data, size_t length) {
+  /*Using the Slicing by Eight algorithm, after the hardware instructions if the CPU has them*/
+  unsigned r = crc ^ 0xffffffffu;
+#ifdef LODEPNG_SIMD_X86
+  if(length >= 64 && (lodepng_cpu_features() & LODEPNG_CPU_PCLMUL)) {
+    size_t amount = length & ~(size_t)15u;
+    r = crc32PCLMUL(r, data, amount);
+    data += amount;
+    length -= amount;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+#ifdef LODEPNG_CRC_ARM
+  r = crc32ARM(r, data, length);
+#else /*LODEPNG_CRC_ARM*/
   while(length >= 8) {
     r = lodepng_crc32_table7[(data[0] ^ (r & 0xffu))] ^
         lodepng_crc32_table6[(data[1] ^ ((r >> 8) & 0xffu))] ^
@@ -2673,8 +3882,14 @@ unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   while(length--) {
     r = lodepng_crc32_table0[(r ^ *data++) & 0xffu] ^ (r >> 8);
   }
+#endif /*LODEPNG_CRC_ARM*/
   return r ^ 0xffffffffu;
 }
+
+/* Computes the cyclic redundancy check as used by PNG chunks*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+  return update_crc32(0u, data, length);
+}
 #else /* LODEPNG_COMPILE_CRC */
 /*in this case, the function is only declared here, and must be defined externally
 so that it will be linked in.
@@ -3302,6 +4517,9 @@ void lodepng_info_init(LodePNGInfo* info) {
   info->interlace_method = 0;
   info->compression_method = 0;
   info->filter_method = 0;
+  info->segment_rows = 0;
+  info->segment_offsets = NULL;
+  info->segment_count = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   info->background_defined = 0;
   info->background_r = info->background_g = info->background_b = 0;
@@ -3328,6 +4546,9 @@ void lodepng_info_init(LodePNGInfo* info) {
 
 void lodepng_info_cleanup(LodePNGInfo* info) {
   lodepng_color_mode_cleanup(&info->color);
+  lodepng_free(info->segment_offsets);
+  info->segment_offsets = NULL;
+  info->segment_rows = info->segment_count = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   LodePNGText_cleanup(info);
   LodePNGIText_cleanup(info);
@@ -3342,7 +4563,17 @@ unsigned lodepng_info_copy(LodePNGInfo* dest, const LodePNGInfo* source) {
   lodepng_info_cleanup(dest);
   lodepng_memcpy(dest, source, sizeof(LodePNGInfo));
   lodepng_color_mode_init(&dest->color);
+  dest->segment_offsets = NULL;
+  dest->segment_rows = dest->segment_count = 0;
   CERROR_TRY_RETURN(lodepng_color_mode_copy(&dest->color, &source->color));
+  if(source->segment_offsets) {
+    size_t size = source->segment_count * sizeof(unsigned);
+    dest->segment_offsets = (unsigned*)lodepng_malloc(size);
+    if(!dest->segment_offsets) return 83; /*alloc fail*/
+    lodepng_memcpy(dest->segment_offsets, source->segment_offsets, size);
+    dest->segment_rows = source->segment_rows;
+    dest->segment_count = source->segment_count;
+  }
 
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   CERROR_TRY_RETURN(LodePNGText_copy(dest, source));
@@ -3370,73 +4601,48 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8u] |= in;
 }
 
-typedef struct ColorTree ColorTree;
+#define COLOR_TABLE_SIZE 512 /*power of two, twice the colors it holds so the probe sequences stay short*/
 
 /*
-One node of a color tree
-This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+Open addressing hash table of RGBA colors, with an index per color, for up to COLOR_TABLE_SIZE / 2 colors.
+This is the data structure used to count the number of unique colors and to get a palette index for a color.
+It's a single block of memory, small enough for the L1 cache.
 */
-struct ColorTree {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
-};
+typedef struct ColorTable {
+  unsigned colors[COLOR_TABLE_SIZE]; /*packed with color_table_pack*/
+  short indices[COLOR_TABLE_SIZE]; /*the index of the color, -1 if the slot is empty*/
+} ColorTable;
 
-static void color_tree_init(ColorTree* tree) {
-  lodepng_memset(tree->children, 0, 16 * sizeof(*tree->children));
-  tree->index = -1;
+static void color_table_init(ColorTable* table) {
+  lodepng_memset(table->indices, 255, sizeof(table->indices)); /*all -1*/
 }
 
-static void color_tree_cleanup(ColorTree* tree) {
-  int i;
-  for(i = 0; i != 16; ++i) {
-    if(tree->children[i]) {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+static LODEPNG_INLINE unsigned color_table_pack(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  return (unsigned)r | ((unsigned)g << 8u) | ((unsigned)b << 16u) | ((unsigned)a << 24u);
 }
 
-/*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+/*the slot that has the color, or the empty slot where it goes*/
+static LODEPNG_INLINE unsigned color_table_slot(const ColorTable* table, unsigned color) {
+  unsigned slot = ((color * 2654435761u) & 0xffffffffu) >> 23u; /*multiplicative hash, 9 bits*/
+  while(table->indices[slot] >= 0 && table->colors[slot] != color) slot = (slot + 1u) & (COLOR_TABLE_SIZE - 1u);
+  return slot;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+/*returns -1 if color not present, its index otherwise*/
+static LODEPNG_INLINE int color_table_get(const ColorTable* table, unsigned color) {
+  return table->indices[color_table_slot(table, color)];
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")
-Returns error code, or 0 if ok*/
-static unsigned color_tree_add(ColorTree* tree,
-                               unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index) {
-  int bit;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      if(!tree->children[i]) return 83; /*alloc fail*/
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
-  return 0;
+/*there must be room for the color if it doesn't exist yet, if it does its index is replaced*/
+static void color_table_add(ColorTable* table, unsigned color, unsigned index) {
+  unsigned slot = color_table_slot(table, color);
+  table->colors[slot] = color;
+  table->indices[slot] = (short)index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
   if(mode->colortype == LCT_GREY) {
     unsigned char gray = r; /*((unsigned short)r + g + b) / 3u;*/
@@ -3458,7 +4664,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
       out[i * 6 + 4] = out[i * 6 + 5] = b;
     }
   } else if(mode->colortype == LCT_PALETTE) {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, color_table_pack(r, g, b, a));
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3592,6 +4798,362 @@ static void getPixelColorRGBA8(unsigned char* r, unsigned char* g,
   }
 }
 
+#ifdef LODEPNG_SIMD_X86
+/*keeps the high byte of each big endian 16-bit value, numbytes is the output size, a multiple of 16*/
+static void narrow16To8SIMD(unsigned char* out, const unsigned char* in, size_t numbytes) {
+  size_t i;
+  const __m128i low_bytes = _mm_set1_epi16(255);
+  for(i = 0; i != numbytes; i += 16) {
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 2)), low_bytes);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i * 2 + 16)), low_bytes);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(a, b));
+  }
+}
+
+/*interleaves 16 pixels given as one vector per channel to 64 bytes of RGBA*/
+static LODEPNG_INLINE void storeRGBA8SSE2(unsigned char* out, __m128i r, __m128i g, __m128i b, __m128i a) {
+  __m128i rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+  __m128i ba0 = _mm_unpacklo_epi8(b, a), ba1 = _mm_unpackhi_epi8(b, a);
+  _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(rg0, ba0));
+  _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(rg0, ba0));
+  _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi16(rg1, ba1));
+  _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi16(rg1, ba1));
+}
+
+/*key is the grey value that becomes transparent, or -1 for none*/
+static void greyToRGBA8SSE2(unsigned char* out, const unsigned char* in, size_t numpixels, int key) {
+  size_t i;
+  const __m128i opaque = _mm_set1_epi8(-1);
+  const __m128i keys = _mm_set1_epi8((char)key);
+  for(i = 0; i != numpixels; i += 16) {
+    __m128i grey = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i alpha = key < 0 ? opaque : _mm_andnot_si128(_mm_cmpeq_epi8(grey, keys), opaque);
+    storeRGBA8SSE2(out + i * 4, grey, grey, grey, alpha);
+  }
+}
+
+static void greyAlphaToRGBA8SSE2(unsigned char* out, const unsigned char* in, size_t numpixels) {
+  size_t i;
+  const __m128i low_bytes = _mm_set1_epi16(255);
+  for(i = 0; i != numpixels; i += 8) {
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(in + i * 2));
+    __m128i grey = _mm_and_si128(pixels, low_bytes);
+    __m128i grey2 = _mm_or_si128(grey, _mm_slli_epi16(grey, 8)); /*grey in both bytes of each pixel*/
+    _mm_storeu_si128((__m128i*)(out + i * 4), _mm_unpacklo_epi16(grey2, pixels));
+    _mm_storeu_si128((__m128i*)(out + i * 4 + 16), _mm_unpackhi_epi16(grey2, pixels));
+  }
+}
+
+/*key is the RGB color that becomes transparent as little endian value with alpha 255, or 0 for none*/
+LODEPNG_TARGET("ssse3")
+static void rgbToRGBA8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels, unsigned key) {
+  size_t i;
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i opaque = _mm_set1_epi32((int)0xff000000u);
+  const __m128i keys = _mm_set1_epi32((int)key);
+  for(i = 0; i != numpixels; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(in + i * 3));
+    __m128i b = _mm_loadu_si128((const __m128i*)(in + i * 3 + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(in + i * 3 + 32));
+    /*each of these has 4 pixels of 3 bytes in its low 12 bytes*/
+    __m128i v[4];
+    unsigned k;
+    v[0] = a;
+    v[1] = _mm_alignr_epi8(b, a, 12);
+    v[2] = _mm_alignr_epi8(c, b, 8);
+    v[3] = _mm_srli_si128(c, 4);
+    for(k = 0; k != 4; ++k) {
+      __m128i pixels = _mm_or_si128(_mm_shuffle_epi8(v[k], shuffle), opaque);
+      if(key) pixels = _mm_andnot_si128(_mm_and_si128(_mm_cmpeq_epi32(pixels, keys), opaque), pixels);
+      _mm_storeu_si128((__m128i*)(out + i * 4 + k * 16), pixels);
+    }
+  }
+}
+
+LODEPNG_TARGET("ssse3")
+static void rgbaToRGB8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels) {
+  size_t i;
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  for(i = 0; i != numpixels; i += 16) {
+    /*each of these has 4 pixels of 3 bytes in its low 12 bytes*/
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * 4)), shuffle);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * 4 + 16)), shuffle);
+    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * 4 + 32)), shuffle);
+    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i * 4 + 48)), shuffle);
+    _mm_storeu_si128((__m128i*)(out + i * 3), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    _mm_storeu_si128((__m128i*)(out + i * 3 + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+    _mm_storeu_si128((__m128i*)(out + i * 3 + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+  }
+}
+
+LODEPNG_TARGET("ssse3")
+static void greyToRGB8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels) {
+  size_t i;
+  const __m128i shuffle0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+  const __m128i shuffle1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+  const __m128i shuffle2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+  for(i = 0; i != numpixels; i += 16) {
+    __m128i grey = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)(out + i * 3), _mm_shuffle_epi8(grey, shuffle0));
+    _mm_storeu_si128((__m128i*)(out + i * 3 + 16), _mm_shuffle_epi8(grey, shuffle1));
+    _mm_storeu_si128((__m128i*)(out + i * 3 + 32), _mm_shuffle_epi8(grey, shuffle2));
+  }
+}
+
+/*Palettes of up to 16 colors: each channel of the palette fits in a vector, and pshufb looks up 16 indices at once.
+With 8-bit indices, blocks with an index above 15 (invalid ones, which are black) are done one by one.*/
+LODEPNG_TARGET("ssse3")
+static void palette16ToRGBA8SSSE3(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                  const unsigned char* palette, unsigned bitdepth) {
+  size_t i;
+  unsigned char planes[4][16];
+  __m128i r, g, b, a;
+  const __m128i low_nibbles = _mm_set1_epi8(15);
+  for(i = 0; i != 64; ++i) planes[i & 3][i >> 2] = palette[i];
+  r = _mm_loadu_si128((const __m128i*)planes[0]);
+  g = _mm_loadu_si128((const __m128i*)planes[1]);
+  b = _mm_loadu_si128((const __m128i*)planes[2]);
+  a = _mm_loadu_si128((const __m128i*)planes[3]);
+  if(bitdepth == 4) {
+    for(i = 0; i != numpixels; i += 16) {
+      __m128i bytes = _mm_loadl_epi64((const __m128i*)(in + i / 2));
+      /*the first pixel is in the high nibble*/
+      __m128i index = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibbles),
+                                        _mm_and_si128(bytes, low_nibbles));
+      storeRGBA8SSE2(out + i * 4, _mm_shuffle_epi8(r, index), _mm_shuffle_epi8(g, index),
+                     _mm_shuffle_epi8(b, index), _mm_shuffle_epi8(a, index));
+    }
+  } else {
+    for(i = 0; i != numpixels; i += 16) {
+      __m128i index = _mm_loadu_si128((const __m128i*)(in + i));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_andnot_si128(low_nibbles, index), _mm_setzero_si128())) == 0xffff) {
+        storeRGBA8SSE2(out + i * 4, _mm_shuffle_epi8(r, index), _mm_shuffle_epi8(g, index),
+                       _mm_shuffle_epi8(b, index), _mm_shuffle_epi8(a, index));
+      } else {
+        size_t j;
+        for(j = i; j != i + 16; ++j) lodepng_memcpy(out + j * 4, &palette[in[j] * 4], 4);
+      }
+    }
+  }
+}
+
+/*Any palette with 8-bit indices: gathers 8 palette entries at once*/
+LODEPNG_TARGET("avx2")
+static void paletteToRGBA8AVX2(unsigned char* out, const unsigned char* in, size_t numpixels,
+                               const unsigned char* palette) {
+  size_t i;
+  for(i = 0; i != numpixels; i += 16) {
+    __m256i index0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+    __m256i index1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i + 8)));
+    _mm256_storeu_si256((__m256i*)(out + i * 4), _mm256_i32gather_epi32((const int*)palette, index0, 4));
+    _mm256_storeu_si256((__m256i*)(out + i * 4 + 32), _mm256_i32gather_epi32((const int*)palette, index1, 4));
+  }
+}
+
+/*Converts numpixels, a multiple of 16, 8-bit (or 4-bit palette) pixels of in to RGBA8 (channels 4) or RGB8
+(channels 3). Returns 0 if there is no kernel for this, or not for this CPU.*/
+static unsigned convertPixelsSIMD(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                  const LodePNGColorMode* mode, unsigned channels) {
+  unsigned features = lodepng_cpu_features();
+  if(channels == 4) {
+    if(mode->colortype == LCT_GREY && mode->bitdepth == 8) {
+      greyToRGBA8SSE2(out, in, numpixels, mode->key_defined && mode->key_r < 256 ? (int)mode->key_r : -1);
+      return 1;
+    } else if(mode->colortype == LCT_GREY_ALPHA && mode->bitdepth == 8) {
+      greyAlphaToRGBA8SSE2(out, in, numpixels);
+      return 1;
+    } else if(mode->colortype == LCT_RGB && mode->bitdepth == 8 && (features & LODEPNG_CPU_SSSE3)) {
+      unsigned key = 0;
+      if(mode->key_defined && mode->key_r < 256 && mode->key_g < 256 && mode->key_b < 256) {
+        key = mode->key_r | (mode->key_g << 8u) | (mode->key_b << 16u) | 0xff000000u;
+      }
+      rgbToRGBA8SSSE3(out, in, numpixels, key);
+      return 1;
+    } else if(mode->colortype == LCT_PALETTE && (mode->bitdepth == 4 || (mode->bitdepth == 8 && mode->palettesize <= 16))
+              && (features & LODEPNG_CPU_SSSE3)) {
+      palette16ToRGBA8SSSE3(out, in, numpixels, mode->palette, mode->bitdepth);
+      return 1;
+    } else if(mode->colortype == LCT_PALETTE && mode->bitdepth == 8 && (features & LODEPNG_CPU_AVX2)) {
+      paletteToRGBA8AVX2(out, in, numpixels, mode->palette);
+      return 1;
+    }
+  } else if(features & LODEPNG_CPU_SSSE3) {
+    if(mode->colortype == LCT_GREY && mode->bitdepth == 8) {
+      greyToRGB8SSSE3(out, in, numpixels);
+      return 1;
+    } else if(mode->colortype == LCT_RGBA && mode->bitdepth == 8) {
+      rgbaToRGB8SSSE3(out, in, numpixels);
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*Same as the SSE2 version of narrow16To8SIMD*/
+static void narrow16To8SIMD(unsigned char* out, const unsigned char* in, size_t numbytes) {
+  size_t i;
+  for(i = 0; i != numbytes; i += 16) vst1q_u8(out + i, vld2q_u8(in + i * 2).val[0]);
+}
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+/*Looks up 16 palette indices in one channel of the palette, stored as 4 tables of 64 bytes. tbx keeps the result
+of the previous tables for the indices that are out of range of its table.*/
+static LODEPNG_INLINE uint8x16_t lookupPaletteNEON(const uint8x16x4_t* table, uint8x16_t index) {
+  const uint8x16_t step = vdupq_n_u8(64);
+  uint8x16_t result = vqtbl4q_u8(table[0], index);
+  index = vsubq_u8(index, step);
+  result = vqtbx4q_u8(result, table[1], index);
+  index = vsubq_u8(index, step);
+  result = vqtbx4q_u8(result, table[2], index);
+  return vqtbx4q_u8(result, table[3], vsubq_u8(index, step));
+}
+
+static void paletteToRGBA8NEON(unsigned char* out, const unsigned char* in, size_t numpixels,
+                               const unsigned char* palette, unsigned bitdepth) {
+  size_t i;
+  unsigned c;
+  uint8x16x4_t pixels;
+  if(bitdepth == 4) {
+    const uint8x16_t low_nibbles = vdupq_n_u8(15);
+    uint8x16_t table[4];
+    uint8x16x4_t planes = vld4q_u8(palette); /*the first 16 colors, one channel per vector*/
+    table[0] = planes.val[0]; table[1] = planes.val[1]; table[2] = planes.val[2]; table[3] = planes.val[3];
+    for(i = 0; i != numpixels; i += 16) {
+      uint8x16_t bytes = vcombine_u8(vld1_u8(in + i / 2), vdup_n_u8(0));
+      /*the first pixel is in the high nibble*/
+      uint8x16_t index = vzipq_u8(vshrq_n_u8(bytes, 4), vandq_u8(bytes, low_nibbles)).val[0];
+      for(c = 0; c != 4; ++c) pixels.val[c] = vqtbl1q_u8(table[c], index);
+      vst4q_u8(out + i * 4, pixels);
+    }
+  } else {
+    uint8x16x4_t table[4][4]; /*per channel 4 tables of 64 colors*/
+    unsigned t;
+    for(t = 0; t != 4; ++t) {
+      for(c = 0; c != 4; ++c) {
+        uint8x16x4_t planes = vld4q_u8(palette + t * 256 + c * 64);
+        table[0][t].val[c] = planes.val[0];
+        table[1][t].val[c] = planes.val[1];
+        table[2][t].val[c] = planes.val[2];
+        table[3][t].val[c] = planes.val[3];
+      }
+    }
+    for(i = 0; i != numpixels; i += 16) {
+      uint8x16_t index = vld1q_u8(in + i);
+      for(c = 0; c != 4; ++c) pixels.val[c] = lookupPaletteNEON(table[c], index);
+      vst4q_u8(out + i * 4, pixels);
+    }
+  }
+}
+#endif /*__aarch64__*/
+
+/*Same as the SSE2 version of convertPixelsSIMD, the structure loads and stores of NEON interleave the channels*/
+static unsigned convertPixelsSIMD(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                  const LodePNGColorMode* mode, unsigned channels) {
+  size_t i;
+  if(mode->bitdepth != 8) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+    if(channels == 4 && mode->colortype == LCT_PALETTE && mode->bitdepth == 4) {
+      paletteToRGBA8NEON(out, in, numpixels, mode->palette, 4);
+      return 1;
+    }
+#endif /*__aarch64__*/
+    return 0;
+  }
+  if(channels == 4 && mode->colortype == LCT_GREY) {
+    uint8x16x4_t pixels;
+    int key = mode->key_defined && mode->key_r < 256;
+    const uint8x16_t keys = vdupq_n_u8((unsigned char)mode->key_r);
+    pixels.val[3] = vdupq_n_u8(255);
+    for(i = 0; i != numpixels; i += 16) {
+      pixels.val[0] = pixels.val[1] = pixels.val[2] = vld1q_u8(in + i);
+      if(key) pixels.val[3] = vmvnq_u8(vceqq_u8(pixels.val[0], keys));
+      vst4q_u8(out + i * 4, pixels);
+    }
+  } else if(channels == 4 && mode->colortype == LCT_GREY_ALPHA) {
+    uint8x16x4_t pixels;
+    for(i = 0; i != numpixels; i += 16) {
+      uint8x16x2_t grey_alpha = vld2q_u8(in + i * 2);
+      pixels.val[0] = pixels.val[1] = pixels.val[2] = grey_alpha.val[0];
+      pixels.val[3] = grey_alpha.val[1];
+      vst4q_u8(out + i * 4, pixels);
+    }
+  } else if(channels == 4 && mode->colortype == LCT_RGB) {
+    uint8x16x4_t pixels;
+    int key = mode->key_defined && mode->key_r < 256 && mode->key_g < 256 && mode->key_b < 256;
+    const uint8x16_t key_r = vdupq_n_u8((unsigned char)mode->key_r);
+    const uint8x16_t key_g = vdupq_n_u8((unsigned char)mode->key_g);
+    const uint8x16_t key_b = vdupq_n_u8((unsigned char)mode->key_b);
+    pixels.val[3] = vdupq_n_u8(255);
+    for(i = 0; i != numpixels; i += 16) {
+      uint8x16x3_t rgb = vld3q_u8(in + i * 3);
+      pixels.val[0] = rgb.val[0];
+      pixels.val[1] = rgb.val[1];
+      pixels.val[2] = rgb.val[2];
+      if(key) {
+        pixels.val[3] = vmvnq_u8(vandq_u8(vandq_u8(vceqq_u8(rgb.val[0], key_r), vceqq_u8(rgb.val[1], key_g)),
+                                          vceqq_u8(rgb.val[2], key_b)));
+      }
+      vst4q_u8(out + i * 4, pixels);
+    }
+  } else if(channels == 4 && mode->colortype == LCT_PALETTE) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+    paletteToRGBA8NEON(out, in, numpixels, mode->palette, 8);
+#else /*__aarch64__*/
+    return 0; /*the table lookups of 32-bit ARM only take 32 bytes*/
+#endif /*__aarch64__*/
+  } else if(channels == 3 && mode->colortype == LCT_GREY) {
+    uint8x16x3_t pixels;
+    for(i = 0; i != numpixels; i += 16) {
+      pixels.val[0] = pixels.val[1] = pixels.val[2] = vld1q_u8(in + i);
+      vst3q_u8(out + i * 3, pixels);
+    }
+  } else if(channels == 3 && mode->colortype == LCT_RGBA) {
+    uint8x16x3_t pixels;
+    for(i = 0; i != numpixels; i += 16) {
+      uint8x16x4_t rgba = vld4q_u8(in + i * 4);
+      pixels.val[0] = rgba.val[0];
+      pixels.val[1] = rgba.val[1];
+      pixels.val[2] = rgba.val[2];
+      vst3q_u8(out + i * 3, pixels);
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+/*Converts the first pixels of in to RGBA8 (channels 4) or RGB8 (channels 3) with the SIMD kernels, and returns how
+many, a multiple of 16: the caller converts the others, or all of them if this returns 0. 16-bit input is narrowed
+to 8 bits first, in parts that fit on the stack, except with a color key since that compares all 16 bits.*/
+static size_t getPixelColorsSIMD(unsigned char* LODEPNG_RESTRICT out, size_t numpixels,
+                                 const unsigned char* LODEPNG_RESTRICT in, const LodePNGColorMode* mode,
+                                 unsigned channels) {
+  size_t i, size, in_channels = lodepng_get_channels(mode);
+  unsigned char buffer[1024];
+  LodePNGColorMode mode8;
+  numpixels &= ~(size_t)15u;
+  if(mode->bitdepth != 16) return convertPixelsSIMD(out, in, numpixels, mode, channels) ? numpixels : 0;
+  if(mode->key_defined) return 0;
+  if(in_channels == channels) {
+    narrow16To8SIMD(out, in, numpixels * channels); /*RGB or RGBA, which only needs the narrowing*/
+    return numpixels;
+  }
+  mode8 = *mode;
+  mode8.bitdepth = 8;
+  if(!convertPixelsSIMD(out, in, 0, &mode8, channels)) return 0; /*with 0 pixels this only tells if there is a kernel*/
+  for(i = 0; i != numpixels; i += size) {
+    size = numpixels - i < 256u ? numpixels - i : 256u;
+    narrow16To8SIMD(buffer, in + i * in_channels * 2u, size * in_channels);
+    if(!convertPixelsSIMD(out + i * channels, buffer, size, &mode8, channels)) return i;
+  }
+  return numpixels;
+}
+#endif
+
 /*Similar to getPixelColorRGBA8, but with all the for loops inside of the color
 mode test cases, optimized to convert the colors much faster, when converting
 to the common case of RGBA with 8 bit per channel. buffer must be RGBA with
@@ -3601,6 +5163,12 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
                                 const LodePNGColorMode* mode) {
   unsigned num_channels = 4;
   size_t i;
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  i = getPixelColorsSIMD(buffer, numpixels, in, mode, num_channels);
+  buffer += i * num_channels;
+  in += i * lodepng_get_bpp(mode) / 8u;
+  numpixels -= i;
+#endif
   if(mode->colortype == LCT_GREY) {
     if(mode->bitdepth == 8) {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
@@ -3697,6 +5265,12 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
                                const LodePNGColorMode* mode) {
   const unsigned num_channels = 3;
   size_t i;
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  i = getPixelColorsSIMD(buffer, numpixels, in, mode, num_channels);
+  buffer += i * num_channels;
+  in += i * lodepng_get_bpp(mode) / 8u;
+  numpixels -= i;
+#endif
   if(mode->colortype == LCT_GREY) {
     if(mode->bitdepth == 8) {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
@@ -3792,11 +5366,42 @@ static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned s
   }
 }
 
+/*
+converts numpixels pixels from in to out, with out starting at pixel index start of the output image, so that
+images with less than 8 bits per pixel can also be converted in parts, such as rows, which then don't need to
+start at a byte boundary. table must contain the palette of mode_out if that is a palette, else it's not used.
+*/
+static unsigned convertPixels(unsigned char* out, size_t start, const unsigned char* in, size_t numpixels,
+                              const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                              const ColorTable* table) {
+  size_t i;
+  unsigned error = 0;
+  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
+    for(i = 0; i != numpixels; ++i) {
+      unsigned short r = 0, g = 0, b = 0, a = 0;
+      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
+      rgba16ToPixel(out, start + i, mode_out, r, g, b, a);
+    }
+  } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA) {
+    getPixelColorsRGBA8(out + start * 4u, numpixels, in, mode_in);
+  } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB) {
+    getPixelColorsRGB8(out + start * 3u, numpixels, in, mode_in);
+  } else {
+    unsigned char r = 0, g = 0, b = 0, a = 0;
+    for(i = 0; i != numpixels; ++i) {
+      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
+      error = rgba8ToPixel(out, start + i, mode_out, table, r, g, b, a);
+      if(error) break;
+    }
+  }
+  return error;
+}
+
 unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
                          unsigned w, unsigned h) {
   size_t i;
-  ColorTree tree;
+  ColorTable* table = 0;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -3830,39 +5435,18 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
       }
     }
     if(palettesize < palsize) palsize = palettesize;
-    color_tree_init(&tree);
+    table = (ColorTable*)lodepng_malloc(sizeof(ColorTable));
+    if(!table) return 83; /*alloc fail*/
+    color_table_init(table);
     for(i = 0; i != palsize; ++i) {
       const unsigned char* p = &palette[i * 4];
-      error = color_tree_add(&tree, p[0], p[1], p[2], p[3], (unsigned)i);
-      if(error) break;
+      color_table_add(table, color_table_pack(p[0], p[1], p[2], p[3]), (unsigned)i);
     }
   }
 
-  if(!error) {
-    if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
-      for(i = 0; i != numpixels; ++i) {
-        unsigned short r = 0, g = 0, b = 0, a = 0;
-        getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
-        rgba16ToPixel(out, i, mode_out, r, g, b, a);
-      }
-    } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA) {
-      getPixelColorsRGBA8(out, numpixels, in, mode_in);
-    } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB) {
-      getPixelColorsRGB8(out, numpixels, in, mode_in);
-    } else {
-      unsigned char r = 0, g = 0, b = 0, a = 0;
-      for(i = 0; i != numpixels; ++i) {
-        getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-        error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
-        if(error) break;
-      }
-    }
-  }
-
-  if(mode_out->colortype == LCT_PALETTE) {
-    color_tree_cleanup(&tree);
-  }
+  error = convertPixels(out, 0, in, numpixels, mode_out, mode_in, table);
 
+  lodepng_free(table);
   return error;
 }
 
@@ -3959,14 +5543,74 @@ static unsigned getValueRequiredBits(unsigned char value) {
   return 8;
 }
 
+/*
+Returns the first pixel of 8-bit RGBA from i on that isn't grey if grey is set, or isn't opaque if opaque is set.
+This lets lodepng_compute_color_stats skip in bulk over the pixels that can't change its result anymore.
+*/
+static size_t findPixelRGBA8(const unsigned char* in, size_t i, size_t numpixels, unsigned grey, unsigned opaque) {
+#if defined(LODEPNG_SIMD_X86)
+  /*per pixel of the masks, bits 0 and 1 are set if r equals g and g equals b, bit 3 is set if a is 255*/
+  const int need = (grey ? 0x3333 : 0) | (opaque ? 0x8888 : 0);
+  const __m128i ones = _mm_set1_epi8(-1);
+  for(; i + 4 <= numpixels; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 4));
+    int mask = (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_srli_epi32(v, 8))) & 0x3333) |
+               (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) & 0x8888);
+    if((mask & need) != need) break;
+  }
+#elif defined(LODEPNG_SIMD_NEON)
+  for(; i + 16 <= numpixels; i += 16) {
+    uint8x16x4_t v = vld4q_u8(in + i * 4);
+    uint8x16_t differ = vdupq_n_u8(0);
+    if(grey) differ = vorrq_u8(vmvnq_u8(vceqq_u8(v.val[0], v.val[1])), vmvnq_u8(vceqq_u8(v.val[1], v.val[2])));
+    if(opaque) differ = vorrq_u8(differ, vmvnq_u8(v.val[3]));
+    if(vmaxvq_u8(differ)) break;
+  }
+#endif
+  /*the rest, and the exact pixel within the block the SIMD code stopped at*/
+  for(; i != numpixels; ++i) {
+    const unsigned char* p = &in[i * 4];
+    if(grey && (p[0] != p[1] || p[1] != p[2])) break;
+    if(opaque && p[3] != 255) break;
+  }
+  return i;
+}
+
+/*Returns the first pixel of 8-bit RGBA from i on that differs from pixel i - 1, i must be at least 1.*/
+static size_t skipRunRGBA8(const unsigned char* in, size_t i, size_t numpixels) {
+  const unsigned char* prev = &in[(i - 1) * 4];
+#if defined(LODEPNG_SIMD_X86)
+  int color;
+  __m128i run;
+  lodepng_memcpy(&color, prev, 4);
+  run = _mm_set1_epi32(color);
+  for(; i + 4 <= numpixels; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 4));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, run)) != 0xffff) break;
+  }
+#elif defined(LODEPNG_SIMD_NEON)
+  const uint8x16_t r = vdupq_n_u8(prev[0]), g = vdupq_n_u8(prev[1]), b = vdupq_n_u8(prev[2]), a = vdupq_n_u8(prev[3]);
+  for(; i + 16 <= numpixels; i += 16) {
+    uint8x16x4_t v = vld4q_u8(in + i * 4);
+    uint8x16_t same = vandq_u8(vandq_u8(vceqq_u8(v.val[0], r), vceqq_u8(v.val[1], g)),
+                               vandq_u8(vceqq_u8(v.val[2], b), vceqq_u8(v.val[3], a)));
+    if(vminvq_u8(same) != 255) break;
+  }
+#endif
+  for(; i != numpixels; ++i) {
+    const unsigned char* p = &in[i * 4];
+    if(p[0] != prev[0] || p[1] != prev[1] || p[2] != prev[2] || p[3] != prev[3]) break;
+  }
+  return i;
+}
+
 /*stats must already have been inited. */
 unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* in, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in) {
   size_t i;
-  ColorTree tree;
+  ColorTable* table = 0;
   size_t numpixels = (size_t)w * (size_t)h;
-  unsigned error = 0;
 
   /* mark things as done already if it would be impossible to have a more expensive case */
   unsigned colored_done = lodepng_is_greyscale_type(mode_in) ? 1 : 0;
@@ -3983,9 +5627,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   /*if palette not allowed, no need to compute numcolors*/
   if(!stats->allow_palette) numcolors_done = 1;
 
-  color_tree_init(&tree);
-
-  /*If the stats was already filled in from previous data, fill its palette in tree
+  /*If the stats was already filled in from previous data, fill its palette in the table
   and mark things as done already if we know they are the most expensive case already*/
   if(stats->alpha) alpha_done = 1;
   if(stats->colored) colored_done = 1;
@@ -3994,10 +5636,12 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   if(stats->numcolors >= maxnumcolors) numcolors_done = 1;
 
   if(!numcolors_done) {
+    table = (ColorTable*)lodepng_malloc(sizeof(ColorTable));
+    if(!table) return 83; /*alloc fail*/
+    color_table_init(table);
     for(i = 0; i < stats->numcolors; i++) {
       const unsigned char* color = &stats->palette[i * 4];
-      error = color_tree_add(&tree, color[0], color[1], color[2], color[3], (unsigned)i);
-      if(error) goto cleanup;
+      color_table_add(table, color_table_pack(color[0], color[1], color[2], color[3]), (unsigned)i);
     }
   }
 
@@ -4063,11 +5707,24 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   } else /* < 16-bit */ {
     unsigned char r = 0, g = 0, b = 0, a = 0;
     unsigned char pr = 0, pg = 0, pb = 0, pa = 0;
+    unsigned rgba8 = mode_in->colortype == LCT_RGBA && mode_in->bitdepth == 8;
+    if(stats->bits >= 8) bits_done = 1; /*more than 8 bits only comes from the 16-bit check above*/
     for(i = 0; i != numpixels; ++i) {
+      if(rgba8 && i != 0) {
+        /*same as the skip of the previous color below, but for the whole run at once*/
+        i = skipRunRGBA8(in, i, numpixels);
+        if(i == numpixels) break;
+      }
+      if(rgba8 && numcolors_done && bits_done && !stats->key) {
+        /*only whether there's color or alpha can still change, and without color key, only by pixels that aren't
+        grey or opaque. The ones in between would be skipped by the loop anyway, only more slowly.*/
+        i = findPixelRGBA8(in, i, numpixels, !colored_done, !alpha_done);
+        if(i == numpixels) break;
+      }
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
 
       /*skip if color same as before, this speeds up large non-photographic
-      images with many same colors by avoiding 'color_tree_has' below */
+      images with many same colors by avoiding the color table below */
       if(i != 0 && r == pr && g == pg && b == pb && a == pa) continue;
       pr = r;
       pg = g;
@@ -4079,7 +5736,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
         unsigned bits = getValueRequiredBits(r);
         if(bits > stats->bits) stats->bits = bits;
       }
-      bits_done = (stats->bits >= bpp);
+      bits_done = (stats->bits >= bpp || stats->bits >= 8);
 
       if(!colored_done && (r != g || r != b)) {
         stats->colored = 1;
@@ -4109,9 +5766,9 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
       }
 
       if(!numcolors_done) {
-        if(!color_tree_has(&tree, r, g, b, a)) {
-          error = color_tree_add(&tree, r, g, b, a, stats->numcolors);
-          if(error) goto cleanup;
+        unsigned color = color_table_pack(r, g, b, a);
+        if(color_table_get(table, color) < 0) {
+          color_table_add(table, color, stats->numcolors);
           if(stats->numcolors < 256) {
             unsigned char* p = stats->palette;
             unsigned n = stats->numcolors;
@@ -4147,9 +5804,8 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     stats->key_b += (stats->key_b << 8);
   }
 
-cleanup:
-  color_tree_cleanup(&tree);
-  return error;
+  lodepng_free(table);
+  return 0;
 }
 
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
@@ -4377,8 +6033,269 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length) {
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+/*calls the kernel with bytewidth as constant, for the pixel sizes the SIMD code supports*/
+#define LODEPNG_SIMD_BYTEWIDTH_CASES(CALL) \
+  switch(bytewidth) {\
+    case 3: { const size_t bw = 3; CALL; return 1; }\
+    case 4: { const size_t bw = 4; CALL; return 1; }\
+    case 6: { const size_t bw = 6; CALL; return 1; }\
+    case 8: { const size_t bw = 8; CALL; return 1; }\
+    default: return 0;\
+  }
+
+/*the little endian value of 3 or 4 bytes, compilers turn this into a single load*/
+static LODEPNG_INLINE unsigned readPixelBytes(const unsigned char* p, size_t n) {
+  unsigned result = p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u);
+  if(n == 4) result |= (unsigned)p[3] << 24u;
+  return result;
+}
+
+static LODEPNG_INLINE void writePixelBytes(unsigned char* p, unsigned value, size_t n) {
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8u);
+  p[2] = (unsigned char)(value >> 16u);
+  if(n == 4) p[3] = (unsigned char)(value >> 24u);
+}
+#endif
+
+#ifdef LODEPNG_SIMD_X86
+/*loads a pixel of bytewidth 3, 4, 6 or 8 in the low bytes of a vector, the other bytes are zero*/
+static LODEPNG_INLINE __m128i loadPixelSSE2(const unsigned char* p, size_t bytewidth) {
+  if(bytewidth == 8) return _mm_loadl_epi64((const __m128i*)p);
+  if(bytewidth == 6) return _mm_insert_epi16(_mm_cvtsi32_si128((int)readPixelBytes(p, 4)), p[4] | (p[5] << 8), 2);
+  return _mm_cvtsi32_si128((int)readPixelBytes(p, bytewidth));
+}
+
+static LODEPNG_INLINE void storePixelSSE2(unsigned char* p, __m128i v, size_t bytewidth) {
+  if(bytewidth == 8) {
+    _mm_storel_epi64((__m128i*)p, v);
+  } else if(bytewidth == 6) {
+    unsigned high = (unsigned)_mm_extract_epi16(v, 2);
+    writePixelBytes(p, (unsigned)_mm_cvtsi128_si32(v), 4);
+    p[4] = (unsigned char)high;
+    p[5] = (unsigned char)(high >> 8u);
+  } else {
+    writePixelBytes(p, (unsigned)_mm_cvtsi128_si32(v), bytewidth);
+  }
+}
+
+/*the absolute value of 16-bit integers, with plain SSE2*/
+static LODEPNG_INLINE __m128i absSSE2(__m128i v) {
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+/*For pixels of bytewidth 3, 4, 6 or 8, the Sub, Average and Paeth filters add the previous pixel, which makes
+them sequential per pixel, but all bytes of a pixel are done at once. The callers give bytewidth as constant so
+that the loads and stores compile to single instructions.*/
+static LODEPNG_INLINE void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline,
+                                           size_t bytewidth, size_t length) {
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    a = _mm_add_epi8(a, loadPixelSSE2(scanline + i, bytewidth));
+    storePixelSSE2(recon + i, a, bytewidth);
+  }
+}
+
+static LODEPNG_INLINE void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline,
+                                               const unsigned char* precon, size_t bytewidth, size_t length) {
+  size_t i;
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    __m128i b = loadPixelSSE2(precon + i, bytewidth);
+    /*_mm_avg_epu8 rounds up, the filter rounds down*/
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(loadPixelSSE2(scanline + i, bytewidth), average);
+    storePixelSSE2(recon + i, a, bytewidth);
+  }
+}
+
+/*the Paeth predictor with 16-bit values: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, choosing the one with the
+smallest value with the same priority as paethPredictor. ssse3 tells to use its abs instruction.*/
+#define LODEPNG_UNFILTER_PAETH_SIMD(ABS) {\
+  size_t i;\
+  const __m128i zero = _mm_setzero_si128();\
+  const __m128i low_bytes = _mm_set1_epi16(255);\
+  __m128i a = zero, c = zero;\
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {\
+    __m128i b = _mm_unpacklo_epi8(loadPixelSSE2(precon + i, bytewidth), zero);\
+    __m128i x = _mm_unpacklo_epi8(loadPixelSSE2(scanline + i, bytewidth), zero);\
+    __m128i pa = _mm_sub_epi16(b, c);\
+    __m128i pb = _mm_sub_epi16(a, c);\
+    __m128i pc = ABS(_mm_add_epi16(pa, pb));\
+    __m128i smallest, nearest;\
+    pa = ABS(pa);\
+    pb = ABS(pb);\
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));\
+    /*c, replaced by b if pb is smallest, replaced by a if pa is smallest*/\
+    nearest = _mm_xor_si128(c, _mm_and_si128(_mm_xor_si128(b, c), _mm_cmpeq_epi16(pb, smallest)));\
+    nearest = _mm_xor_si128(nearest, _mm_and_si128(_mm_xor_si128(a, nearest), _mm_cmpeq_epi16(pa, smallest)));\
+    a = _mm_and_si128(_mm_add_epi16(nearest, x), low_bytes);\
+    storePixelSSE2(recon + i, _mm_packus_epi16(a, a), bytewidth);\
+    c = b;\
+  }\
+}
+
+static LODEPNG_INLINE void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline,
+                                             const unsigned char* precon, size_t bytewidth, size_t length)
+LODEPNG_UNFILTER_PAETH_SIMD(absSSE2)
+
+LODEPNG_TARGET("ssse3")
+static void unfilterPaethSSSE3(unsigned char* recon, const unsigned char* scanline,
+                               const unsigned char* precon, size_t bytewidth, size_t length)
+LODEPNG_UNFILTER_PAETH_SIMD(_mm_abs_epi16)
+
+#undef LODEPNG_UNFILTER_PAETH_SIMD
+
+static void unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline,
+                           const unsigned char* precon, size_t length) {
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+LODEPNG_TARGET("avx2")
+static void unfilterUpAVX2(unsigned char* recon, const unsigned char* scanline,
+                           const unsigned char* precon, size_t length) {
+  size_t i;
+  for(i = 0; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(precon + i));
+    _mm256_storeu_si256((__m256i*)(recon + i), _mm256_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+/*
+Unfilters a scanline with SIMD instructions, for the cases they support: the Sub, Average and Paeth filters with
+bytewidth 3, 4, 6 or 8, and the Up filter with any bytewidth. Returns 1 if done, 0 if the plain C code must do
+it instead. The same requirements as for unfilterScanline hold.
+*/
+static unsigned unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length) {
+  if(filterType == 2 && precon) {
+    if(lodepng_cpu_features() & LODEPNG_CPU_AVX2) unfilterUpAVX2(recon, scanline, precon, length);
+    else unfilterUpSSE2(recon, scanline, precon, length);
+    return 1;
+  } else if(filterType == 1 || (filterType == 4 && !precon)) {
+    /*Paeth without previous scanline is the same as Sub*/
+    LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterSubSSE2(recon, scanline, bw, length))
+  } else if(filterType == 3 && precon) {
+    LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterAverageSSE2(recon, scanline, precon, bw, length))
+  } else if(filterType == 4 && precon) {
+    if(lodepng_cpu_features() & LODEPNG_CPU_SSSE3) {
+      LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterPaethSSSE3(recon, scanline, precon, bw, length))
+    } else {
+      LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterPaethSSE2(recon, scanline, precon, bw, length))
+    }
+  }
+  return 0;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*loads a pixel of bytewidth 3, 4, 6 or 8 in the low bytes of a vector, the other bytes are zero*/
+static LODEPNG_INLINE uint8x8_t loadPixelNEON(const unsigned char* p, size_t bytewidth) {
+  uint64_t value;
+  if(bytewidth == 8) return vld1_u8(p);
+  value = readPixelBytes(p, bytewidth == 3 ? 3 : 4);
+  if(bytewidth == 6) value |= ((uint64_t)p[4] << 32u) | ((uint64_t)p[5] << 40u);
+  return vcreate_u8(value);
+}
+
+static LODEPNG_INLINE void storePixelNEON(unsigned char* p, uint8x8_t v, size_t bytewidth) {
+  uint64_t value;
+  if(bytewidth == 8) {
+    vst1_u8(p, v);
+    return;
+  }
+  value = vget_lane_u64(vreinterpret_u64_u8(v), 0);
+  writePixelBytes(p, (unsigned)value, bytewidth == 3 ? 3 : 4);
+  if(bytewidth == 6) {
+    p[4] = (unsigned char)(value >> 32u);
+    p[5] = (unsigned char)(value >> 40u);
+  }
+}
+
+/*Same as the SSE2 versions: sequential per pixel, but all bytes of a pixel at once*/
+static LODEPNG_INLINE void unfilterSubNEON(unsigned char* recon, const unsigned char* scanline,
+                                           size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0);
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    a = vadd_u8(a, loadPixelNEON(scanline + i, bytewidth));
+    storePixelNEON(recon + i, a, bytewidth);
+  }
+}
+
+static LODEPNG_INLINE void unfilterAverageNEON(unsigned char* recon, const unsigned char* scanline,
+                                               const unsigned char* precon, size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0);
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    /*the halving add rounds down like the filter*/
+    a = vadd_u8(loadPixelNEON(scanline + i, bytewidth), vhadd_u8(a, loadPixelNEON(precon + i, bytewidth)));
+    storePixelNEON(recon + i, a, bytewidth);
+  }
+}
+
+static LODEPNG_INLINE void unfilterPaethNEON(unsigned char* recon, const unsigned char* scanline,
+                                             const unsigned char* precon, size_t bytewidth, size_t length) {
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    uint8x8_t b = loadPixelNEON(precon + i, bytewidth);
+    /*pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, the latter needs 16 bits*/
+    uint16x8_t pa = vmovl_u8(vabd_u8(b, c));
+    uint16x8_t pb = vmovl_u8(vabd_u8(a, c));
+    uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+    /*choose with the same priority as paethPredictor*/
+    uint8x8_t choose_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+    uint8x8_t choose_b = vmovn_u16(vcleq_u16(pb, pc));
+    uint8x8_t nearest = vbsl_u8(choose_a, a, vbsl_u8(choose_b, b, c));
+    a = vadd_u8(loadPixelNEON(scanline + i, bytewidth), nearest);
+    storePixelNEON(recon + i, a, bytewidth);
+    c = b;
+  }
+}
+
+static void unfilterUpNEON(unsigned char* recon, const unsigned char* scanline,
+                           const unsigned char* precon, size_t length) {
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16) {
+    vst1q_u8(recon + i, vaddq_u8(vld1q_u8(scanline + i), vld1q_u8(precon + i)));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+/*Same as the SSE2 version of unfilterScanlineSIMD*/
+static unsigned unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length) {
+  if(filterType == 2 && precon) {
+    unfilterUpNEON(recon, scanline, precon, length);
+    return 1;
+  } else if(filterType == 1 || (filterType == 4 && !precon)) {
+    LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterSubNEON(recon, scanline, bw, length))
+  } else if(filterType == 3 && precon) {
+    LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterAverageNEON(recon, scanline, precon, bw, length))
+  } else if(filterType == 4 && precon) {
+    LODEPNG_SIMD_BYTEWIDTH_CASES(unfilterPaethNEON(recon, scanline, precon, bw, length))
+  }
+  return 0;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+#undef LODEPNG_SIMD_BYTEWIDTH_CASES
+
+static unsigned unfilterScanlineScalar(unsigned char* recon, const unsigned char* scanline,
+                                       const unsigned char* precon, size_t bytewidth, unsigned char filterType,
+                                       size_t length) {
   /*
   For PNG filter method 0
   unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
@@ -4568,6 +6485,15 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
+/*unfilters with SIMD for the filter types and pixel sizes that it supports, else with unfilterScanlineScalar*/
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length) {
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif
+  return unfilterScanlineScalar(recon, scanline, precon, bytewidth, filterType, length);
+}
+
 static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp) {
   /*
   For PNG filter method 0
@@ -4766,6 +6692,24 @@ static unsigned readChunk_tRNS(LodePNGColorMode* color, const unsigned char* dat
   return 0; /* OK */
 }
 
+/*segment index chunk (sgIX): the scanlines per segment, then the position in the zlib data of each segment. It only
+makes decoding faster, so a chunk that isn't valid is ignored rather than giving an error.*/
+static unsigned readChunk_sgIX(LodePNGInfo* info, const unsigned char* data, size_t chunkLength) {
+  unsigned i, count;
+  lodepng_free(info->segment_offsets);
+  info->segment_offsets = NULL;
+  info->segment_rows = info->segment_count = 0;
+  if(chunkLength < 8 || chunkLength % 4 != 0 || lodepng_read32bitInt(data) == 0) return 0;
+
+  count = (unsigned)(chunkLength / 4 - 1);
+  info->segment_offsets = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+  if(!info->segment_offsets) return 83; /*alloc fail*/
+  for(i = 0; i != count; ++i) info->segment_offsets[i] = lodepng_read32bitInt(&data[4 + 4 * i]);
+  info->segment_rows = lodepng_read32bitInt(data);
+  info->segment_count = count;
+  return 0; /* OK */
+}
+
 
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
 /*background color chunk (bKGD)*/
@@ -5169,6 +7113,245 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
   return error;
 }
 
+/*
+Reads a chunk other than IHDR, IDAT and IEND into the state, and checks its CRC. The chunk must be complete.
+critical_pos is 1 after IHDR, 2 after PLTE and 3 after IDAT, for the placement of unknown chunks. Returns error code.
+*/
+static unsigned decodeChunk(LodePNGState* state, const unsigned char* chunk, unsigned* critical_pos) {
+  unsigned error = 0;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  const unsigned char* data = lodepng_chunk_data_const(chunk);
+  unsigned unknown = 0;
+
+  if(lodepng_chunk_type_equals(chunk, "PLTE")) {
+    /*palette chunk (PLTE)*/
+    error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+    if(error) return error;
+    *critical_pos = 2;
+  } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
+    /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
+    in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
+    affects the alpha channel of pixels. */
+    error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "sgIX")) {
+    /*segment index chunk (sgIX), only of use before the image data*/
+    if(*critical_pos != 3) {
+      error = readChunk_sgIX(&state->info_png, data, chunkLength);
+      if(error) return error;
+    }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    /*background color chunk (bKGD)*/
+  } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
+    error = readChunk_bKGD(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
+    /*text chunk (tEXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_tEXt(&state->info_png, data, chunkLength);
+      if(error) return error;
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
+    /*compressed text chunk (zTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
+      if(error) return error;
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
+    /*international text chunk (iTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
+      if(error) return error;
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
+    error = readChunk_tIME(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
+    error = readChunk_pHYs(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
+    error = readChunk_gAMA(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
+    error = readChunk_cHRM(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
+    error = readChunk_sRGB(&state->info_png, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
+    error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
+    if(error) return error;
+  } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
+    error = readChunk_sBIT(&state->info_png, data, chunkLength);
+    if(error) return error;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
+      return 69;
+    }
+
+    unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks) {
+      error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[*critical_pos - 1],
+                                   &state->info_png.unknown_chunks_size[*critical_pos - 1], chunk);
+      if(error) return error;
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+
+
+
+  if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
+    if(lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+  }
+
+  return 0;
+}
+
+/*the size of all scanlines of the image together including the filter type bytes, which is what the zlib data
+of the IDAT chunks decompresses to. For Adam7 interlaced images, this is the sum of the 7 reduced images.*/
+static size_t lodepng_get_raw_size_scanlines(unsigned w, unsigned h, const LodePNGInfo* info) {
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  size_t size = 0;
+  if(info->interlace_method == 0) {
+    size = lodepng_get_raw_size_idat(w, h, bpp);
+  } else {
+    size += lodepng_get_raw_size_idat((w + 7) >> 3, (h + 7) >> 3, bpp);
+    if(w > 4) size += lodepng_get_raw_size_idat((w + 3) >> 3, (h + 7) >> 3, bpp);
+    size += lodepng_get_raw_size_idat((w + 3) >> 2, (h + 3) >> 3, bpp);
+    if(w > 2) size += lodepng_get_raw_size_idat((w + 1) >> 2, (h + 3) >> 2, bpp);
+    size += lodepng_get_raw_size_idat((w + 1) >> 1, (h + 1) >> 2, bpp);
+    if(w > 1) size += lodepng_get_raw_size_idat((w + 0) >> 1, (h + 1) >> 1, bpp);
+    size += lodepng_get_raw_size_idat((w + 0), (h + 0) >> 1, bpp);
+  }
+  return size;
+}
+
+/*whether the segment index of the PNG can be used to decode it on multiple threads*/
+static unsigned segmentIndexUsable(const LodePNGState* state, unsigned w, unsigned h) {
+#ifdef LODEPNG_USE_THREADS
+  const LodePNGInfo* info = &state->info_png;
+  const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+  size_t linebits = (size_t)w * lodepng_get_bpp(&info->color);
+  /*the first segment covers all rows if there are fewer than segment_rows, which is tested this way*/
+  if(info->segment_rows == 0 || info->segment_rows >= h) return 0;
+  if(info->segment_count != (h - 1u) / info->segment_rows + 1u) return 0;
+  /*segments of rows with padding bits would share the bytes of the output where they meet*/
+  if(info->interlace_method != 0 || linebits % 8u != 0) return 0;
+  if(settings->custom_zlib || settings->custom_inflate) return 0;
+  return lodepng_get_num_threads(state->decoder.num_threads) > 1;
+#else /*LODEPNG_USE_THREADS*/
+  (void)state;
+  (void)w;
+  (void)h;
+  return 0;
+#endif /*LODEPNG_USE_THREADS*/
+}
+
+#ifdef LODEPNG_USE_THREADS
+/*what the threads of decodeSegmented share*/
+typedef struct SegmentDecoder {
+  const unsigned char* zlib; /*the zlib data*/
+  size_t zlibsize;
+  const LodePNGInfo* info;
+  const LodePNGDecompressSettings* settings;
+  unsigned w, h;
+  unsigned char* out; /*the unfiltered image*/
+  unsigned* adler; /*the adler32 of the inflated data of each segment*/
+  unsigned* errors; /*the error of each segment*/
+} SegmentDecoder;
+
+/*inflates and unfilters one segment*/
+static void decodeSegment(void* context, size_t index) {
+  const SegmentDecoder* decoder = (const SegmentDecoder*)context;
+  const LodePNGInfo* info = decoder->info;
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  size_t linebytes = lodepng_get_raw_size_idat(decoder->w, 1, bpp) - 1u;
+  unsigned last = index + 1u == info->segment_count;
+  unsigned y = (unsigned)index * info->segment_rows;
+  unsigned numrows = last ? decoder->h - y : info->segment_rows;
+  size_t start = info->segment_offsets[index];
+  size_t end = last ? decoder->zlibsize - 4u : info->segment_offsets[index + 1];
+  size_t expected_size = (size_t)numrows * (linebytes + 1u);
+  LodePNGDecompressSettings settings = *decoder->settings;
+  ucvector scanlines = ucvector_init(NULL, 0);
+  LodePNGBitReader reader;
+  Inflater inflater;
+  unsigned error = LodePNGBitReader_init(&reader, decoder->zlib + start, end - start);
+
+  Inflater_init(&inflater);
+  inflater.end_at_block = !last;
+  settings.max_output_size = expected_size;
+  if(!error && !ucvector_reserve(&scanlines, expected_size)) error = 83; /*alloc fail*/
+  if(!error) error = inflateResume(&inflater, &scanlines, &reader, &settings, 1);
+  /*the last segment has the final block, the others end with the flush at the end of their data*/
+  if(!error && (last ? inflater.mode != INFLATE_DONE : inflater.mode != INFLATE_BLOCK_START)) error = 52;
+  if(!error && scanlines.size != expected_size) error = 91; /*decompressed size doesn't match prediction*/
+  /*the first row of the segment may not use the row before it, which is unfiltered by another thread*/
+  if(!error && index && scanlines.data[0] > 1) error = 36;
+  if(!error) error = unfilter(decoder->out + (size_t)y * linebytes, scanlines.data, decoder->w, numrows, bpp);
+  if(!error && !settings.ignore_adler32) decoder->adler[index] = adler32(scanlines.data, (unsigned)expected_size);
+
+  Inflater_cleanup(&inflater);
+  lodepng_free(scanlines.data);
+  decoder->errors[index] = error;
+}
+
+/*
+Decodes a non-interlaced PNG with a usable segment index from its zlib data into *out, inflating and unfiltering
+the segments on multiple threads. Returns 0 if that worked. Otherwise, such as when the index doesn't match the
+zlib data, *out is not set and the PNG must be decoded the normal way, which also gives the right error if the zlib
+data is corrupt.
+*/
+static unsigned decodeSegmented(unsigned char** out, const unsigned char* zlib, size_t zlibsize,
+                                unsigned w, unsigned h, const LodePNGState* state) {
+  const LodePNGInfo* info = &state->info_png;
+  unsigned count = info->segment_count, i, adler = 0, error = 0;
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, lodepng_get_bpp(&info->color)) - 1u;
+  SegmentDecoder decoder;
+
+  if(zlibsize < 6 || checkZlibHeader(zlib)) return 1;
+  /*the segments must start after the zlib header, in order, before the adler32 checksum*/
+  if(info->segment_offsets[0] != 2) return 1;
+  for(i = 1; i != count; ++i) {
+    if(info->segment_offsets[i] <= info->segment_offsets[i - 1] || info->segment_offsets[i] >= zlibsize - 4) return 1;
+  }
+
+  decoder.zlib = zlib;
+  decoder.zlibsize = zlibsize;
+  decoder.info = info;
+  decoder.settings = &state->decoder.zlibsettings;
+  decoder.w = w;
+  decoder.h = h;
+  decoder.out = (unsigned char*)lodepng_malloc(linebytes * h);
+  decoder.adler = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+  decoder.errors = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+  if(!decoder.out || !decoder.adler || !decoder.errors) error = 83; /*alloc fail*/
+
+  if(!error) lodepng_run_tasks(count, lodepng_get_num_threads(state->decoder.num_threads), decodeSegment, &decoder);
+  for(i = 0; i != count && !error; ++i) error = decoder.errors[i];
+  if(!error && !state->decoder.zlibsettings.ignore_adler32) {
+    for(i = 0; i != count; ++i) {
+      unsigned numrows = i + 1u == count ? h - i * info->segment_rows : info->segment_rows;
+      adler = i ? combine_adler32(adler, decoder.adler[i], (size_t)numrows * (linebytes + 1u)) : decoder.adler[0];
+    }
+    /*error, adler checksum not correct, data must be corrupted*/
+    if(adler != lodepng_read32bitInt(&zlib[zlibsize - 4])) error = 58;
+  }
+
+  lodepng_free(decoder.adler);
+  lodepng_free(decoder.errors);
+  if(error) {
+    lodepng_free(decoder.out);
+    return error;
+  }
+  *out = decoder.out;
+  return 0;
+}
+#endif /*LODEPNG_USE_THREADS*/
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
@@ -5182,11 +7365,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   size_t outsize = 0;
 
   /*for unknown chunk order*/
-  unsigned unknown = 0;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-
 
   /* safe output values in case error happens */
   *out = 0;
@@ -5232,8 +7411,6 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 
     data = lodepng_chunk_data_const(chunk);
 
-    unknown = 0;
-
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT")) {
       size_t newsize;
@@ -5241,88 +7418,20 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       if(newsize > insize) CERROR_BREAK(state->error, 95);
       lodepng_memcpy(idat + idatsize, data, chunkLength);
       idatsize += chunkLength;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
       critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+      if(!state->decoder.ignore_crc) /*check CRC if wanted*/ {
+        if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
+      }
     } else if(lodepng_chunk_type_equals(chunk, "IEND")) {
       /*IEND chunk*/
       IEND = 1;
-    } else if(lodepng_chunk_type_equals(chunk, "PLTE")) {
-      /*palette chunk (PLTE)*/
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
-      /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
-      in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
-      affects the alpha channel of pixels. */
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      /*background color chunk (bKGD)*/
-    } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
-      /*text chunk (tEXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
-      /*compressed text chunk (zTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
+      if(!state->decoder.ignore_crc) /*check CRC if wanted*/ {
+        if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
       }
-    } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
-      /*international text chunk (iTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
-      state->error = readChunk_gAMA(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
-      state->error = readChunk_cHRM(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
-      state->error = readChunk_sRGB(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
-      state->error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
-      state->error = readChunk_sBIT(&state->info_png, data, chunkLength);
+    } else {
+      /*any other chunk, this also checks its CRC*/
+      state->error = decodeChunk(state, chunk, &critical_pos);
       if(state->error) break;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
-        CERROR_BREAK(state->error, 69);
-      }
-
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks) {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
-      }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-
-    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
-      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
     }
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk, in + insize);
@@ -5332,25 +7441,17 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     state->error = 106; /* error: PNG file must have PLTE chunk if color type is palette */
   }
 
+#ifdef LODEPNG_USE_THREADS
+  if(!state->error && segmentIndexUsable(state, *w, *h) && !decodeSegmented(out, idat, idatsize, *w, *h, state)) {
+    lodepng_free(idat);
+    return;
+  }
+#endif /*LODEPNG_USE_THREADS*/
+
   if(!state->error) {
     /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
     If the decompressed size does not match the prediction, the image must be corrupt.*/
-    if(state->info_png.interlace_method == 0) {
-      unsigned bpp = lodepng_get_bpp(&state->info_png.color);
-      expected_size = lodepng_get_raw_size_idat(*w, *h, bpp);
-    } else {
-      unsigned bpp = lodepng_get_bpp(&state->info_png.color);
-      /*Adam-7 interlaced: expected size is the sum of the 7 sub-images sizes*/
-      expected_size = 0;
-      expected_size += lodepng_get_raw_size_idat((*w + 7) >> 3, (*h + 7) >> 3, bpp);
-      if(*w > 4) expected_size += lodepng_get_raw_size_idat((*w + 3) >> 3, (*h + 7) >> 3, bpp);
-      expected_size += lodepng_get_raw_size_idat((*w + 3) >> 2, (*h + 3) >> 3, bpp);
-      if(*w > 2) expected_size += lodepng_get_raw_size_idat((*w + 1) >> 2, (*h + 3) >> 2, bpp);
-      expected_size += lodepng_get_raw_size_idat((*w + 1) >> 1, (*h + 1) >> 2, bpp);
-      if(*w > 1) expected_size += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, bpp);
-      expected_size += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, bpp);
-    }
-
+    expected_size = lodepng_get_raw_size_scanlines(*w, *h, &state->info_png);
     state->error = zlib_decompress(&scanlines, &scanlines_size, expected_size, idat, idatsize, &state->decoder.zlibsettings);
   }
   if(!state->error && scanlines_size != expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
@@ -5368,12 +7469,8 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   lodepng_free(scanlines);
 }
 
-unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
-                        LodePNGState* state,
-                        const unsigned char* in, size_t insize) {
-  *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
-  if(state->error) return state->error;
+/*converts the decoded image in *out from the color mode of the PNG to state->info_raw, if wanted, replacing *out*/
+static unsigned decodeConvert(unsigned char** out, unsigned w, unsigned h, LodePNGState* state) {
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
     /*same color type, no copying or converting of data needed*/
     /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
@@ -5393,18 +7490,38 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
       return 56; /*unsupported color mode conversion*/
     }
 
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
+    outsize = lodepng_get_raw_size(w, h, &state->info_raw);
     *out = (unsigned char*)lodepng_malloc(outsize);
     if(!(*out)) {
       state->error = 83; /*alloc fail*/
     }
     else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
+                                        &state->info_png.color, w, h);
     lodepng_free(data);
   }
   return state->error;
 }
 
+unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
+                        LodePNGState* state,
+                        const unsigned char* in, size_t insize) {
+  *out = 0;
+  if(state->decoder.region_y0 || state->decoder.region_y1 || state->decoder.reduce) {
+    /*the push decoder only decompresses and converts what the region needs*/
+    unsigned error;
+    LodePNGPushDecoder* decoder = lodepng_push_decoder_new(state);
+    *w = *h = 0;
+    if(!decoder) return 83; /*alloc fail*/
+    error = lodepng_push_decoder_write(decoder, in, insize);
+    if(!error) error = lodepng_push_decoder_finish(decoder, out, w, h);
+    lodepng_push_decoder_delete(decoder);
+    return error;
+  }
+  decodeGeneric(out, w, h, state, in, insize);
+  if(state->error) return state->error;
+  return decodeConvert(out, *w, *h, state);
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -5430,45 +7547,1207 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
   return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
 }
 
-#ifdef LODEPNG_COMPILE_DISK
-unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
-                             LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
-  size_t buffersize;
-  unsigned error;
-  /* safe output values in case error happens */
-  *out = 0;
-  *w = *h = 0;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
-  if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
-  return error;
-}
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Push Decoder                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
 
-unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename) {
-  return lodepng_decode_file(out, w, h, filename, LCT_RGBA, 8);
+/*
+the rows y0 to y1 of a w * h PNG that are decoded for the region and reduction of the settings, and in *w and *h
+the size of the output
+*/
+static unsigned getRegion(unsigned* y0, unsigned* y1, unsigned* w, unsigned* h,
+                          const LodePNGDecoderSettings* settings) {
+  unsigned reduce = settings->reduce, square;
+  unsigned end = settings->region_y1 ? settings->region_y1 : *h;
+  if(reduce > 3u || end > *h || settings->region_y0 >= end) return 118; /*invalid region*/
+  square = 1u << reduce;
+  *y0 = settings->region_y0 & ~(square - 1u);
+  /*end rounded up to a whole square, without going past the image*/
+  *y1 = end > *h - (*h & (square - 1u)) ? *h : (end + square - 1u) & ~(square - 1u);
+  *w = (*w + square - 1u) >> reduce;
+  *h = (*y1 - *y0 + square - 1u) >> reduce;
+  return 0;
 }
 
-unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename) {
-  return lodepng_decode_file(out, w, h, filename, LCT_RGB, 8);
+/*copies amount bits from in starting at bit ibp, to out starting at bit obp*/
+static void copyBits(unsigned char* out, size_t obp, const unsigned char* in, size_t ibp, size_t amount) {
+  size_t i;
+  for(i = 0; i != amount; ++i) {
+    unsigned char bit = readBitFromReversedStream(&ibp, in);
+    setBitOfReversedStream(&obp, out, bit);
+  }
 }
-#endif /*LODEPNG_COMPILE_DISK*/
 
-void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings) {
-  settings->color_convert = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  settings->read_text_chunks = 1;
-  settings->remember_unknown_chunks = 0;
-  settings->max_text_size = 16777216;
-  settings->max_icc_size = 16777216; /* 16MB is much more than enough for any reasonable ICC profile */
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-  settings->ignore_crc = 0;
-  settings->ignore_critical = 0;
-  settings->ignore_end = 0;
-  lodepng_decompress_settings_init(&settings->zlibsettings);
+/*
+Reduces rows of an image by 2^reduce in both directions. Color modes with 8 or 16 bits per channel, other than
+palette, are box filtered: each output pixel is the rounded average of its square, clipped to the image. Of other
+color modes, and of Adam7 interlaced images, the top left pixel of the square is taken.
+*/
+typedef struct RowReducer {
+  unsigned w; /*the width of the input rows*/
+  unsigned reduce;
+  const LodePNGColorMode* mode;
+  unsigned* sums; /*the sums of each channel of each input column so far, if box filtered*/
+  unsigned rows; /*the amount of input rows in the output row so far*/
+  unsigned char* out; /*the output row*/
+} RowReducer;
+
+static void RowReducer_init(RowReducer* reducer) {
+  reducer->sums = 0;
+  reducer->out = 0;
+}
+
+static void RowReducer_cleanup(RowReducer* reducer) {
+  lodepng_free(reducer->sums);
+  lodepng_free(reducer->out);
+  RowReducer_init(reducer);
+}
+
+static unsigned RowReducer_start(RowReducer* reducer, unsigned w, unsigned reduce, const LodePNGColorMode* mode,
+                                 unsigned interlaced) {
+  unsigned out_w = (w + (1u << reduce) - 1u) >> reduce;
+  size_t outsize = lodepng_get_raw_size(out_w, 1, mode);
+  reducer->w = w;
+  reducer->reduce = reduce;
+  reducer->mode = mode;
+  reducer->rows = 0;
+  reducer->out = (unsigned char*)lodepng_malloc(outsize);
+  if(!reducer->out) return 83; /*alloc fail*/
+  lodepng_memset(reducer->out, 0, outsize);
+  if(mode->colortype != LCT_PALETTE && mode->bitdepth >= 8 && !interlaced) {
+    size_t sumsize = (size_t)w * lodepng_get_channels(mode) * sizeof(unsigned);
+    reducer->sums = (unsigned*)lodepng_malloc(sumsize);
+    if(!reducer->sums) return 83; /*alloc fail*/
+    lodepng_memset(reducer->sums, 0, sumsize);
+  }
+  return 0;
 }
 
-#endif /*LODEPNG_COMPILE_DECODER*/
+/*adds the next input row, and returns whether reducer->out is a complete output row, which it is after 2^reduce
+rows or if last is 1*/
+static unsigned RowReducer_add(RowReducer* reducer, const unsigned char* row, unsigned last) {
+  unsigned reduce = reducer->reduce, w = reducer->w;
+  unsigned out_w = (w + (1u << reduce) - 1u) >> reduce;
+  unsigned x;
+  if(!reducer->sums) {
+    unsigned bpp = lodepng_get_bpp(reducer->mode);
+    if(reducer->rows == 0) {
+      for(x = 0; x != out_w; ++x) copyBits(reducer->out, (size_t)x * bpp, row, ((size_t)x << reduce) * bpp, bpp);
+    }
+  } else {
+    /*the columns are summed when the output row is complete*/
+    size_t i, n = (size_t)w * lodepng_get_channels(reducer->mode);
+    unsigned* sums = reducer->sums;
+    if(reducer->mode->bitdepth == 8) {
+      for(i = 0; i != n; ++i) sums[i] += row[i];
+    } else {
+      for(i = 0; i != n; ++i) sums[i] += 256u * row[2 * i] + row[2 * i + 1];
+    }
+  }
+  if(++reducer->rows != (1u << reduce) && !last) return 0;
+
+  if(reducer->sums) {
+    unsigned channels = lodepng_get_channels(reducer->mode), c, k;
+    unsigned bitdepth = reducer->mode->bitdepth, shift = 2u * reduce, rows = reducer->rows;
+    const unsigned* sums = reducer->sums;
+    unsigned char* out = reducer->out;
+    for(x = 0; x != out_w; ++x) {
+      /*the squares at the right can be narrower*/
+      unsigned cols = w - (x << reduce) < (1u << reduce) ? w - (x << reduce) : (1u << reduce);
+      unsigned count = cols * rows, n = cols * channels;
+      for(c = 0; c != channels; ++c) {
+        unsigned value = 0;
+        for(k = c; k < n; k += channels) value += sums[k];
+        /*whole squares have a power of two pixels*/
+        if(count == (1u << shift)) value = (value + count / 2u) >> shift;
+        else value = (value + count / 2u) / count;
+        if(bitdepth == 8) *out++ = (unsigned char)value;
+        else {
+          *out++ = (unsigned char)(value >> 8u);
+          *out++ = (unsigned char)value;
+        }
+      }
+      sums += n;
+    }
+    lodepng_memset(reducer->sums, 0, (size_t)w * channels * sizeof(unsigned));
+  }
+  reducer->rows = 0;
+  return 1;
+}
+
+/*what the push decoder expects next*/
+#define PUSH_HEADER 0u /*the signature and IHDR chunk, 33 bytes*/
+#define PUSH_CHUNK_HEADER 1u /*the length and type of a chunk, 8 bytes*/
+#define PUSH_CHUNK 2u /*the rest of a chunk other than IDAT, which is gathered whole*/
+#define PUSH_IDAT_DATA 3u /*the data of an IDAT chunk, which is used as it comes*/
+#define PUSH_IDAT_CRC 4u /*the CRC of an IDAT chunk, 4 bytes*/
+#define PUSH_END 5u /*nothing, IEND was read. Any data after it is ignored.*/
+
+/*the output size at which the inflater pauses to let the unfiltered rows be removed from the scanlines*/
+static const size_t PUSH_INFLATE_STEP = 262144;
+
+/*the amount of compressed bytes appended to the leftover of the previous input at a time*/
+static const size_t PUSH_INPUT_STEP = 4096;
+
+/*how the rows of a non-interlaced image are converted to the color mode of the output*/
+#define PUSH_CONVERT_UNKNOWN 0u /*not known yet, until the first row*/
+#define PUSH_CONVERT_NONE 1u /*the output has the color mode of the PNG*/
+#define PUSH_CONVERT_ROWS 2u /*each row is converted when it is unfiltered*/
+#define PUSH_CONVERT_END 3u /*the whole image is converted at the end, for conversions to palette*/
+
+struct LodePNGPushDecoder {
+  LodePNGState* state;
+  unsigned phase; /*one of the PUSH_ values above*/
+  ucvector chunk; /*gathers the header, the header of chunks, whole chunks other than IDAT and the IDAT CRC*/
+  size_t chunk_need; /*the size chunk must reach before it can be used*/
+  size_t idat_left; /*the amount of bytes of the current IDAT chunk that is still to come*/
+#ifdef LODEPNG_COMPILE_CRC
+  unsigned idat_crc; /*the CRC of the current IDAT chunk so far*/
+#else /*LODEPNG_COMPILE_CRC*/
+  ucvector idat_chunk; /*the type and data of the current IDAT chunk, since an external lodepng_crc32 can't continue*/
+#endif /*LODEPNG_COMPILE_CRC*/
+  unsigned critical_pos; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  unsigned w, h;
+  size_t expected_size; /*the size of all scanlines of the image*/
+  unsigned char* image; /*the decoded image, allocated once needed. Not used if rows only go to the callback.*/
+  size_t image_size; /*the allocated size of image, which grows as rows are produced, see pushReserveImage*/
+  size_t image_used; /*the bytes at the start of image that rows were stored in*/
+  size_t image_linebits; /*the bits per row of image*/
+  unsigned image_h; /*the amount of rows of the whole image*/
+  unsigned rows_done; /*the amount of rows of the output that are complete*/
+  unsigned rows_unfiltered; /*the amount of rows that are unfiltered*/
+  unsigned convert; /*one of the PUSH_CONVERT_ values above*/
+  unsigned (*row_callback)(const unsigned char* row, unsigned y, void* context);
+  void* row_context;
+  unsigned region; /*whether only a region of the image, or a reduced image, is output*/
+  unsigned y0, y1; /*the rows of the region, widened to whole squares of the reduction*/
+  unsigned out_w, out_h; /*the size of the output*/
+  unsigned reduce; /*the output is reduced by 2^reduce*/
+  unsigned cropped; /*whether image holds only the region, reduced, rather than the whole image*/
+  unsigned region_done; /*whether the data that the region needs is all used, and the rest is ignored*/
+  RowReducer reducer; /*reduces the rows of a non-interlaced image as they come*/
+  unsigned has_output; /*whether the image is decoded into memory of the caller*/
+  unsigned char* output; /*that memory, which is NULL if its size is 0*/
+  size_t output_size;
+  size_t output_stride; /*the distance between rows in output, or 0 if they follow each other without gaps*/
+  unsigned streaming; /*whether the zlib data is inflated as it comes, or gathered in idat and decompressed at the end*/
+  ucvector idat; /*all zlib data, if not streaming*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  size_t idat_total; /*the amount of zlib data so far*/
+  unsigned char zlib_header[2];
+  unsigned char adler_bytes[4]; /*the last 4 bytes of zlib data so far*/
+  Inflater inflater;
+  ucvector zdata; /*compressed data that was not yet used by the inflater*/
+  size_t zbp; /*bit position in the first byte of zdata, or of the next input if zdata is empty*/
+  ucvector scanlines; /*inflated data, of which the rows that are already unfiltered are removed regularly*/
+  size_t scanlines_pos; /*position in scanlines of the filter type byte of the next row to unfilter*/
+  size_t scanlines_removed; /*the amount of bytes that were removed from the front of scanlines*/
+  unsigned adler; /*the adler32 of the removed bytes*/
+  unsigned char* lines; /*the current and previous unfiltered row, if they are not unfiltered into image*/
+  unsigned char* row; /*the current converted row, if rows only go to the callback or are cropped*/
+  size_t adam7_size; /*the size of the scanlines of the passes of an Adam7 image that a reduction needs, or 0*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+};
+
+LodePNGPushDecoder* lodepng_push_decoder_new(LodePNGState* state) {
+  LodePNGPushDecoder* decoder = (LodePNGPushDecoder*)lodepng_malloc(sizeof(LodePNGPushDecoder));
+  if(!decoder) return 0;
+  decoder->state = state;
+  decoder->phase = PUSH_HEADER;
+  decoder->chunk = ucvector_init(NULL, 0);
+  decoder->chunk_need = 33;
+  decoder->idat_left = 0;
+#ifdef LODEPNG_COMPILE_CRC
+  decoder->idat_crc = 0;
+#else /*LODEPNG_COMPILE_CRC*/
+  decoder->idat_chunk = ucvector_init(NULL, 0);
+#endif /*LODEPNG_COMPILE_CRC*/
+  decoder->critical_pos = 1;
+  decoder->w = decoder->h = 0;
+  decoder->expected_size = 0;
+  decoder->image = 0;
+  decoder->image_size = decoder->image_used = decoder->image_linebits = 0;
+  decoder->image_h = 0;
+  decoder->rows_done = 0;
+  decoder->rows_unfiltered = 0;
+  decoder->convert = PUSH_CONVERT_UNKNOWN;
+  decoder->row_callback = 0;
+  decoder->row_context = 0;
+  decoder->region = 0;
+  decoder->y0 = decoder->y1 = 0;
+  decoder->out_w = decoder->out_h = 0;
+  decoder->reduce = 0;
+  decoder->cropped = 0;
+  decoder->region_done = 0;
+  RowReducer_init(&decoder->reducer);
+  decoder->has_output = 0;
+  decoder->output = 0;
+  decoder->output_size = 0;
+  decoder->output_stride = 0;
+  decoder->streaming = 0;
+  decoder->idat = ucvector_init(NULL, 0);
+#ifdef LODEPNG_COMPILE_ZLIB
+  decoder->idat_total = 0;
+  lodepng_memset(decoder->adler_bytes, 0, 4);
+  Inflater_init(&decoder->inflater);
+  decoder->zdata = ucvector_init(NULL, 0);
+  decoder->zbp = 0;
+  decoder->scanlines = ucvector_init(NULL, 0);
+  decoder->scanlines_pos = 0;
+  decoder->scanlines_removed = 0;
+  decoder->adler = 1u;
+  decoder->lines = 0;
+  decoder->row = 0;
+  decoder->adam7_size = 0;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  state->error = 0;
+  return decoder;
+}
+
+void lodepng_push_decoder_delete(LodePNGPushDecoder* decoder) {
+  if(!decoder) return;
+  lodepng_free(decoder->chunk.data);
+  lodepng_free(decoder->image);
+  lodepng_free(decoder->idat.data);
+#ifndef LODEPNG_COMPILE_CRC
+  lodepng_free(decoder->idat_chunk.data);
+#endif /*LODEPNG_COMPILE_CRC*/
+  RowReducer_cleanup(&decoder->reducer);
+#ifdef LODEPNG_COMPILE_ZLIB
+  Inflater_cleanup(&decoder->inflater);
+  lodepng_free(decoder->zdata.data);
+  lodepng_free(decoder->scanlines.data);
+  lodepng_free(decoder->lines);
+  lodepng_free(decoder->row);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  lodepng_free(decoder);
+}
+
+void lodepng_push_decoder_set_row_callback(LodePNGPushDecoder* decoder,
+                                           unsigned (*callback)(const unsigned char* row, unsigned y, void* context),
+                                           void* context) {
+  decoder->row_callback = callback;
+  decoder->row_context = context;
+}
+
+void lodepng_push_decoder_set_output(LodePNGPushDecoder* decoder, unsigned char* out, size_t outsize,
+                                     size_t stride) {
+  decoder->has_output = 1;
+  decoder->output = out;
+  decoder->output_size = outsize;
+  decoder->output_stride = stride;
+}
+
+unsigned lodepng_push_decoder_rows_done(const LodePNGPushDecoder* decoder) {
+  return decoder->rows_done;
+}
+
+const unsigned char* lodepng_push_decoder_image(const LodePNGPushDecoder* decoder) {
+  return decoder->rows_done ? decoder->image : 0;
+}
+
+/*allocates the whole image at once, for when all image data is decompressed already*/
+static unsigned pushAllocateImage(LodePNGPushDecoder* decoder, unsigned w, unsigned h, const LodePNGColorMode* mode) {
+  size_t size = lodepng_get_raw_size(w, h, mode);
+  decoder->image = (unsigned char*)lodepng_malloc(size);
+  if(!decoder->image) return 83; /*alloc fail*/
+  lodepng_memset(decoder->image, 0, size);
+  decoder->image_size = decoder->image_used = size;
+  return 0;
+}
+
+/*the color mode of the image that lodepng_push_decoder_finish outputs, once the header is read*/
+static const LodePNGColorMode* pushOutputMode(const LodePNGPushDecoder* decoder) {
+  const LodePNGState* state = decoder->state;
+  return state->decoder.color_convert ? &state->info_raw : &state->info_png.color;
+}
+
+/*checks that the image fits in the output memory of the caller, once the header is read*/
+static unsigned pushCheckOutput(const LodePNGPushDecoder* decoder) {
+  const LodePNGColorMode* mode = pushOutputMode(decoder);
+  size_t linebytes = lodepng_get_raw_size(decoder->out_w, 1, mode);
+  size_t needed;
+  if(!decoder->output_stride) {
+    needed = lodepng_get_raw_size(decoder->out_w, decoder->out_h, mode);
+  } else {
+    if(decoder->output_stride < linebytes) return 117; /*the rows overlap*/
+    if(lodepng_mulofl(decoder->out_h - 1u, decoder->output_stride, &needed)) return 117;
+    if(lodepng_addofl(needed, linebytes, &needed)) return 117;
+  }
+  return decoder->output_size < needed ? 117 : 0;
+}
+
+/*copies the whole image, in the color mode of the output, to the output memory of the caller*/
+static void pushImageToOutput(LodePNGPushDecoder* decoder, const unsigned char* image) {
+  size_t linebits = (size_t)decoder->out_w * lodepng_get_bpp(pushOutputMode(decoder));
+  size_t linebytes = (linebits + 7u) / 8u;
+  unsigned y;
+  if(!decoder->output_stride) {
+    lodepng_memcpy(decoder->output, image,
+                   lodepng_get_raw_size(decoder->out_w, decoder->out_h, pushOutputMode(decoder)));
+    return;
+  }
+  for(y = 0; y != decoder->out_h; ++y) {
+    unsigned char* row = decoder->output + (size_t)y * decoder->output_stride;
+    /*rows that don't start at a byte boundary in the image start at one in the output. copyBits leaves the padding
+    bits at the end of the row as they are*/
+    if(linebits & 7u) {
+      row[linebytes - 1u] = 0;
+      copyBits(row, 0, image, y * linebits, linebits);
+    } else {
+      lodepng_memcpy(row, image + y * linebytes, linebytes);
+    }
+  }
+}
+
+/*gives the rows of the whole image, in the given color mode, to the row callback*/
+static unsigned pushRowsToCallback(LodePNGPushDecoder* decoder, const unsigned char* image,
+                                   const LodePNGColorMode* mode) {
+  size_t linebits = (size_t)decoder->out_w * lodepng_get_bpp(mode);
+  size_t linebytes = (linebits + 7u) / 8u;
+  unsigned char* row = 0;
+  unsigned error = 0, y;
+  /*rows that don't start at a byte boundary in the image are copied first*/
+  if(linebits & 7u) {
+    row = (unsigned char*)lodepng_malloc(linebytes);
+    if(!row) return 83; /*alloc fail*/
+  }
+  for(y = 0; y != decoder->out_h && !error; ++y) {
+    if(row) {
+      /*copyBits leaves the padding bits at the end of the row as they are*/
+      row[linebytes - 1u] = 0;
+      copyBits(row, 0, image, y * linebits, linebits);
+    }
+    if(decoder->row_callback(row ? row : image + y * linebytes, y, decoder->row_context)) error = 116;
+  }
+  lodepng_free(row);
+  return error;
+}
+
+/*replaces the whole image in *out, in the color mode of the output, by its region, reduced*/
+static unsigned pushCropImage(LodePNGPushDecoder* decoder, unsigned char** out) {
+  const LodePNGColorMode* mode = pushOutputMode(decoder);
+  size_t linebits = (size_t)decoder->w * lodepng_get_bpp(mode);
+  size_t outbits = (size_t)decoder->out_w * lodepng_get_bpp(mode);
+  size_t size = lodepng_get_raw_size(decoder->out_w, decoder->out_h, mode);
+  unsigned char* image = (unsigned char*)lodepng_malloc(size);
+  unsigned char* row = 0;
+  unsigned error = 0, y;
+  if(!image) return 83; /*alloc fail*/
+  /*copyBits leaves the padding bits at the end of the image as they are*/
+  if((outbits & 7u) && size) image[size - 1u] = 0;
+  /*rows that don't start at a byte boundary in the image are copied first*/
+  if(linebits & 7u) {
+    row = (unsigned char*)lodepng_malloc((linebits + 7u) / 8u);
+    if(!row) error = 83; /*alloc fail*/
+  }
+  if(!error && decoder->reduce) {
+    error = RowReducer_start(&decoder->reducer, decoder->w, decoder->reduce, mode,
+                             decoder->state->info_png.interlace_method);
+  }
+  for(y = decoder->y0; y != decoder->y1 && !error; ++y) {
+    const unsigned char* in = *out + y * (linebits / 8u);
+    size_t oy = y - decoder->y0;
+    if(row) {
+      copyBits(row, 0, *out, y * linebits, linebits);
+      in = row;
+    }
+    if(decoder->reduce) {
+      if(!RowReducer_add(&decoder->reducer, in, y + 1u == decoder->y1)) continue;
+      in = decoder->reducer.out;
+      oy >>= decoder->reduce;
+    }
+    if(outbits & 7u) copyBits(image, oy * outbits, in, 0, outbits);
+    else lodepng_memcpy(image + oy * (outbits / 8u), in, outbits / 8u);
+  }
+  lodepng_free(row);
+  RowReducer_cleanup(&decoder->reducer);
+  lodepng_free(*out);
+  *out = image;
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+makes room in the image for its first rows rows. The image grows as the rows are produced, rather than being allocated
+whole when the header is read, so that a small corrupt file can't claim the memory of the size its header gives.
+*/
+static unsigned pushReserveImage(LodePNGPushDecoder* decoder, unsigned rows) {
+  size_t needed = ((size_t)rows * decoder->image_linebits + 7u) / 8u;
+  if(needed > decoder->image_size) {
+    size_t full = ((size_t)decoder->image_h * decoder->image_linebits + 7u) / 8u;
+    /*doubles, so that all rows together are copied about once*/
+    size_t size = decoder->image_size > full / 2u ? full : decoder->image_size * 2u;
+    unsigned char* data;
+    if(size < needed) size = needed;
+    data = (unsigned char*)lodepng_realloc(decoder->image, size ? size : 1u);
+    if(!data) return 83; /*alloc fail*/
+    decoder->image = data;
+    decoder->image_size = size;
+  }
+  if(needed > decoder->image_used) {
+    /*rows that don't end at a byte boundary are copied bit by bit, which leaves the padding bits at the end of the
+    image as they are, so clear the new bytes*/
+    if(decoder->image_linebits & 7u) {
+      lodepng_memset(decoder->image + decoder->image_used, 0, needed - decoder->image_used);
+    }
+    decoder->image_used = needed;
+  }
+  return 0;
+}
+
+/*starts the image that grows as rows are produced, with the first row*/
+static unsigned pushStartImage(LodePNGPushDecoder* decoder, unsigned w, unsigned h, const LodePNGColorMode* mode) {
+  decoder->image_linebits = (size_t)w * lodepng_get_bpp(mode);
+  decoder->image_h = h;
+  return pushReserveImage(decoder, h ? 1u : 0u);
+}
+
+/*the start of row y in the output memory of the caller, for rows of whole bytes*/
+static unsigned char* pushOutputRow(const LodePNGPushDecoder* decoder, unsigned y, size_t linebytes) {
+  return decoder->output + (size_t)y * (decoder->output_stride ? decoder->output_stride : linebytes);
+}
+
+/*
+makes the reduced image of an Adam7 interlaced image, in the color mode of the PNG, from the scanlines of only the
+first passes. Those have the top left pixels of all squares of the reduction, which are the output pixels.
+*/
+static unsigned adam7Reduce(LodePNGPushDecoder* decoder, unsigned char* scanlines) {
+  const LodePNGColorMode* mode = &decoder->state->info_png.color;
+  unsigned bpp = lodepng_get_bpp(mode);
+  unsigned passes = 7u - 2u * decoder->reduce;
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned i, x, y;
+
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, decoder->w, decoder->h, bpp);
+  for(i = 0; i != passes; ++i) {
+    CERROR_TRY_RETURN(unfilter(&scanlines[padded_passstart[i]], &scanlines[filter_passstart[i]],
+                               passw[i], passh[i], bpp));
+  }
+
+  for(y = 0; y != decoder->out_h; ++y) {
+    unsigned py = decoder->y0 + (y << decoder->reduce);
+    for(x = 0; x != decoder->out_w; ++x) {
+      unsigned px = x << decoder->reduce;
+      size_t ibp, obp = ((size_t)y * decoder->out_w + x) * bpp;
+      for(i = 0; i != passes; ++i) {
+        if(px % ADAM7_DX[i] == ADAM7_IX[i] && py % ADAM7_DY[i] == ADAM7_IY[i]) break;
+      }
+      /*the unfiltered rows of the pass are padded to whole bytes*/
+      ibp = padded_passstart[i] * 8u + (size_t)((py - ADAM7_IY[i]) / ADAM7_DY[i]) * ((passw[i] * bpp + 7u) / 8u) * 8u
+          + (size_t)((px - ADAM7_IX[i]) / ADAM7_DX[i]) * bpp;
+      if(bpp & 7u) copyBits(decoder->image, obp, scanlines, ibp, bpp);
+      else lodepng_memcpy(decoder->image + obp / 8u, scanlines + ibp / 8u, bpp / 8u);
+    }
+  }
+  return 0;
+}
+
+/*chooses how the rows are converted and stored, when the first row of a non-interlaced image is complete*/
+static unsigned pushStartRows(LodePNGPushDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  const LodePNGColorMode* mode = &state->info_png.color;
+  size_t linebytes = lodepng_get_raw_size_idat(decoder->w, 1, lodepng_get_bpp(mode)) - 1u;
+
+  /*the palette is needed for the conversion, and must come before the image data*/
+  if(mode->colortype == LCT_PALETTE && !mode->palette) return 106; /*error: PNG file must have PLTE chunk*/
+
+  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, mode)) {
+    decoder->convert = PUSH_CONVERT_NONE;
+  } else if(state->info_raw.colortype == LCT_PALETTE) {
+    decoder->convert = PUSH_CONVERT_END; /*this needs a color tree of the whole palette, left to decodeConvert*/
+  } else if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+            && !(state->info_raw.bitdepth == 8)) {
+    return 56; /*unsupported color mode conversion*/
+  } else {
+    decoder->convert = PUSH_CONVERT_ROWS;
+  }
+
+  /*the rows of a region are cropped and reduced as they come, unless they're converted to palette at the end*/
+  decoder->cropped = decoder->region && decoder->convert != PUSH_CONVERT_END;
+
+  /*rows that go to the callback or the output of the caller are not kept, but the conversion to palette at the
+  end needs the image*/
+  if((!decoder->row_callback && !decoder->has_output) || decoder->convert == PUSH_CONVERT_END) {
+    unsigned error = pushStartImage(decoder, decoder->cropped ? decoder->out_w : decoder->w,
+                                    decoder->cropped ? decoder->out_h : decoder->h,
+                                    decoder->convert == PUSH_CONVERT_ROWS ? &state->info_raw : mode);
+    if(error) return error;
+  }
+  /*converted rows that can't go to their place in the output right away*/
+  if(decoder->convert == PUSH_CONVERT_ROWS && (decoder->cropped || (!decoder->image && !decoder->has_output))) {
+    size_t rowsize = lodepng_get_raw_size(decoder->w, 1, &state->info_raw);
+    decoder->row = (unsigned char*)lodepng_malloc(rowsize);
+    if(!decoder->row) return 83; /*alloc fail*/
+    /*the conversion doesn't set the padding bits at the end of the row*/
+    lodepng_memset(decoder->row, 0, rowsize);
+  }
+  if(decoder->cropped && decoder->reduce) {
+    unsigned error = RowReducer_start(&decoder->reducer, decoder->w, decoder->reduce, pushOutputMode(decoder), 0);
+    if(error) return error;
+  }
+  decoder->lines = (unsigned char*)lodepng_malloc(linebytes * 2u);
+  if(!decoder->lines) return 83; /*alloc fail*/
+  return 0;
+}
+
+/*copies row y of the output, of linebits bits, into the output memory of the caller that has no stride. The padding
+bits at the end of the image are cleared, so that the output is the same as that of lodepng_decode.*/
+static void pushOutputBits(LodePNGPushDecoder* decoder, unsigned y, const unsigned char* row, size_t linebits) {
+  size_t end = ((size_t)y + 1u) * linebits;
+  copyBits(decoder->output, y * linebits, row, 0, linebits);
+  if(y + 1u == decoder->out_h && (end & 7u)) {
+    decoder->output[end / 8u] &= (unsigned char)(0xffu << (8u - (end & 7u)));
+  }
+}
+
+/*stores row y of the output, which is in the color mode of the output, where the output goes*/
+static unsigned pushStoreRow(LodePNGPushDecoder* decoder, const unsigned char* row, unsigned y) {
+  size_t linebits = (size_t)decoder->out_w * lodepng_get_bpp(pushOutputMode(decoder));
+  size_t linebytes = (linebits + 7u) / 8u;
+  if(decoder->has_output) {
+    if(decoder->output_stride || linebits == linebytes * 8u) {
+      lodepng_memcpy(pushOutputRow(decoder, y, linebytes), row, linebytes);
+    } else {
+      pushOutputBits(decoder, y, row, linebits);
+    }
+  } else if(decoder->image) {
+    unsigned error = pushReserveImage(decoder, y + 1u);
+    if(error) return error;
+    if(linebits == linebytes * 8u) lodepng_memcpy(decoder->image + y * linebytes, row, linebytes);
+    else copyBits(decoder->image, y * linebits, row, 0, linebits);
+  } else if(decoder->row_callback(row, y, decoder->row_context)) {
+    return 116;
+  }
+  return 0;
+}
+
+/*uses row y of a non-interlaced image, unfiltered in recon, for the output if it is in the region*/
+static unsigned pushRegionRow(LodePNGPushDecoder* decoder, unsigned y, const unsigned char* recon) {
+  LodePNGState* state = decoder->state;
+  const unsigned char* row = recon;
+  unsigned out_y = (y - decoder->y0) >> decoder->reduce;
+  if(y < decoder->y0) return 0; /*only needed to unfilter the next rows*/
+  if(decoder->convert == PUSH_CONVERT_ROWS) {
+    unsigned error = convertPixels(decoder->row, 0, recon, decoder->w, &state->info_raw, &state->info_png.color, 0);
+    if(error) return error;
+    row = decoder->row;
+  }
+  if(decoder->reduce) {
+    if(!RowReducer_add(&decoder->reducer, row, y + 1u == decoder->y1)) return 0;
+    row = decoder->reducer.out;
+  }
+  decoder->rows_done = out_y + 1u;
+  return pushStoreRow(decoder, row, out_y);
+}
+
+/*
+unfilters the complete rows of a non-interlaced image that are in the scanlines, and converts them to the color
+mode of the output right away, so that only the last two unfiltered rows are needed. Gives them to the row
+callback if there is one.
+*/
+static unsigned pushUnfilterRows(LodePNGPushDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t linebits = (size_t)decoder->w * bpp;
+  size_t linebytes = lodepng_get_raw_size_idat(decoder->w, 1, bpp) - 1u;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7u) / 8u;
+  /*rows without padding bits that need no conversion are unfiltered directly into the image*/
+  unsigned direct;
+
+  if(decoder->rows_unfiltered == decoder->h || decoder->region_done
+     || decoder->scanlines.size - decoder->scanlines_pos < linebytes + 1u) {
+    return 0; /*no complete row*/
+  }
+  if(decoder->convert == PUSH_CONVERT_UNKNOWN) {
+    unsigned error = pushStartRows(decoder);
+    if(error) return error;
+  }
+  direct = decoder->image && decoder->convert != PUSH_CONVERT_ROWS && linebits == linebytes * 8u && !decoder->cropped;
+
+  while(decoder->rows_unfiltered < decoder->h && decoder->scanlines.size - decoder->scanlines_pos >= linebytes + 1u) {
+    unsigned error;
+    unsigned y = decoder->rows_unfiltered;
+    const unsigned char* in = decoder->scanlines.data + decoder->scanlines_pos;
+    unsigned char* recon;
+    const unsigned char* precon;
+
+    if(decoder->image && !decoder->cropped) {
+      error = pushReserveImage(decoder, y + 1u);
+      if(error) return error;
+    }
+    if(direct) {
+      recon = decoder->image + y * linebytes;
+      precon = y ? recon - linebytes : 0;
+    } else {
+      recon = decoder->lines + (y & 1u) * linebytes;
+      precon = y ? decoder->lines + ((y + 1u) & 1u) * linebytes : 0;
+    }
+
+    error = unfilterScanline(recon, in + 1, precon, bytewidth, in[0], linebytes);
+    if(error) return error;
+
+    if(decoder->cropped) {
+      error = pushRegionRow(decoder, y, recon);
+      if(error) return error;
+    } else if(decoder->convert == PUSH_CONVERT_ROWS) {
+      if(decoder->has_output) {
+        /*the output mode has whole bytes per pixel, since conversions to fewer bits are not supported*/
+        error = convertPixels(pushOutputRow(decoder, y, lodepng_get_raw_size(decoder->w, 1, &state->info_raw)), 0,
+                              recon, decoder->w, &state->info_raw, &state->info_png.color, 0);
+      } else if(decoder->image) {
+        error = convertPixels(decoder->image, (size_t)y * decoder->w, recon, decoder->w,
+                              &state->info_raw, &state->info_png.color, 0);
+      } else {
+        error = convertPixels(decoder->row, 0, recon, decoder->w, &state->info_raw, &state->info_png.color, 0);
+        if(!error && decoder->row_callback(decoder->row, y, decoder->row_context)) error = 116;
+      }
+      if(error) return error;
+    } else if(!direct) {
+      if(decoder->image) copyBits(decoder->image, y * linebits, recon, 0, linebits);
+      else if(decoder->has_output) {
+        if(decoder->output_stride || linebits == linebytes * 8u) {
+          lodepng_memcpy(pushOutputRow(decoder, y, linebytes), recon, linebytes);
+        } else {
+          pushOutputBits(decoder, y, recon, linebits);
+        }
+      } else if(decoder->row_callback(recon, y, decoder->row_context)) return 116;
+    }
+
+    decoder->scanlines_pos += linebytes + 1u;
+    decoder->rows_unfiltered = y + 1u;
+    if(decoder->cropped) {
+      /*the rest of the image is not needed*/
+      if(y + 1u == decoder->y1) {
+        decoder->region_done = 1;
+        break;
+      }
+    } else if(decoder->convert != PUSH_CONVERT_END) {
+      /*with the conversion at the end, no rows of the output are done before that*/
+      decoder->rows_done = y + 1u;
+    }
+  }
+
+  return 0;
+}
+
+/*removes the unfiltered rows from the front of the scanlines, keeping the last 32768 bytes that the inflater can
+still refer back to*/
+static void pushRemoveScanlines(LodePNGPushDecoder* decoder) {
+  ucvector* scanlines = &decoder->scanlines;
+  size_t amount = decoder->scanlines_pos, i;
+  if(scanlines->size - amount < 32768u) amount = scanlines->size < 32768u ? 0 : scanlines->size - 32768u;
+  if(amount < 65536u) return; /*not worth it yet*/
+
+  decoder->adler = update_adler32(decoder->adler, scanlines->data, (unsigned)amount);
+  /*the ranges can overlap, so this copies forward one by one*/
+  for(i = amount; i != scanlines->size; ++i) scanlines->data[i - amount] = scanlines->data[i];
+  scanlines->size -= amount;
+  decoder->scanlines_pos -= amount;
+  decoder->scanlines_removed += amount;
+}
+
+/*
+inflates as much as possible of the compressed data in, starting at bit bp, and sets *bp to where the inflater
+stopped. If final is 0, more input is to come, else the inflater must finish.
+*/
+static unsigned pushInflate(LodePNGPushDecoder* decoder, const unsigned char* in, size_t insize,
+                            size_t* bp, unsigned final) {
+  LodePNGState* state = decoder->state;
+  unsigned interlaced = state->info_png.interlace_method != 0;
+  LodePNGBitReader reader;
+  unsigned error = LodePNGBitReader_init(&reader, in, insize);
+  if(error) return error;
+  reader.bp = *bp;
+
+  for(;;) {
+    unsigned paused;
+    /*max_output_size is about the output so far, including the scanlines that were removed already*/
+    LodePNGDecompressSettings settings = state->decoder.zlibsettings;
+    if(settings.max_output_size) settings.max_output_size -= decoder->scanlines_removed;
+    /*interlaced images can only be used at the end, then all scanlines are kept anyway, but a reduction may only
+    need the first passes*/
+    if(!interlaced) decoder->inflater.pause_size = decoder->scanlines.size + PUSH_INFLATE_STEP;
+    else if(decoder->adam7_size) decoder->inflater.pause_size = decoder->adam7_size;
+
+    error = inflateResume(&decoder->inflater, &decoder->scanlines, &reader, &settings, final);
+    paused = decoder->inflater.mode != INFLATE_DONE && decoder->scanlines.size >= decoder->inflater.pause_size;
+    if(!error && decoder->scanlines_removed + decoder->scanlines.size > decoder->expected_size) {
+      error = 91; /*decompressed size doesn't match prediction*/
+    }
+    if(!error && !interlaced) {
+      error = pushUnfilterRows(decoder);
+      pushRemoveScanlines(decoder);
+    }
+    if(decoder->adam7_size && decoder->scanlines.size >= decoder->adam7_size) decoder->region_done = 1;
+    /*continue if the inflater paused, rather than waiting for more input*/
+    if(error || !paused || decoder->region_done) break;
+  }
+
+  *bp = reader.bp;
+  return error;
+}
+
+/*uses the next part of the zlib data, after the zlib header*/
+static unsigned pushDeflateData(LodePNGPushDecoder* decoder, const unsigned char* in, size_t insize) {
+  ucvector* zdata = &decoder->zdata;
+  unsigned error = 0;
+
+  while(!error && insize && decoder->inflater.mode != INFLATE_DONE && !decoder->region_done) {
+    if(zdata->size == 0) {
+      /*inflate directly from the input, and keep what could not be used yet until the next input arrives*/
+      size_t bp = decoder->zbp;
+      error = pushInflate(decoder, in, insize, &bp, 0);
+      if(error || decoder->region_done) break;
+      if(!ucvector_resize(zdata, insize - (bp >> 3u))) return 83; /*alloc fail*/
+      lodepng_memcpy(zdata->data, in + (bp >> 3u), zdata->size);
+      decoder->zbp = bp & 7u;
+      insize = 0;
+    } else {
+      /*append a bit of the input to the leftover of the previous input, until the inflater is past the leftover*/
+      size_t oldsize = zdata->size, i;
+      size_t amount = insize < PUSH_INPUT_STEP ? insize : PUSH_INPUT_STEP;
+      size_t bp = decoder->zbp, used;
+      if(!ucvector_resize(zdata, oldsize + amount)) return 83; /*alloc fail*/
+      lodepng_memcpy(zdata->data + oldsize, in, amount);
+      error = pushInflate(decoder, zdata->data, zdata->size, &bp, 0);
+      if(error || decoder->region_done) break;
+      used = bp >> 3u;
+      decoder->zbp = bp & 7u;
+      if(used >= oldsize) {
+        /*continue directly from the input*/
+        in += used - oldsize;
+        insize -= used - oldsize;
+        zdata->size = 0;
+      } else {
+        for(i = used; i != zdata->size; ++i) zdata->data[i - used] = zdata->data[i];
+        zdata->size -= used;
+        in += amount;
+        insize -= amount;
+      }
+    }
+  }
+
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*uses the next part of the data of IDAT chunks*/
+static unsigned pushIdatData(LodePNGPushDecoder* decoder, const unsigned char* in, size_t insize) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(decoder->streaming) {
+    size_t i;
+    /*the adler32 checksum is the last 4 bytes of the zlib data*/
+    if(insize >= 4) lodepng_memcpy(decoder->adler_bytes, in + insize - 4, 4);
+    else {
+      for(i = 0; i != insize; ++i) {
+        decoder->adler_bytes[0] = decoder->adler_bytes[1];
+        decoder->adler_bytes[1] = decoder->adler_bytes[2];
+        decoder->adler_bytes[2] = decoder->adler_bytes[3];
+        decoder->adler_bytes[3] = in[i];
+      }
+    }
+    /*the zlib header*/
+    while(insize && decoder->idat_total < 2) {
+      decoder->zlib_header[decoder->idat_total++] = *in++;
+      insize--;
+      if(decoder->idat_total == 2) {
+        unsigned error = checkZlibHeader(decoder->zlib_header);
+        if(error) return error;
+      }
+    }
+    decoder->idat_total += insize;
+    return pushDeflateData(decoder, in, insize);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(!ucvector_resize(&decoder->idat, decoder->idat.size + insize)) return 83; /*alloc fail*/
+  if(insize) lodepng_memcpy(decoder->idat.data + decoder->idat.size - insize, in, insize);
+  return 0;
+}
+
+/*uses the data gathered in decoder->chunk, which reached its needed size*/
+#ifdef LODEPNG_COMPILE_CRC
+/*starts the CRC of an IDAT chunk with its type, the CRC is continued as the data of the chunk comes*/
+static unsigned pushIdatCrcStart(LodePNGPushDecoder* decoder, const unsigned char* type) {
+  decoder->idat_crc = update_crc32(0u, type, 4);
+  return 0;
+}
+
+static unsigned pushIdatCrcUpdate(LodePNGPushDecoder* decoder, const unsigned char* data, size_t size) {
+  decoder->idat_crc = update_crc32(decoder->idat_crc, data, size);
+  return 0;
+}
+
+static unsigned pushIdatCrc(const LodePNGPushDecoder* decoder) {
+  return decoder->idat_crc;
+}
+#else /*LODEPNG_COMPILE_CRC*/
+/*the external lodepng_crc32 can't continue a CRC, so the type and data of an IDAT chunk are gathered for it, unless
+the CRC is ignored*/
+static unsigned pushIdatCrcUpdate(LodePNGPushDecoder* decoder, const unsigned char* data, size_t size) {
+  size_t pos = decoder->idat_chunk.size;
+  if(decoder->state->decoder.ignore_crc) return 0;
+  if(!ucvector_resize(&decoder->idat_chunk, pos + size)) return 83; /*alloc fail*/
+  lodepng_memcpy(decoder->idat_chunk.data + pos, data, size);
+  return 0;
+}
+
+static unsigned pushIdatCrcStart(LodePNGPushDecoder* decoder, const unsigned char* type) {
+  decoder->idat_chunk.size = 0;
+  return pushIdatCrcUpdate(decoder, type, 4);
+}
+
+static unsigned pushIdatCrc(const LodePNGPushDecoder* decoder) {
+  return lodepng_crc32(decoder->idat_chunk.data, decoder->idat_chunk.size);
+}
+#endif /*LODEPNG_COMPILE_CRC*/
+
+static unsigned pushChunk(LodePNGPushDecoder* decoder) {
+  LodePNGState* state = decoder->state;
+  const unsigned char* chunk = decoder->chunk.data;
+  unsigned error = 0;
+
+  if(decoder->phase == PUSH_HEADER) {
+    /*reads header and resets other parameters in state->info_png*/
+    error = lodepng_inspect(&decoder->w, &decoder->h, state, chunk, 33);
+    if(error) return error;
+    if(lodepng_pixel_overflow(decoder->w, decoder->h, &state->info_png.color, &state->info_raw)) {
+      return 92; /*overflow possible due to amount of pixels*/
+    }
+    decoder->out_w = decoder->w;
+    decoder->out_h = decoder->h;
+    error = getRegion(&decoder->y0, &decoder->y1, &decoder->out_w, &decoder->out_h, &state->decoder);
+    if(error) return error;
+    decoder->reduce = state->decoder.reduce;
+    decoder->region = decoder->y0 != 0 || decoder->y1 != decoder->h || decoder->reduce;
+    if(decoder->has_output) {
+      error = pushCheckOutput(decoder);
+      if(error) return error;
+    }
+    decoder->expected_size = lodepng_get_raw_size_scanlines(decoder->w, decoder->h, &state->info_png);
+#ifdef LODEPNG_COMPILE_ZLIB
+    /*custom zlib or inflate functions need all the zlib data at once*/
+    decoder->streaming = !state->decoder.zlibsettings.custom_zlib && !state->decoder.zlibsettings.custom_inflate;
+    if(decoder->reduce && state->info_png.interlace_method != 0) {
+      /*the pixels of the reduced image are all in the first passes*/
+      unsigned passw[7], passh[7];
+      size_t filter_passstart[8], padded_passstart[8], passstart[8];
+      Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart,
+                          decoder->w, decoder->h, lodepng_get_bpp(&state->info_png.color));
+      decoder->adam7_size = filter_passstart[7u - 2u * decoder->reduce];
+    }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    decoder->phase = PUSH_CHUNK_HEADER;
+    decoder->chunk_need = 8;
+  } else if(decoder->phase == PUSH_CHUNK_HEADER) {
+    unsigned chunkLength = lodepng_chunk_length(chunk);
+    /*error: chunk length larger than the max PNG chunk size*/
+    if(chunkLength > 2147483647) {
+      if(state->decoder.ignore_end) {
+        decoder->phase = PUSH_END; /*other errors may still happen though*/
+        return 0;
+      }
+      return 63;
+    }
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      decoder->critical_pos = 3;
+      decoder->idat_left = chunkLength;
+      error = pushIdatCrcStart(decoder, chunk + 4);
+      if(error) return error;
+      decoder->phase = chunkLength ? PUSH_IDAT_DATA : PUSH_IDAT_CRC;
+      decoder->chunk.size = 0;
+      decoder->chunk_need = 4;
+    } else {
+      decoder->phase = PUSH_CHUNK;
+      decoder->chunk_need = (size_t)chunkLength + 12u;
+    }
+    return 0;
+  } else if(decoder->phase == PUSH_IDAT_CRC) {
+    if(!state->decoder.ignore_crc && lodepng_read32bitInt(chunk) != pushIdatCrc(decoder)) {
+      return 57; /*invalid CRC*/
+    }
+    decoder->phase = PUSH_CHUNK_HEADER;
+    decoder->chunk_need = 8;
+  } else /*if(decoder->phase == PUSH_CHUNK)*/ {
+    if(lodepng_chunk_type_equals(chunk, "IEND")) {
+      if(!state->decoder.ignore_crc && lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+      decoder->phase = PUSH_END;
+      return 0;
+    }
+    /*this also checks the CRC*/
+    error = decodeChunk(state, chunk, &decoder->critical_pos);
+    if(error) return error;
+    /*decoding on multiple threads needs all zlib data at once*/
+    if(segmentIndexUsable(state, decoder->w, decoder->h)) decoder->streaming = 0;
+    decoder->phase = PUSH_CHUNK_HEADER;
+    decoder->chunk_need = 8;
+  }
+
+  decoder->chunk.size = 0;
+  return 0;
+}
+
+unsigned lodepng_push_decoder_write(LodePNGPushDecoder* decoder, const unsigned char* in, size_t insize) {
+  LodePNGState* state = decoder->state;
+
+  while(insize && !state->error && decoder->phase != PUSH_END) {
+    if(decoder->phase == PUSH_IDAT_DATA) {
+      size_t amount = insize < decoder->idat_left ? insize : decoder->idat_left;
+      state->error = pushIdatCrcUpdate(decoder, in, amount);
+      if(!state->error) state->error = pushIdatData(decoder, in, amount);
+      decoder->idat_left -= amount;
+      if(!decoder->idat_left) decoder->phase = PUSH_IDAT_CRC;
+      in += amount;
+      insize -= amount;
+    } else {
+      size_t amount = decoder->chunk_need - decoder->chunk.size;
+      if(amount > insize) amount = insize;
+      if(!ucvector_resize(&decoder->chunk, decoder->chunk.size + amount)) CERROR_BREAK(state->error, 83);
+      lodepng_memcpy(decoder->chunk.data + decoder->chunk.size - amount, in, amount);
+      in += amount;
+      insize -= amount;
+      if(decoder->chunk.size == decoder->chunk_need) state->error = pushChunk(decoder);
+    }
+  }
+
+  return state->error;
+}
+
+unsigned lodepng_push_decoder_finish(LodePNGPushDecoder* decoder, unsigned char** out, unsigned* w, unsigned* h) {
+  LodePNGState* state = decoder->state;
+
+  /* safe output values in case error happens */
+  *out = 0;
+  *w = *h = 0;
+  if(state->error) return state->error;
+
+  if(decoder->phase == PUSH_HEADER) {
+    /*gives the error for too small or empty data*/
+    return lodepng_inspect(w, h, state, decoder->chunk.data, decoder->chunk.size);
+  } else if(decoder->phase == PUSH_CHUNK_HEADER) {
+    if(!state->decoder.ignore_end) CERROR_RETURN_ERROR(state->error, 30); /*error: no IEND chunk*/
+  } else if(decoder->phase != PUSH_END) {
+    CERROR_RETURN_ERROR(state->error, 64); /*error: the data ends in the middle of a chunk*/
+  }
+
+  if(state->info_png.color.colortype == LCT_PALETTE && !state->info_png.color.palette) {
+    CERROR_RETURN_ERROR(state->error, 106); /* error: PNG file must have PLTE chunk if color type is palette */
+  }
+
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(decoder->streaming) {
+    const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+    if(decoder->idat_total < 2) CERROR_RETURN_ERROR(state->error, 53); /*error, size of zlib data too small*/
+    if(decoder->inflater.mode != INFLATE_DONE && !decoder->region_done) {
+      state->error = pushInflate(decoder, decoder->zdata.data, decoder->zdata.size, &decoder->zbp, 1);
+      if(state->error) return state->error;
+    }
+    /*the checks need all data, which is not decompressed if the region was done before*/
+    if(!settings->ignore_adler32 && !decoder->region_done) {
+      unsigned ADLER32 = lodepng_read32bitInt(decoder->adler_bytes);
+      unsigned checksum = update_adler32(decoder->adler, decoder->scanlines.data, (unsigned)decoder->scanlines.size);
+      /*error, adler checksum not correct, data must be corrupted*/
+      if(checksum != ADLER32) CERROR_RETURN_ERROR(state->error, 58);
+    }
+    if(!decoder->region_done && decoder->scanlines_removed + decoder->scanlines.size != decoder->expected_size) {
+      CERROR_RETURN_ERROR(state->error, 91); /*decompressed size doesn't match prediction*/
+    }
+    if(decoder->adam7_size) {
+      state->error = pushAllocateImage(decoder, decoder->out_w, decoder->out_h, &state->info_png.color);
+      if(!state->error) state->error = adam7Reduce(decoder, decoder->scanlines.data);
+      if(state->error) return state->error;
+      decoder->cropped = 1;
+    } else if(state->info_png.interlace_method != 0) {
+      state->error = pushAllocateImage(decoder, decoder->w, decoder->h, &state->info_png.color);
+      if(!state->error) {
+        state->error = postProcessScanlines(decoder->image, decoder->scanlines.data,
+                                            decoder->w, decoder->h, &state->info_png);
+      }
+      if(state->error) return state->error;
+    }
+  } else
+#endif /*LODEPNG_COMPILE_ZLIB*/
+#ifdef LODEPNG_USE_THREADS
+  if(segmentIndexUsable(state, decoder->w, decoder->h)
+     && !decodeSegmented(&decoder->image, decoder->idat.data, decoder->idat.size, decoder->w, decoder->h, state)) {
+    /*decoded on multiple threads*/
+  } else
+#endif /*LODEPNG_USE_THREADS*/
+  {
+    unsigned char* scanlines = 0;
+    size_t scanlines_size = 0;
+    state->error = zlib_decompress(&scanlines, &scanlines_size, decoder->expected_size,
+                                   decoder->idat.data, decoder->idat.size, &state->decoder.zlibsettings);
+    if(!state->error && scanlines_size != decoder->expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
+    if(!state->error) state->error = pushAllocateImage(decoder, decoder->w, decoder->h, &state->info_png.color);
+    if(!state->error) {
+      state->error = postProcessScanlines(decoder->image, scanlines, decoder->w, decoder->h, &state->info_png);
+    }
+    lodepng_free(scanlines);
+    if(state->error) return state->error;
+  }
+
+  /*the image now belongs to the caller*/
+  *out = decoder->image;
+  decoder->image = 0;
+  if(decoder->convert != PUSH_CONVERT_ROWS) {
+    state->error = decodeConvert(out, decoder->cropped ? decoder->out_w : decoder->w,
+                                 decoder->cropped ? decoder->out_h : decoder->h, state);
+  }
+  if(!state->error && decoder->region && !decoder->cropped) state->error = pushCropImage(decoder, out);
+  /*give the rows that were not given yet to the output of the caller or the callback, the image is then not
+  output*/
+  if(!state->error && (decoder->has_output || decoder->row_callback)
+     && (decoder->convert == PUSH_CONVERT_UNKNOWN || decoder->convert == PUSH_CONVERT_END)) {
+    if(decoder->has_output) pushImageToOutput(decoder, *out);
+    else state->error = pushRowsToCallback(decoder, *out, &state->info_raw);
+    lodepng_free(*out);
+    *out = 0;
+  }
+  if(state->error) {
+    lodepng_free(*out);
+    *out = 0;
+    return state->error;
+  }
+  decoder->rows_done = decoder->out_h;
+  *w = decoder->out_w;
+  *h = decoder->out_h;
+  return 0;
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, size_t stride, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize) {
+  unsigned char* image;
+  unsigned error;
+  LodePNGPushDecoder* decoder = lodepng_push_decoder_new(state);
+  *w = *h = 0;
+  if(!decoder) return 83; /*alloc fail*/
+  lodepng_push_decoder_set_output(decoder, out, outsize, stride);
+  /*all data at once, so the zlib data is inflated straight from in*/
+  error = lodepng_push_decoder_write(decoder, in, insize);
+  if(!error) error = lodepng_push_decoder_finish(decoder, &image, w, h);
+  /*the size of the image is also given when it doesn't fit the output, to know how much is needed*/
+  if(error == 117) {
+    *w = decoder->out_w;
+    *h = decoder->out_h;
+  }
+  lodepng_push_decoder_delete(decoder);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+/*the size of the parts in which lodepng_decode_file reads the file*/
+static const size_t DECODE_FILE_PART_SIZE = 65536;
+
+/*decodes the file into *out, or if into is 1, into the output memory of the caller*/
+static unsigned decodeFile(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
+                           LodePNGColorType colortype, unsigned bitdepth,
+                           unsigned into, unsigned char* output, size_t outputsize, size_t stride) {
+  unsigned char* buffer = 0;
+  unsigned error = 0;
+  FILE* file = 0;
+  const unsigned char* mapped = 0;
+  size_t mappedsize = 0;
+  LodePNGState state;
+  LodePNGPushDecoder* decoder;
+  /* safe output values in case error happens */
+  *out = 0;
+  *w = *h = 0;
+
+#ifdef LODEPNG_USE_MMAP
+  mapped = lodepng_map_file(&mappedsize, filename);
+#endif /*LODEPNG_USE_MMAP*/
+  if(!mapped) {
+    file = fopen(filename, "rb");
+    if(!file) return 78;
+  }
+
+  lodepng_state_init(&state);
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*disable reading things that this function doesn't output*/
+  state.decoder.read_text_chunks = 0;
+  state.decoder.remember_unknown_chunks = 0;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+  decoder = lodepng_push_decoder_new(&state);
+  if(!decoder) error = 83; /*alloc fail*/
+  if(!error && into) lodepng_push_decoder_set_output(decoder, output, outputsize, stride);
+  if(!error && mapped) {
+    /*the whole file at once, so the zlib data is inflated straight from the mapping*/
+    error = lodepng_push_decoder_write(decoder, mapped, mappedsize);
+  } else if(!error) {
+    /*decode while reading, rather than loading the whole file first*/
+    buffer = (unsigned char*)lodepng_malloc(DECODE_FILE_PART_SIZE);
+    if(!buffer) error = 83; /*alloc fail*/
+    while(!error) {
+      size_t readsize = fread(buffer, 1, DECODE_FILE_PART_SIZE, file);
+      if(readsize == 0) {
+        if(ferror(file)) error = 78;
+        break;
+      }
+      error = lodepng_push_decoder_write(decoder, buffer, readsize);
+    }
+  }
+  if(!error) error = lodepng_push_decoder_finish(decoder, out, w, h);
+  /*the size of the image is also given when it doesn't fit the output, to know how much is needed*/
+  if(error == 117) {
+    *w = decoder->out_w;
+    *h = decoder->out_h;
+  }
+
+  if(file) fclose(file);
+#ifdef LODEPNG_USE_MMAP
+  if(mapped) lodepng_unmap_file(mapped, mappedsize);
+#endif /*LODEPNG_USE_MMAP*/
+  lodepng_free(buffer);
+  lodepng_push_decoder_delete(decoder);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
+                             LodePNGColorType colortype, unsigned bitdepth) {
+  return decodeFile(out, w, h, filename, colortype, bitdepth, 0, 0, 0, 0);
+}
+
+unsigned lodepng_decode_file_into(unsigned char* out, size_t outsize, size_t stride, unsigned* w, unsigned* h,
+                                  const char* filename, LodePNGColorType colortype, unsigned bitdepth) {
+  unsigned char* image;
+  return decodeFile(&image, w, h, filename, colortype, bitdepth, 1, out, outsize, stride);
+}
+
+unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename) {
+  return lodepng_decode_file(out, w, h, filename, LCT_RGBA, 8);
+}
+
+unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename) {
+  return lodepng_decode_file(out, w, h, filename, LCT_RGB, 8);
+}
+#endif /*LODEPNG_COMPILE_DISK*/
+
+void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings) {
+  settings->color_convert = 1;
+  settings->num_threads = 1;
+  settings->region_y0 = 0;
+  settings->region_y1 = 0;
+  settings->reduce = 0;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  settings->read_text_chunks = 1;
+  settings->remember_unknown_chunks = 0;
+  settings->max_text_size = 16777216;
+  settings->max_icc_size = 16777216; /* 16MB is much more than enough for any reasonable ICC profile */
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  settings->ignore_crc = 0;
+  settings->ignore_critical = 0;
+  settings->ignore_end = 0;
+  lodepng_decompress_settings_init(&settings->zlibsettings);
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 #if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
 
@@ -5593,28 +8872,64 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info) {
   return 0;
 }
 
-static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings) {
+/*splits the zlib data over as few IDAT chunks as possible*/
+static unsigned addIDATChunks(ucvector* out, const unsigned char* zlib, size_t zlibsize) {
   unsigned error = 0;
-  unsigned char* zlib = 0;
   size_t pos = 0;
-  size_t zlibsize = 0;
   /* max chunk length allowed by the specification is 2147483647 bytes */
   const size_t max_chunk_length = 2147483647u;
 
-  error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings);
-  while(!error) {
+  for(;;) {
     if(zlibsize - pos > max_chunk_length) {
       error = lodepng_chunk_createv(out, max_chunk_length, "IDAT", zlib + pos);
+      if(error) return error;
       pos += max_chunk_length;
     } else {
-      error = lodepng_chunk_createv(out, zlibsize - pos, "IDAT", zlib + pos);
-      break;
+      return lodepng_chunk_createv(out, zlibsize - pos, "IDAT", zlib + pos);
+    }
+  }
+}
+
+static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
+                              LodePNGCompressSettings* zlibsettings) {
+  unsigned char* zlib = 0;
+  size_t zlibsize = 0;
+  unsigned error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings);
+  if(!error) error = addIDATChunks(out, zlib, zlibsize);
+  lodepng_free(zlib);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*the segment index chunk (sgIX) followed by the IDAT chunks, with the zlib data compressed in segments of
+segment_rows scanlines. For zlib data too large for the index, there are only the IDAT chunks.*/
+static unsigned addChunks_sgIX_IDAT(ucvector* out, const unsigned char* data, size_t datasize, unsigned h,
+                                    unsigned segment_rows, const LodePNGCompressSettings* zlibsettings) {
+  unsigned char* zlib = 0;
+  size_t zlibsize = 0;
+  uivector offsets;
+  unsigned error;
+
+  uivector_init(&offsets);
+  error = zlib_compress_segments(&zlib, &zlibsize, &offsets, data, datasize, datasize / h * segment_rows,
+                                 zlibsettings);
+  if(!error && offsets.size) {
+    unsigned char* chunk;
+    error = lodepng_chunk_init(&chunk, out, 4u + 4u * offsets.size, "sgIX");
+    if(!error) {
+      size_t i;
+      lodepng_set32bitInt(chunk + 8, segment_rows);
+      for(i = 0; i != offsets.size; ++i) lodepng_set32bitInt(chunk + 12 + 4 * i, offsets.data[i]);
+      lodepng_chunk_generate_crc(chunk);
     }
   }
+  if(!error) error = addIDATChunks(out, zlib, zlibsize);
+
+  uivector_cleanup(&offsets);
   lodepng_free(zlib);
   return error;
 }
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
 static unsigned addChunk_IEND(ucvector* out) {
   return lodepng_chunk_createv(out, 0, "IEND", 0);
@@ -5845,20 +9160,206 @@ static unsigned addChunk_sBIT(ucvector* out, const LodePNGInfo* info) {
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType) {
+#ifdef LODEPNG_SIMD_X86
+/*the sum of the four 64-bit lanes of _mm_sad_epu8 results*/
+static LODEPNG_INLINE size_t sumLanesSSE2(__m128i total) {
+  __m128i both = _mm_add_epi64(total, _mm_srli_si128(total, 8));
+  size_t low = (unsigned)_mm_cvtsi128_si32(both), high = (unsigned)_mm_cvtsi128_si32(_mm_srli_epi64(both, 32));
+  return low + ((high << 16u) << 16u);
+}
+
+/*
+Filters the bytes of a scanline from start on in blocks of 16, for filter type 0 or 1, or 2 to 4 with a previous
+scanline. Unlike unfiltering, every byte only depends on the input, so this works for any bytewidth. If sum is not
+NULL, adds the sum of the filtered bytes as LFS_MINSUM computes it to *sum. Returns where it stopped.
+*/
+static size_t filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t start, size_t length, size_t bytewidth, unsigned char filterType,
+                                 size_t* sum) {
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i ones = _mm_set1_epi8(-1);
+  __m128i total = zero;
+  for(i = start; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i a, b, c;
+    if(filterType == 1) {
+      x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth)));
+    } else if(filterType == 2) {
+      x = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(prevline + i)));
+    } else if(filterType == 3) {
+      a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+      b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      /*_mm_avg_epu8 rounds up, the filter rounds down*/
+      x = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+    } else if(filterType == 4) {
+      /*pa = |b - c| and pb = |a - c| fit in 8 bits, pc = |a + b - 2c| is computed in 16 bits and saturated to
+      8 bits, which keeps which of the three is smallest*/
+      __m128i pa, pb, pc, smallest, nearest;
+      a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+      b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+      pa = _mm_or_si128(_mm_subs_epu8(b, c), _mm_subs_epu8(c, b));
+      pb = _mm_or_si128(_mm_subs_epu8(a, c), _mm_subs_epu8(c, a));
+      {
+        __m128i c_low = _mm_unpacklo_epi8(c, zero), c_high = _mm_unpackhi_epi8(c, zero);
+        __m128i low = _mm_add_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(a, zero), c_low),
+                                    _mm_sub_epi16(_mm_unpacklo_epi8(b, zero), c_low));
+        __m128i high = _mm_add_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(a, zero), c_high),
+                                     _mm_sub_epi16(_mm_unpackhi_epi8(b, zero), c_high));
+        low = _mm_max_epi16(low, _mm_sub_epi16(zero, low));
+        high = _mm_max_epi16(high, _mm_sub_epi16(zero, high));
+        pc = _mm_packus_epi16(low, high);
+      }
+      smallest = _mm_min_epu8(pc, _mm_min_epu8(pa, pb));
+      /*c, replaced by b if pb is smallest, replaced by a if pa is smallest, as paethPredictor chooses*/
+      nearest = _mm_xor_si128(c, _mm_and_si128(_mm_xor_si128(b, c), _mm_cmpeq_epi8(pb, smallest)));
+      nearest = _mm_xor_si128(nearest, _mm_and_si128(_mm_xor_si128(a, nearest), _mm_cmpeq_epi8(pa, smallest)));
+      x = _mm_sub_epi8(x, nearest);
+    }
+    _mm_storeu_si128((__m128i*)(out + i), x);
+    /*min(s, 255 - s) is the magnitude of the signed byte s as LFS_MINSUM computes it*/
+    if(filterType) x = _mm_min_epu8(x, _mm_xor_si128(x, ones));
+    total = _mm_add_epi64(total, _mm_sad_epu8(x, zero));
+  }
+  if(sum) *sum += sumLanesSSE2(total);
+  return i;
+}
+
+/*the same as filterScanlineSSE2 in blocks of 32*/
+LODEPNG_TARGET("avx2")
+static size_t filterScanlineAVX2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t start, size_t length, size_t bytewidth, unsigned char filterType,
+                                 size_t* sum) {
+  size_t i;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i ones = _mm256_set1_epi8(-1);
+  __m256i total = zero;
+  for(i = start; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i a, b, c;
+    if(filterType == 1) {
+      x = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth)));
+    } else if(filterType == 2) {
+      x = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(prevline + i)));
+    } else if(filterType == 3) {
+      a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+      b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      x = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one)));
+    } else if(filterType == 4) {
+      /*the unpacks and the pack work within each 128-bit half, so they keep the order*/
+      __m256i pa, pb, pc, smallest, nearest;
+      a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+      b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      c = _mm256_loadu_si256((const __m256i*)(prevline + i - bytewidth));
+      pa = _mm256_or_si256(_mm256_subs_epu8(b, c), _mm256_subs_epu8(c, b));
+      pb = _mm256_or_si256(_mm256_subs_epu8(a, c), _mm256_subs_epu8(c, a));
+      {
+        __m256i c_low = _mm256_unpacklo_epi8(c, zero), c_high = _mm256_unpackhi_epi8(c, zero);
+        __m256i low = _mm256_add_epi16(_mm256_sub_epi16(_mm256_unpacklo_epi8(a, zero), c_low),
+                                       _mm256_sub_epi16(_mm256_unpacklo_epi8(b, zero), c_low));
+        __m256i high = _mm256_add_epi16(_mm256_sub_epi16(_mm256_unpackhi_epi8(a, zero), c_high),
+                                        _mm256_sub_epi16(_mm256_unpackhi_epi8(b, zero), c_high));
+        pc = _mm256_packus_epi16(_mm256_abs_epi16(low), _mm256_abs_epi16(high));
+      }
+      smallest = _mm256_min_epu8(pc, _mm256_min_epu8(pa, pb));
+      nearest = _mm256_xor_si256(c, _mm256_and_si256(_mm256_xor_si256(b, c), _mm256_cmpeq_epi8(pb, smallest)));
+      nearest = _mm256_xor_si256(nearest,
+                                 _mm256_and_si256(_mm256_xor_si256(a, nearest), _mm256_cmpeq_epi8(pa, smallest)));
+      x = _mm256_sub_epi8(x, nearest);
+    }
+    _mm256_storeu_si256((__m256i*)(out + i), x);
+    if(filterType) x = _mm256_min_epu8(x, _mm256_xor_si256(x, ones));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(x, zero));
+  }
+  if(sum) {
+    *sum += sumLanesSSE2(_mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1)));
+  }
+  return i;
+}
+
+static size_t filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t start, size_t length, size_t bytewidth, unsigned char filterType,
+                                 size_t* sum) {
+  if(lodepng_cpu_features() & LODEPNG_CPU_AVX2) {
+    start = filterScanlineAVX2(out, scanline, prevline, start, length, bytewidth, filterType, sum);
+  }
+  return filterScanlineSSE2(out, scanline, prevline, start, length, bytewidth, filterType, sum);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*Same as filterScanlineSSE2*/
+static size_t filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t start, size_t length, size_t bytewidth, unsigned char filterType,
+                                 size_t* sum) {
   size_t i;
+  uint64x2_t total = vdupq_n_u64(0);
+  for(i = start; i + 16 <= length; i += 16) {
+    uint8x16_t x = vld1q_u8(scanline + i);
+    uint8x16_t a, b, c;
+    if(filterType == 1) {
+      x = vsubq_u8(x, vld1q_u8(scanline + i - bytewidth));
+    } else if(filterType == 2) {
+      x = vsubq_u8(x, vld1q_u8(prevline + i));
+    } else if(filterType == 3) {
+      /*the halving add rounds down like the filter*/
+      x = vsubq_u8(x, vhaddq_u8(vld1q_u8(scanline + i - bytewidth), vld1q_u8(prevline + i)));
+    } else if(filterType == 4) {
+      /*pc = |a + b - 2c| needs 16 bits, saturating it to 8 bits keeps the comparisons with pa and pb*/
+      uint8x16_t pa, pb, pc, choose_a, choose_b;
+      a = vld1q_u8(scanline + i - bytewidth);
+      b = vld1q_u8(prevline + i);
+      c = vld1q_u8(prevline + i - bytewidth);
+      pa = vabdq_u8(b, c);
+      pb = vabdq_u8(a, c);
+      pc = vcombine_u8(vqmovn_u16(vabdq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)),
+                                            vaddl_u8(vget_low_u8(c), vget_low_u8(c)))),
+                       vqmovn_u16(vabdq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)),
+                                            vaddl_u8(vget_high_u8(c), vget_high_u8(c)))));
+      /*choose with the same priority as paethPredictor*/
+      choose_a = vandq_u8(vcleq_u8(pa, pb), vcleq_u8(pa, pc));
+      choose_b = vcleq_u8(pb, pc);
+      x = vsubq_u8(x, vbslq_u8(choose_a, a, vbslq_u8(choose_b, b, c)));
+    }
+    vst1q_u8(out + i, x);
+    if(filterType) x = vminq_u8(x, vmvnq_u8(x));
+    total = vpadalq_u32(total, vpaddlq_u16(vpaddlq_u8(x)));
+  }
+  if(sum) *sum += (size_t)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+  return i;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*
+Filters a scanline with the filter type. Without previous scanline, Up is the same as None and Paeth as Sub. If sum
+is not NULL, it receives the sum of the filtered bytes that LFS_MINSUM minimizes: the bytes as unsigned values for
+None, their magnitude as signed values otherwise.
+*/
+static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t length, size_t bytewidth, unsigned char filterType, size_t* sum) {
+  size_t i, end = bytewidth; /*the SIMD code does the bytes from bytewidth to end*/
+  if(sum) *sum = 0;
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  if(filterType <= 1 || (filterType <= 4 && prevline)) {
+    end = filterScanlineSIMD(out, scanline, prevline, bytewidth, length, bytewidth, filterType, sum);
+  }
+#endif
   switch(filterType) {
     case 0: /*None*/
-      for(i = 0; i != length; ++i) out[i] = scanline[i];
+      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+      for(i = end; i < length; ++i) out[i] = scanline[i];
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      for(i = end; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline) {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = end; i < length; ++i) out[i] = scanline[i] - prevline[i];
       } else {
         for(i = 0; i != length; ++i) out[i] = scanline[i];
       }
@@ -5866,7 +9367,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
     case 3: /*Average*/
       if(prevline) {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        for(i = end; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
         for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
@@ -5876,7 +9377,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline) {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i) {
+        for(i = end; i < length; ++i) {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
       } else {
@@ -5887,17 +9388,11 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     default: return; /*invalid filter type given*/
   }
-}
-
-/* integer binary logarithm, max return value is 31 */
-static size_t ilog2(size_t i) {
-  size_t result = 0;
-  if(i >= 65536) { result += 16; i >>= 16; }
-  if(i >= 256) { result += 8; i >>= 8; }
-  if(i >= 16) { result += 4; i >>= 4; }
-  if(i >= 4) { result += 2; i >>= 2; }
-  if(i >= 2) { result += 1; /*i >>= 1;*/ }
-  return result;
+  if(sum) {
+    /*the bytes the SIMD code didn't sum*/
+    for(i = 0; i != bytewidth; ++i) *sum += filterType == 0 || out[i] < 128 ? out[i] : 255u - out[i];
+    for(i = end; i < length; ++i) *sum += filterType == 0 || out[i] < 128 ? out[i] : 255u - out[i];
+  }
 }
 
 /* integer approximation for i * log2(i), helper function for LFS_ENTROPY */
@@ -5910,50 +9405,42 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (((size_t)1) << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+/* log2(i) * 16 for i >= 1, with the fractional part linearly approximated as in ilog2i, helper function for
+LFS_ESTIMATE */
+static unsigned ilog2fix(size_t i) {
+  size_t l = ilog2(i);
+  return (unsigned)(l * 16u + (l >= 4u ? i >> (l - 4u) : i << (4u - l)) - 16u);
+}
 
-  unsigned bpp = lodepng_get_bpp(color);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+/*the estimated size in 1/16 bits of a filtered scanline from the bit costs of the byte values, where a byte that
+repeats the one before it costs a sixteenth, since LZ77 makes runs cheap. Helper function for LFS_ESTIMATE*/
+static size_t filterCostEstimate(const unsigned char* data, size_t length, const unsigned* bitcost) {
+  size_t i, cost = length ? bitcost[data[0]] : 0;
+  for(i = 1; i < length; ++i) {
+    unsigned c = bitcost[data[i]];
+    cost += data[i] == data[i - 1] ? c >> 4u : c;
+  }
+  return cost;
+}
 
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+/*
+filters numrows scanlines of in into out with the strategy, where prevline is the scanline before them, or NULL at
+the top of the image, and predefined_filters has their filter types for LFS_PREDEFINED. The choice of filter of each
+row only depends on the input, so any range of rows can be filtered on its own.
+*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                           size_t linebytes, size_t bytewidth, unsigned numrows, LodePNGFilterStrategy strategy,
+                           const unsigned char* predefined_filters, const LodePNGEncoderSettings* settings) {
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) strategy = LFS_ZERO;
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
+    for(y = 0; y != numrows; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type, 0);
       prevline = &in[inindex];
     }
   } else if(strategy == LFS_MINSUM) {
@@ -5968,24 +9455,14 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = 0; y != numrows; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
+          size_t sum;
+          /*For differences, each byte is treated as signed, values above 127 are negative (converted to signed
+          char). Filtertype 0 isn't a difference though, so it sums unsigned there. This means filtertype 0 is
+          almost never chosen, but that is justified.*/
+          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, &sum);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum < smallest) {
@@ -6015,11 +9492,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = 0; y != numrows; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, 0);
           lodepng_memset(count, 0, 256 * sizeof(*count));
           for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
           ++count[type]; /*the filter type itself is part of the scanline*/
@@ -6041,14 +9518,65 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
 
+    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+  } else if(strategy == LFS_ESTIMATE) {
+    /*the three filters with the smallest sum are ranked by their estimated compressed size, with the statistics of
+    the bytes of the rows before, in which older rows count less*/
+    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+    unsigned char tried[5];
+    size_t sum[5], cost, bestCost = 0, total;
+    unsigned type, bestType = 0, i;
+    unsigned counts[256], bitcost[256];
+
+    for(type = 0; type != 5; ++type) {
+      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      if(!attempt[type]) error = 83; /*alloc fail*/
+    }
+
+    if(!error) {
+      lodepng_memset(counts, 0, 256 * sizeof(*counts));
+      for(y = 0; y != numrows; ++y) {
+        /*bit cost of each byte value, in 1/16 bits, where values not seen yet count as seen once*/
+        total = 256;
+        for(x = 0; x != 256; ++x) total += counts[x];
+        for(x = 0; x != 256; ++x) bitcost[x] = ilog2fix(total) - ilog2fix(counts[x] + 1u);
+
+        for(type = 0; type != 5; ++type) {
+          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, &sum[type]);
+          tried[type] = 0;
+        }
+        for(i = 0; i != 3; ++i) {
+          unsigned smallest = 5;
+          for(type = 0; type != 5; ++type) {
+            if(!tried[type] && (smallest == 5 || sum[type] < sum[smallest])) smallest = type;
+          }
+          tried[smallest] = 1;
+          cost = filterCostEstimate(attempt[smallest], linebytes, bitcost);
+          if(i == 0 || cost < bestCost) {
+            bestType = smallest;
+            bestCost = cost;
+          }
+        }
+
+        prevline = &in[y * linebytes];
+
+        for(x = 0; x != 256; ++x) counts[x] -= counts[x] >> 2u;
+        for(x = 0; x != linebytes; ++x) ++counts[attempt[bestType][x]];
+
+        /*now fill the out values*/
+        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
+      }
+    }
+
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
+    for(y = 0; y != numrows; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
+      unsigned char type = predefined_filters[y];
       out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type, 0);
       prevline = &in[inindex];
     }
   } else if(strategy == LFS_BRUTE_FORCE) {
@@ -6071,17 +9599,19 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*the rows may already be filtered on multiple threads, and their size must not depend on the setting*/
+    zlibsettings.num_threads = 1;
     for(type = 0; type != 5; ++type) {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = 0; y != numrows; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
 
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type, 0);
           size[type] = 0;
           dummy = 0;
           zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
@@ -6104,6 +9634,143 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+/*filters the numrows scanlines from y0 on of the image in, where the rows of in and out are linebytes apart and
+linebytes + 1 with the filter type byte*/
+static unsigned filterBand(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                           unsigned y0, unsigned numrows, LodePNGFilterStrategy strategy,
+                           const LodePNGEncoderSettings* settings) {
+  return filterRows(out + (size_t)y0 * (linebytes + 1u), in + (size_t)y0 * linebytes,
+                    y0 ? in + (size_t)(y0 - 1u) * linebytes : 0, linebytes, bytewidth, numrows, strategy,
+                    settings->predefined_filters ? settings->predefined_filters + y0 : 0, settings);
+}
+
+#ifdef LODEPNG_USE_THREADS
+/*what the threads of filter share, which each filter bands of band_rows scanlines*/
+typedef struct RowFilter {
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  unsigned h;
+  unsigned band_rows;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned* errors; /*the error of each band*/
+} RowFilter;
+
+static void filterRowsTask(void* context, size_t index) {
+  const RowFilter* rows = (const RowFilter*)context;
+  unsigned y0 = (unsigned)index * rows->band_rows;
+  unsigned numrows = rows->h - y0 < rows->band_rows ? rows->h - y0 : rows->band_rows;
+  rows->errors[index] = filterBand(rows->out, rows->in, rows->linebytes, rows->bytewidth, y0, numrows,
+                                   rows->strategy, rows->settings);
+}
+#endif /*LODEPNG_USE_THREADS*/
+
+/*the filter strategy for the color mode*/
+static LodePNGFilterStrategy filterStrategy(const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) return LFS_ZERO;
+  return settings->filter_strategy;
+}
+
+/*the scanlines per band of filter: bands of at least 64 KiB of scanlines, which can be filtered on multiple threads
+with the same result. The statistics of LFS_ESTIMATE start anew in each band, also on one thread.*/
+static unsigned filterBandRows(size_t linebytes) {
+  return (unsigned)(65536u / (linebytes + 1u)) + 1u;
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(color);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7u) / 8u;
+  LodePNGFilterStrategy strategy = filterStrategy(color, settings);
+  unsigned band_rows = filterBandRows(linebytes), count, i, error = 0;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  count = h ? (h - 1u) / band_rows + 1u : 1u;
+#ifdef LODEPNG_USE_THREADS
+  if(count > 1 && lodepng_get_num_threads(settings->zlibsettings.num_threads) > 1) {
+    RowFilter rows;
+    rows.out = out;
+    rows.in = in;
+    rows.linebytes = linebytes;
+    rows.bytewidth = bytewidth;
+    rows.h = h;
+    rows.band_rows = band_rows;
+    rows.strategy = strategy;
+    rows.settings = settings;
+    rows.errors = (unsigned*)lodepng_malloc(count * sizeof(unsigned));
+    if(!rows.errors) return 83; /*alloc fail*/
+    lodepng_run_tasks(count, lodepng_get_num_threads(settings->zlibsettings.num_threads), filterRowsTask, &rows);
+    for(i = 0; i != count && !error; ++i) error = rows.errors[i];
+    lodepng_free(rows.errors);
+    return error;
+  }
+#endif /*LODEPNG_USE_THREADS*/
+
+  for(i = 0; i != count && !error; ++i) {
+    unsigned y0 = i * band_rows;
+    error = filterBand(out, in, linebytes, bytewidth, y0, h - y0 < band_rows ? h - y0 : band_rows, strategy, settings);
+  }
+  return error;
+}
+
+/*
+filters the image in segments of segment_rows scanlines, each as if it were a whole image, so that the first row of
+each segment doesn't use the row before it. Such a first row after the first segment can then only have the filter
+types None and Sub, to which Up and Paeth without previous row are equal. Average is redone as Sub.
+*/
+static unsigned filterSegments(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                               const LodePNGColorMode* color, const LodePNGEncoderSettings* settings,
+                               unsigned segment_rows) {
+  unsigned bpp = lodepng_get_bpp(color);
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+  size_t bytewidth = (bpp + 7u) / 8u;
+  LodePNGEncoderSettings segment_settings = *settings;
+  unsigned y, error = 0;
+
+  for(y = 0; y < h && !error; y += segment_rows) {
+    unsigned numrows = h - y < segment_rows ? h - y : segment_rows;
+    unsigned char* filtered = out + (size_t)y * (linebytes + 1u);
+    if(settings->predefined_filters) segment_settings.predefined_filters = settings->predefined_filters + y;
+    error = filter(filtered, in + (size_t)y * linebytes, w, numrows, color, &segment_settings);
+    if(error || y == 0) continue;
+    if(filtered[0] == 2) filtered[0] = 0;
+    else if(filtered[0] == 4) filtered[0] = 1;
+    else if(filtered[0] == 3) {
+      filtered[0] = 1;
+      filterScanline(filtered + 1, in + (size_t)y * linebytes, 0, linebytes, bytewidth, 1, 0);
+    }
+  }
+
+  return error;
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -6176,12 +9843,13 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                    unsigned w, unsigned h,
-                                    const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings) {
+                                    unsigned w, unsigned h, const LodePNGInfo* info_png,
+                                    const LodePNGEncoderSettings* settings, unsigned segment_rows) {
   /*
   This function converts the pure 2D image with the PNG's colortype, into filtered-padded-interlaced data. Steps:
   *) if no Adam7: 1) add padding bits (= possible extra bits per scanline if bpp < 8) 2) filter
   *) if adam7: 1) Adam7_interlace 2) 7x add padding bits 3) 7x filter
+  segment_rows is 0 or the scanlines per segment of the segment index, which has no padding bits or Adam7.
   */
   size_t bpp = lodepng_get_bpp(&info_png->color);
   unsigned error = 0;
@@ -6203,7 +9871,8 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         lodepng_free(padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        if(segment_rows) error = filterSegments(*out, in, w, h, &info_png->color, settings, segment_rows);
+        else error = filter(*out, in, w, h, &info_png->color, settings);
       }
     }
   } else /*interlace_method is 1 (Adam7)*/ {
@@ -6242,43 +9911,258 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       }
     }
 
-    lodepng_free(adam7);
+    lodepng_free(adam7);
+  }
+
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
+  unsigned char* inchunk = data;
+  while((size_t)(inchunk - data) < datasize) {
+    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
+    out->allocsize = out->size; /*fix the allocsize again*/
+    inchunk = lodepng_chunk_next(inchunk, data + datasize);
+  }
+  return 0;
+}
+
+static unsigned isGrayICCProfile(const unsigned char* profile, unsigned size) {
+  /*
+  It is a gray profile if bytes 16-19 are "GRAY", rgb profile if bytes 16-19
+  are "RGB ". We do not perform any full parsing of the ICC profile here, other
+  than check those 4 bytes to grayscale profile. Other than that, validity of
+  the profile is not checked. This is needed only because the PNG specification
+  requires using a non-gray color model if there is an ICC profile with "RGB "
+  (sadly limiting compression opportunities if the input data is grayscale RGB
+  data), and requires using a gray color model if it is "GRAY".
+  */
+  if(size < 20) return 0;
+  return profile[16] == 'G' &&  profile[17] == 'R' &&  profile[18] == 'A' &&  profile[19] == 'Y';
+}
+
+static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size) {
+  /* See comment in isGrayICCProfile*/
+  if(size < 20) return 0;
+  return profile[16] == 'R' &&  profile[17] == 'G' &&  profile[18] == 'B' &&  profile[19] == ' ';
+}
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+/*the scanlines per segment to use for a segment index (sgIX chunk) in the PNG, 0 if there will be none*/
+static unsigned encoderSegmentRows(const LodePNGInfo* info, unsigned w, unsigned h,
+                                   const LodePNGEncoderSettings* settings) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  size_t linebits = (size_t)w * lodepng_get_bpp(&info->color);
+  /*one segment needs no index*/
+  if(settings->segment_rows == 0 || settings->segment_rows >= h) return 0;
+  /*the decoder can't use segments of interlaced images or rows with padding bits*/
+  if(info->interlace_method != 0 || linebits % 8u != 0) return 0;
+  /*a custom zlib or deflate function can't be told to compress in segments*/
+  if(settings->zlibsettings.custom_zlib || settings->zlibsettings.custom_deflate) return 0;
+  return settings->segment_rows;
+#else /*LODEPNG_COMPILE_ZLIB*/
+  (void)info;
+  (void)w;
+  (void)h;
+  (void)settings;
+  return 0;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
+/*checks the validity of the settings and color modes of the state, before any color conversion*/
+static unsigned checkEncoderState(const LodePNGState* state) {
+  const LodePNGInfo* info_png = &state->info_png;
+  unsigned error;
+  if((info_png->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info_png->color.palettesize == 0 || info_png->color.palettesize > 256)) {
+    /*this error is returned even if auto_convert is enabled and thus encoder could
+    generate the palette by itself: while allowing this could be possible in theory,
+    it may complicate the code or edge cases, and always requiring to give a palette
+    when setting this color type is a simpler contract*/
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) return 61; /*error: invalid btype*/
+  if(state->encoder.zlibsettings.level > 9) return 119; /*error: invalid compression level*/
+  if(info_png->interlace_method > 1) return 71; /*error: invalid interlace mode*/
+  error = checkColorValidity(info_png->color.colortype, info_png->color.bitdepth);
+  if(error) return error; /*error: invalid color type given*/
+  return checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+}
+
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+/*checks that the color type of info, after any conversion, is allowed with its ICC profile, if it has one*/
+static unsigned checkICCProfileColor(const LodePNGInfo* info, unsigned auto_convert) {
+  if(info->iccp_defined) {
+    unsigned gray_icc = isGrayICCProfile(info->iccp_profile, info->iccp_profile_size);
+    unsigned rgb_icc = isRGBICCProfile(info->iccp_profile, info->iccp_profile_size);
+    unsigned gray_png = info->color.colortype == LCT_GREY || info->color.colortype == LCT_GREY_ALPHA;
+    if(!gray_icc && !rgb_icc) {
+      return 100; /* Disallowed profile color type for PNG */
+    }
+    if(gray_icc != gray_png) {
+      /*Not allowed to use RGB/RGBA/palette with GRAY ICC profile or vice versa,
+      or in case of auto_convert, it wasn't possible to find appropriate model*/
+      return auto_convert ? 102 : 101;
+    }
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+/*the settings to compress the IDAT data of the image with*/
+static LodePNGCompressSettings idatCompressSettings(const LodePNGInfo* info, unsigned w,
+                                                   const LodePNGEncoderSettings* settings) {
+  LodePNGCompressSettings zlibsettings = settings->zlibsettings;
+  if(zlibsettings.rle && zlibsettings.rle_distance == 0 && info->interlace_method == 0) {
+    /*match scanlines with the one above, including its filter type byte*/
+    size_t linebytes = lodepng_get_raw_size_idat(w, 1, lodepng_get_bpp(&info->color));
+    if(linebytes <= 32768) zlibsettings.rle_distance = (unsigned)linebytes;
   }
-
-  return error;
+  return zlibsettings;
 }
 
+/*the signature and all chunks that come before the IDAT chunks*/
+static unsigned addChunksBeforeIDAT(ucvector* out, unsigned w, unsigned h, const LodePNGInfo* info,
+                                    LodePNGEncoderSettings* settings) {
+  unsigned error = writeSignature(out);
+  if(error) return error;
+  /*IHDR*/
+  error = addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+  if(error) return error;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
-  unsigned char* inchunk = data;
-  while((size_t)(inchunk - data) < datasize) {
-    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
-    out->allocsize = out->size; /*fix the allocsize again*/
-    inchunk = lodepng_chunk_next(inchunk, data + datasize);
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
+  }
+  /*color profile chunks must come before PLTE */
+  if(info->iccp_defined) {
+    error = addChunk_iCCP(out, info, &settings->zlibsettings);
+    if(error) return error;
+  }
+  if(info->srgb_defined) {
+    error = addChunk_sRGB(out, info);
+    if(error) return error;
+  }
+  if(info->gama_defined) {
+    error = addChunk_gAMA(out, info);
+    if(error) return error;
+  }
+  if(info->chrm_defined) {
+    error = addChunk_cHRM(out, info);
+    if(error) return error;
   }
+  if(info->sbit_defined) {
+    error = addChunk_sBIT(out, info);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE) {
+    error = addChunk_PLTE(out, &info->color);
+    if(error) return error;
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA)) {
+    /*force_palette means: write suggested palette for truecolor in PLTE chunk*/
+    error = addChunk_PLTE(out, &info->color);
+    if(error) return error;
+  }
+  /*tRNS (this will only add if when necessary) */
+  error = addChunk_tRNS(out, &info->color);
+  if(error) return error;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) {
+    error = addChunk_bKGD(out, info);
+    if(error) return error;
+  }
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) {
+    error = addChunk_pHYs(out, info);
+    if(error) return error;
+  }
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+    if(error) return error;
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   return 0;
 }
 
-static unsigned isGrayICCProfile(const unsigned char* profile, unsigned size) {
-  /*
-  It is a gray profile if bytes 16-19 are "GRAY", rgb profile if bytes 16-19
-  are "RGB ". We do not perform any full parsing of the ICC profile here, other
-  than check those 4 bytes to grayscale profile. Other than that, validity of
-  the profile is not checked. This is needed only because the PNG specification
-  requires using a non-gray color model if there is an ICC profile with "RGB "
-  (sadly limiting compression opportunities if the input data is grayscale RGB
-  data), and requires using a gray color model if it is "GRAY".
-  */
-  if(size < 20) return 0;
-  return profile[16] == 'G' &&  profile[17] == 'R' &&  profile[18] == 'A' &&  profile[19] == 'Y';
-}
+/*all chunks that come after the IDAT chunks, ending with IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, LodePNGEncoderSettings* settings) {
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  unsigned error;
+  /*tIME*/
+  if(info->time_defined) {
+    error = addChunk_tIME(out, &info->time);
+    if(error) return error;
+  }
+  /*tEXt and/or zTXt*/
+  for(i = 0; i != info->text_num; ++i) {
+    if(lodepng_strlen(info->text_keys[i]) > 79) {
+      return 66; /*text chunk too large*/
+    }
+    if(lodepng_strlen(info->text_keys[i]) < 1) {
+      return 67; /*text chunk too small*/
+    }
+    if(settings->text_compression) {
+      error = addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+      if(error) return error;
+    } else {
+      error = addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+      if(error) return error;
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id) {
+    unsigned already_added_id_text = 0;
+    for(i = 0; i != info->text_num; ++i) {
+      const char* k = info->text_keys[i];
+      /* Could use strcmp, but we're not calling or reimplementing this C library function for this use only */
+      if(k[0] == 'L' && k[1] == 'o' && k[2] == 'd' && k[3] == 'e' &&
+         k[4] == 'P' && k[5] == 'N' && k[6] == 'G' && k[7] == '\0') {
+        already_added_id_text = 1;
+        break;
+      }
+    }
+    if(already_added_id_text == 0) {
+      error = addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+      if(error) return error;
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i != info->itext_num; ++i) {
+    if(lodepng_strlen(info->itext_keys[i]) > 79) {
+      return 66; /*text chunk too large*/
+    }
+    if(lodepng_strlen(info->itext_keys[i]) < 1) {
+      return 67; /*text chunk too small*/
+    }
+    error = addChunk_iTXt(
+        out, settings->text_compression,
+        info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+        &settings->zlibsettings);
+    if(error) return error;
+  }
 
-static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size) {
-  /* See comment in isGrayICCProfile*/
-  if(size < 20) return 0;
-  return profile[16] == 'R' &&  profile[17] == 'G' &&  profile[18] == 'B' &&  profile[19] == ' ';
-}
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2]) {
+    error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return addChunk_IEND(out);
+}
 
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
@@ -6289,6 +10173,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   LodePNGInfo info;
   const LodePNGInfo* info_png = &state->info_png;
   LodePNGColorMode auto_color;
+  unsigned segment_rows; /*the scanlines per segment of the segment index, 0 if there is none*/
+  LodePNGCompressSettings zlibsettings; /*the settings for the IDAT chunks*/
 
   lodepng_info_init(&info);
   lodepng_color_mode_init(&auto_color);
@@ -6298,31 +10184,11 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   *outsize = 0;
   state->error = 0;
 
-  /*check input values validity*/
-  if((info_png->color.colortype == LCT_PALETTE || state->encoder.force_palette)
-      && (info_png->color.palettesize == 0 || info_png->color.palettesize > 256)) {
-    /*this error is returned even if auto_convert is enabled and thus encoder could
-    generate the palette by itself: while allowing this could be possible in theory,
-    it may complicate the code or edge cases, and always requiring to give a palette
-    when setting this color type is a simpler contract*/
-    state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
-    goto cleanup;
-  }
-  if(state->encoder.zlibsettings.btype > 2) {
-    state->error = 61; /*error: invalid btype*/
-    goto cleanup;
-  }
-  if(info_png->interlace_method > 1) {
-    state->error = 71; /*error: invalid interlace mode*/
-    goto cleanup;
-  }
-  state->error = checkColorValidity(info_png->color.colortype, info_png->color.bitdepth);
-  if(state->error) goto cleanup; /*error: invalid color type given*/
-  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
-  if(state->error) goto cleanup; /*error: invalid color type given*/
+  state->error = checkEncoderState(state);
+  if(state->error) goto cleanup;
 
   /* color convert and compute scanline filter types */
-  lodepng_info_copy(&info, &state->info_png);
+  lodepng_info_copy(&info, info_png);
   if(state->encoder.auto_convert) {
     LodePNGColorStats stats;
     unsigned allow_convert = 1;
@@ -6428,22 +10294,10 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
   }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-  if(info_png->iccp_defined) {
-    unsigned gray_icc = isGrayICCProfile(info_png->iccp_profile, info_png->iccp_profile_size);
-    unsigned rgb_icc = isRGBICCProfile(info_png->iccp_profile, info_png->iccp_profile_size);
-    unsigned gray_png = info.color.colortype == LCT_GREY || info.color.colortype == LCT_GREY_ALPHA;
-    if(!gray_icc && !rgb_icc) {
-      state->error = 100; /* Disallowed profile color type for PNG */
-      goto cleanup;
-    }
-    if(gray_icc != gray_png) {
-      /*Not allowed to use RGB/RGBA/palette with GRAY ICC profile or vice versa,
-      or in case of auto_convert, it wasn't possible to find appropriate model*/
-      state->error = state->encoder.auto_convert ? 102 : 101;
-      goto cleanup;
-    }
-  }
+  state->error = checkICCProfileColor(&info, state->encoder.auto_convert);
+  if(state->error) goto cleanup;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  segment_rows = encoderSegmentRows(&info, w, h, &state->encoder);
   if(!lodepng_color_mode_equal(&state->info_raw, &info.color)) {
     unsigned char* converted;
     size_t size = ((size_t)w * (size_t)h * (size_t)lodepng_get_bpp(&info.color) + 7u) / 8u;
@@ -6454,154 +10308,31 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
     if(!state->error) {
-      state->error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+      state->error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder, segment_rows);
     }
     lodepng_free(converted);
     if(state->error) goto cleanup;
   } else {
-    state->error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+    state->error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder, segment_rows);
     if(state->error) goto cleanup;
   }
 
-  /* output all PNG chunks */ {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    state->error = writeSignature(&outv);
-    if(state->error) goto cleanup;
-    /*IHDR*/
-    state->error = addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) goto cleanup;
-    }
-    /*color profile chunks must come before PLTE */
-    if(info.iccp_defined) {
-      state->error = addChunk_iCCP(&outv, &info, &state->encoder.zlibsettings);
-      if(state->error) goto cleanup;
-    }
-    if(info.srgb_defined) {
-      state->error = addChunk_sRGB(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info.gama_defined) {
-      state->error = addChunk_gAMA(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info.chrm_defined) {
-      state->error = addChunk_cHRM(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    if(info_png->sbit_defined) {
-      state->error = addChunk_sBIT(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE) {
-      state->error = addChunk_PLTE(&outv, &info.color);
-      if(state->error) goto cleanup;
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA)) {
-      /*force_palette means: write suggested palette for truecolor in PLTE chunk*/
-      state->error = addChunk_PLTE(&outv, &info.color);
-      if(state->error) goto cleanup;
-    }
-    /*tRNS (this will only add if when necessary) */
-    state->error = addChunk_tRNS(&outv, &info.color);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) {
-      state->error = addChunk_bKGD(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) {
-      state->error = addChunk_pHYs(&outv, &info);
-      if(state->error) goto cleanup;
-    }
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
-    if(state->error) goto cleanup;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) {
-      state->error = addChunk_tIME(&outv, &info.time);
-      if(state->error) goto cleanup;
-    }
-    /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i) {
-      if(lodepng_strlen(info.text_keys[i]) > 79) {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(lodepng_strlen(info.text_keys[i]) < 1) {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
-      }
-      if(state->encoder.text_compression) {
-        state->error = addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-        if(state->error) goto cleanup;
-      } else {
-        state->error = addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-        if(state->error) goto cleanup;
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id) {
-      unsigned already_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i) {
-        const char* k = info.text_keys[i];
-        /* Could use strcmp, but we're not calling or reimplementing this C library function for this use only */
-        if(k[0] == 'L' && k[1] == 'o' && k[2] == 'd' && k[3] == 'e' &&
-           k[4] == 'P' && k[5] == 'N' && k[6] == 'G' && k[7] == '\0') {
-          already_added_id_text = 1;
-          break;
-        }
-      }
-      if(already_added_id_text == 0) {
-        state->error = addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-        if(state->error) goto cleanup;
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i) {
-      if(lodepng_strlen(info.itext_keys[i]) > 79) {
-        state->error = 66; /*text chunk too large*/
-        goto cleanup;
-      }
-      if(lodepng_strlen(info.itext_keys[i]) < 1) {
-        state->error = 67; /*text chunk too small*/
-        goto cleanup;
-      }
-      state->error = addChunk_iTXt(
-          &outv, state->encoder.text_compression,
-          info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-          &state->encoder.zlibsettings);
-      if(state->error) goto cleanup;
-    }
+  zlibsettings = idatCompressSettings(&info, w, &state->encoder);
 
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) goto cleanup;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    state->error = addChunk_IEND(&outv);
-    if(state->error) goto cleanup;
+  /* output all PNG chunks */
+  state->error = addChunksBeforeIDAT(&outv, w, h, &info, &state->encoder);
+  if(state->error) goto cleanup;
+  /*IDAT (multiple IDAT chunks must be consecutive)*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(segment_rows) {
+    state->error = addChunks_sgIX_IDAT(&outv, data, datasize, h, segment_rows, &zlibsettings);
+  } else
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  {
+    state->error = addChunk_IDAT(&outv, data, datasize, &zlibsettings);
   }
+  if(state->error) goto cleanup;
+  state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
 
 cleanup:
   lodepng_info_cleanup(&info);
@@ -6658,6 +10389,316 @@ unsigned lodepng_encode24_file(const char* filename, const unsigned char* image,
 }
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_ZLIB
+struct LodePNGPushEncoder {
+  LodePNGState* state;
+  unsigned w, h;
+  unsigned y; /*the amount of rows given so far*/
+  unsigned started; /*whether the chunks before the image data are written and the buffers are allocated*/
+  unsigned finished; /*whether lodepng_push_encoder_finish was done*/
+  unsigned (*write_callback)(const unsigned char* data, size_t size, void* context);
+  void* write_context;
+#ifdef LODEPNG_COMPILE_DISK
+  FILE* file; /*the file that the PNG is written to, if it was set with lodepng_push_encoder_set_file*/
+#endif /*LODEPNG_COMPILE_DISK*/
+  size_t chunk_size; /*the maximum size of the data of an IDAT chunk*/
+  size_t linebytes; /*the size of a scanline of the PNG, without the filter type byte*/
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  unsigned band_rows; /*the scanlines that are filtered together, in the same bands as filter*/
+  LodePNGCompressSettings zlibsettings;
+  ColorTable* table; /*the palette of the PNG to convert to, or NULL*/
+  unsigned char* rows; /*the last row of the band before the current one, then the rows of the current band*/
+  ucvector filtered; /*up to 32768 bytes of compressed scanlines as dictionary, then the scanlines to compress*/
+  size_t filtered_pos; /*the position in filtered of the scanlines to compress*/
+  unsigned adler; /*the adler32 of the compressed scanlines*/
+  ucvector idat; /*zlib data that is not written in an IDAT chunk yet*/
+};
+
+LodePNGPushEncoder* lodepng_push_encoder_new(LodePNGState* state, unsigned w, unsigned h) {
+  LodePNGPushEncoder* encoder = (LodePNGPushEncoder*)lodepng_malloc(sizeof(LodePNGPushEncoder));
+  if(!encoder) return 0;
+  encoder->state = state;
+  encoder->w = w;
+  encoder->h = h;
+  encoder->y = 0;
+  encoder->started = 0;
+  encoder->finished = 0;
+  encoder->write_callback = 0;
+  encoder->write_context = 0;
+#ifdef LODEPNG_COMPILE_DISK
+  encoder->file = 0;
+#endif /*LODEPNG_COMPILE_DISK*/
+  encoder->chunk_size = 65536;
+  encoder->linebytes = 0;
+  encoder->bytewidth = 0;
+  encoder->strategy = LFS_ZERO;
+  encoder->band_rows = 0;
+  encoder->table = 0;
+  encoder->rows = 0;
+  encoder->filtered = ucvector_init(NULL, 0);
+  encoder->filtered_pos = 0;
+  encoder->adler = 1u;
+  encoder->idat = ucvector_init(NULL, 0);
+  state->error = 0;
+  return encoder;
+}
+
+void lodepng_push_encoder_delete(LodePNGPushEncoder* encoder) {
+  if(!encoder) return;
+#ifdef LODEPNG_COMPILE_DISK
+  if(encoder->file) fclose(encoder->file);
+#endif /*LODEPNG_COMPILE_DISK*/
+  lodepng_free(encoder->table);
+  lodepng_free(encoder->rows);
+  lodepng_free(encoder->filtered.data);
+  lodepng_free(encoder->idat.data);
+  lodepng_free(encoder);
+}
+
+void lodepng_push_encoder_set_write_callback(LodePNGPushEncoder* encoder,
+                                             unsigned (*callback)(const unsigned char* data, size_t size,
+                                                                  void* context),
+                                             void* context) {
+  encoder->write_callback = callback;
+  encoder->write_context = context;
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+static unsigned pushEncoderWriteFile(const unsigned char* data, size_t size, void* context) {
+  return fwrite(data, 1, size, (FILE*)context) != size;
+}
+
+unsigned lodepng_push_encoder_set_file(LodePNGPushEncoder* encoder, const char* filename) {
+  if(encoder->file) fclose(encoder->file);
+  encoder->file = fopen(filename, "wb");
+  if(!encoder->file) return 79;
+  lodepng_push_encoder_set_write_callback(encoder, pushEncoderWriteFile, encoder->file);
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_DISK*/
+
+void lodepng_push_encoder_set_chunk_size(LodePNGPushEncoder* encoder, size_t size) {
+  /*the PNG specification allows chunks of up to 2^31-1 bytes*/
+  encoder->chunk_size = size < 1u ? 1u : size > 2147483647u ? 2147483647u : size;
+}
+
+static unsigned pushEncoderOutput(LodePNGPushEncoder* encoder, const unsigned char* data, size_t size) {
+  if(!encoder->write_callback) return 122;
+  return encoder->write_callback(data, size, encoder->write_context) ? 122 : 0;
+}
+
+#ifdef LODEPNG_COMPILE_CRC
+/*writes an IDAT chunk with the zlib data, in parts so that it isn't copied*/
+static unsigned pushEncoderWriteIDAT(LodePNGPushEncoder* encoder, const unsigned char* data, size_t size) {
+  unsigned char header[8];
+  unsigned char crc[4];
+  unsigned error;
+  lodepng_set32bitInt(header, (unsigned)size);
+  lodepng_memcpy(header + 4, "IDAT", 4);
+  lodepng_set32bitInt(crc, update_crc32(update_crc32(0u, header + 4, 4), data, size));
+  error = pushEncoderOutput(encoder, header, 8);
+  if(!error) error = pushEncoderOutput(encoder, data, size);
+  if(!error) error = pushEncoderOutput(encoder, crc, 4);
+  return error;
+}
+#else /*LODEPNG_COMPILE_CRC*/
+/*writes an IDAT chunk with the zlib data. The external lodepng_crc32 can't continue a CRC, so the chunk is made whole*/
+static unsigned pushEncoderWriteIDAT(LodePNGPushEncoder* encoder, const unsigned char* data, size_t size) {
+  ucvector chunk = ucvector_init(NULL, 0);
+  unsigned error = lodepng_chunk_createv(&chunk, size, "IDAT", data);
+  if(!error) error = pushEncoderOutput(encoder, chunk.data, chunk.size);
+  lodepng_free(chunk.data);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_CRC*/
+
+/*writes the zlib data in IDAT chunks of chunk_size bytes, and the rest in a smaller one if final*/
+static unsigned pushEncoderFlushIDAT(LodePNGPushEncoder* encoder, unsigned final) {
+  ucvector* idat = &encoder->idat;
+  size_t pos = 0, i;
+  unsigned error = 0;
+  while(!error && (idat->size - pos >= encoder->chunk_size || (final && pos != idat->size))) {
+    size_t size = idat->size - pos < encoder->chunk_size ? idat->size - pos : encoder->chunk_size;
+    error = pushEncoderWriteIDAT(encoder, idat->data + pos, size);
+    pos += size;
+  }
+  if(pos) {
+    for(i = pos; i != idat->size; ++i) idat->data[i - pos] = idat->data[i];
+    idat->size -= pos;
+  }
+  return error;
+}
+
+/*
+compresses the filtered scanlines in the same segments as zlib_compress_segmented, so a part of up to
+DEFLATE_THREAD_SEGMENT_SIZE bytes stays until more comes, or until final, which ends the deflate data
+*/
+static unsigned pushEncoderDeflate(LodePNGPushEncoder* encoder, unsigned final) {
+  ucvector* filtered = &encoder->filtered;
+  size_t i, amount;
+  unsigned error = 0;
+  while(!error && (final || filtered->size - encoder->filtered_pos > DEFLATE_THREAD_SEGMENT_SIZE)) {
+    size_t size = filtered->size - encoder->filtered_pos;
+    unsigned last = final && size <= DEFLATE_THREAD_SEGMENT_SIZE;
+    if(!last) size = DEFLATE_THREAD_SEGMENT_SIZE;
+    error = deflateSegment(&encoder->idat, filtered->data, encoder->filtered_pos, encoder->filtered_pos + size,
+                           &encoder->zlibsettings, last);
+    encoder->adler = update_adler32(encoder->adler, filtered->data + encoder->filtered_pos, (unsigned)size);
+    encoder->filtered_pos += size;
+    if(last) break;
+  }
+  /*keep the largest window that deflate allows before the scanlines to compress*/
+  if(encoder->filtered_pos > 32768u) {
+    amount = encoder->filtered_pos - 32768u;
+    for(i = amount; i != filtered->size; ++i) filtered->data[i - amount] = filtered->data[i];
+    filtered->size -= amount;
+    encoder->filtered_pos -= amount;
+  }
+  if(!error) error = pushEncoderFlushIDAT(encoder, 0);
+  return error;
+}
+
+/*checks the settings, allocates the buffers and writes the chunks before the image data*/
+static unsigned pushEncoderStart(LodePNGPushEncoder* encoder) {
+  LodePNGState* state = encoder->state;
+  const LodePNGInfo* info = &state->info_png;
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  ucvector chunks = ucvector_init(NULL, 0);
+  size_t size;
+  unsigned error = checkEncoderState(state);
+
+  if(error) return error;
+  if(info->interlace_method != 0) return 120; /*Adam7 needs the whole image*/
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  error = checkICCProfileColor(info, 0);
+  if(error) return error;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  if(!lodepng_color_mode_equal(&state->info_raw, &info->color)) {
+    if(state->info_raw.colortype == LCT_PALETTE && !state->info_raw.palette) {
+      return 107; /* error: must provide palette if input mode is palette */
+    }
+    if(info->color.colortype == LCT_PALETTE) {
+      size_t palsize = (size_t)1u << info->color.bitdepth, i;
+      if(info->color.palettesize < palsize) palsize = info->color.palettesize;
+      encoder->table = (ColorTable*)lodepng_malloc(sizeof(ColorTable));
+      if(!encoder->table) return 83; /*alloc fail*/
+      color_table_init(encoder->table);
+      for(i = 0; i != palsize; ++i) {
+        const unsigned char* p = &info->color.palette[i * 4];
+        color_table_add(encoder->table, color_table_pack(p[0], p[1], p[2], p[3]), (unsigned)i);
+      }
+    }
+  }
+
+  encoder->linebytes = lodepng_get_raw_size_idat(encoder->w, 1, bpp) - 1u;
+  encoder->bytewidth = (bpp + 7u) / 8u;
+  encoder->strategy = filterStrategy(&info->color, &state->encoder);
+  encoder->band_rows = filterBandRows(encoder->linebytes);
+  encoder->zlibsettings = idatCompressSettings(info, encoder->w, &state->encoder);
+  size = ((size_t)encoder->band_rows + 1u) * encoder->linebytes;
+  encoder->rows = (unsigned char*)lodepng_malloc(size);
+  if(!encoder->rows && size) return 83; /*alloc fail*/
+  if(!ucvector_resize(&encoder->idat, 2)) return 83; /*alloc fail*/
+  writeZlibHeader(encoder->idat.data);
+
+  error = addChunksBeforeIDAT(&chunks, encoder->w, encoder->h, info, &state->encoder);
+  if(!error) error = pushEncoderOutput(encoder, chunks.data, chunks.size);
+  lodepng_free(chunks.data);
+  return error;
+}
+
+/*converts the row to the color mode of the PNG*/
+static unsigned pushEncoderConvertRow(LodePNGPushEncoder* encoder, unsigned char* out, const unsigned char* in) {
+  const LodePNGColorMode* mode_out = &encoder->state->info_png.color;
+  const LodePNGColorMode* mode_in = &encoder->state->info_raw;
+  size_t linebits = (size_t)encoder->w * lodepng_get_bpp(mode_out);
+  unsigned error = 0;
+  if(lodepng_color_mode_equal(mode_out, mode_in)) {
+    lodepng_memcpy(out, in, encoder->linebytes);
+  } else {
+    error = convertPixels(out, 0, in, encoder->w, mode_out, mode_in, encoder->table);
+  }
+  /*the padding bits at the end of the scanline are 0, like addPaddingBits makes them*/
+  if(linebits % 8u) out[encoder->linebytes - 1u] &= (unsigned char)(0xffu << (8u - linebits % 8u));
+  return error;
+}
+
+/*filters the numrows rows of the current band after the other filtered scanlines, and compresses what it can*/
+static unsigned pushEncoderFilterBand(LodePNGPushEncoder* encoder, unsigned numrows) {
+  const LodePNGEncoderSettings* settings = &encoder->state->encoder;
+  size_t linebytes = encoder->linebytes, pos = encoder->filtered.size;
+  unsigned y0 = encoder->y - numrows;
+  unsigned error;
+
+  if(!ucvector_resize(&encoder->filtered, pos + (size_t)numrows * (linebytes + 1u))) return 83; /*alloc fail*/
+  error = filterRows(encoder->filtered.data + pos, encoder->rows + linebytes, y0 ? encoder->rows : 0, linebytes,
+                     encoder->bytewidth, numrows, encoder->strategy,
+                     settings->predefined_filters ? settings->predefined_filters + y0 : 0, settings);
+  /*the last row of the band is the row above the next band*/
+  lodepng_memcpy(encoder->rows, encoder->rows + (size_t)numrows * linebytes, linebytes);
+  if(!error) error = pushEncoderDeflate(encoder, 0);
+  return error;
+}
+
+unsigned lodepng_push_encoder_write_row(LodePNGPushEncoder* encoder, const unsigned char* row) {
+  LodePNGState* state = encoder->state;
+  unsigned band_y; /*the row in the current band*/
+
+  if(state->error) return state->error;
+  if(encoder->y == encoder->h || encoder->finished) {
+    state->error = 121; /*wrong amount of rows*/
+    return state->error;
+  }
+  if(!encoder->started) {
+    encoder->started = 1;
+    state->error = pushEncoderStart(encoder);
+    if(state->error) return state->error;
+  }
+
+  band_y = encoder->y % encoder->band_rows;
+  state->error = pushEncoderConvertRow(encoder, encoder->rows + (band_y + 1u) * encoder->linebytes, row);
+  ++encoder->y;
+  if(!state->error && (band_y + 1u == encoder->band_rows || encoder->y == encoder->h)) {
+    state->error = pushEncoderFilterBand(encoder, band_y + 1u);
+  }
+  return state->error;
+}
+
+unsigned lodepng_push_encoder_finish(LodePNGPushEncoder* encoder) {
+  LodePNGState* state = encoder->state;
+  ucvector chunks = ucvector_init(NULL, 0);
+
+  if(state->error) return state->error;
+  if(encoder->y != encoder->h || encoder->finished) {
+    state->error = 121; /*wrong amount of rows*/
+    return state->error;
+  }
+  encoder->finished = 1;
+  if(!encoder->started) {
+    encoder->started = 1;
+    state->error = pushEncoderStart(encoder);
+  }
+
+  if(!state->error) state->error = pushEncoderDeflate(encoder, 1);
+  if(!state->error && !ucvector_resize(&encoder->idat, encoder->idat.size + 4u)) state->error = 83; /*alloc fail*/
+  if(!state->error) {
+    lodepng_set32bitInt(encoder->idat.data + encoder->idat.size - 4u, encoder->adler);
+    state->error = pushEncoderFlushIDAT(encoder, 1);
+  }
+  if(!state->error) state->error = addChunksAfterIDAT(&chunks, &state->info_png, &state->encoder);
+  if(!state->error) state->error = pushEncoderOutput(encoder, chunks.data, chunks.size);
+  lodepng_free(chunks.data);
+#ifdef LODEPNG_COMPILE_DISK
+  if(encoder->file) {
+    if(fclose(encoder->file) && !state->error) state->error = 122; /*such as when the disk is full*/
+    encoder->file = 0;
+  }
+#endif /*LODEPNG_COMPILE_DISK*/
+  return state->error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   lodepng_compress_settings_init(&settings->zlibsettings);
   settings->filter_palette_zero = 1;
@@ -6665,6 +10706,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->segment_rows = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -6803,6 +10845,13 @@ const char* lodepng_error_text(unsigned code) {
     case 113: return "ICC profile unreasonably large";
     case 114: return "sBIT chunk has wrong size for the color type of the image";
     case 115: return "sBIT value out of range";
+    case 116: return "the row callback of the push decoder returned an error";
+    case 117: return "the image doesn't fit in the memory given to decode into, or its stride is less than a row";
+    case 118: return "invalid region to decode: it is empty or goes past the bottom of the image, or reduce is above 3";
+    case 119: return "invalid compression level, must be 0 to 9";
+    case 120: return "the push encoder can't encode interlaced images";
+    case 121: return "the push encoder was given more or less rows than the image height, or used after finishing";
+    case 122: return "the push encoder has no output, or writing the PNG failed";
   }
   return "unknown error code";
 }
@@ -6894,21 +10943,40 @@ State& State::operator=(const State& other) {
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const unsigned char* in,
-                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
-  unsigned error = lodepng_decode_memory(&buffer, &w, &h, in, insize, colortype, bitdepth);
-  if(buffer && !error) {
-    State state;
-    state.info_raw.colortype = colortype;
-    state.info_raw.bitdepth = bitdepth;
-    size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
-    out.insert(out.end(), buffer, &buffer[buffersize]);
+/*decodes straight into the end of out, once the header tells how much memory the image needs*/
+static unsigned decodeAppend(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
+                             State& state, const unsigned char* in, size_t insize) {
+  unsigned error = lodepng_inspect(&w, &h, &state, in, insize);
+  unsigned y0, y1;
+  if(!error && lodepng_pixel_overflow(w, h, &state.info_png.color, &state.info_raw)) {
+    error = 92; /*overflow possible due to amount of pixels*/
   }
-  lodepng_free(buffer);
+  /*the size of the output, if only a region is decoded*/
+  if(!error) error = getRegion(&y0, &y1, &w, &h, &state.decoder);
+  if(!error) {
+    size_t oldsize = out.size();
+    const LodePNGColorMode* mode = state.decoder.color_convert ? &state.info_raw : &state.info_png.color;
+    out.resize(oldsize + lodepng_get_raw_size(w, h, mode));
+    error = lodepng_decode_into(&out[oldsize], out.size() - oldsize, 0, &w, &h, &state, in, insize);
+    if(error) out.resize(oldsize);
+  }
+  if(error) w = h = 0;
   return error;
 }
 
+unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const unsigned char* in,
+                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
+  State state;
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*disable reading things that this function doesn't output*/
+  state.decoder.read_text_chunks = 0;
+  state.decoder.remember_unknown_chunks = 0;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return decodeAppend(out, w, h, state, in, insize);
+}
+
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
                 const std::vector<unsigned char>& in, LodePNGColorType colortype, unsigned bitdepth) {
   return decode(out, w, h, in.empty() ? 0 : &in[0], (unsigned)in.size(), colortype, bitdepth);
@@ -6917,14 +10985,7 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
                 State& state,
                 const unsigned char* in, size_t insize) {
-  unsigned char* buffer = NULL;
-  unsigned error = lodepng_decode(&buffer, &w, &h, &state, in, insize);
-  if(buffer && !error) {
-    size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
-    out.insert(out.end(), buffer, &buffer[buffersize]);
-  }
-  lodepng_free(buffer);
-  return error;
+  return decodeAppend(out, w, h, state, in, insize);
 }
 
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
@@ -6939,6 +11000,15 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const
   std::vector<unsigned char> buffer;
   /* safe output values in case error happens */
   w = h = 0;
+#ifdef LODEPNG_USE_MMAP
+  size_t mappedsize;
+  const unsigned char* mapped = lodepng_map_file(&mappedsize, filename.c_str());
+  if(mapped) {
+    unsigned error = decode(out, w, h, mapped, mappedsize, colortype, bitdepth);
+    lodepng_unmap_file(mapped, mappedsize);
+    return error;
+  }
+#endif /*LODEPNG_USE_MMAP*/
   unsigned error = load_file(buffer, filename);
   if(error) return error;
   return decode(out, w, h, buffer, colortype, bitdepth);
@@ -102,6 +102,34 @@ or comment out LODEPNG_COMPILE_CRC below*/
 #define LODEPNG_COMPILE_CRC
 #endif
 
+/*SIMD instructions for the time critical loops: SSE2 on x86 when the compiler targets it, with SSSE3, AVX2 and
+PCLMULQDQ (for the CRC) used only if the CPU supports them (checked at runtime), and NEON and the ARMv8 CRC32
+instructions on ARM when the compiler targets them. The plain C code, which gives the same results, is used
+otherwise.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+/*pass -DLODEPNG_NO_COMPILE_SIMD to the compiler to use only plain C code,
+or comment out LODEPNG_COMPILE_SIMD below*/
+#define LODEPNG_COMPILE_SIMD
+#endif
+
+/*Use multiple threads where the work can be split up, such as for decoding PNGs that have a segment index (see
+segment_rows in LodePNGEncoderSettings) and for compressing, if num_threads in LodePNGDecoderSettings or
+LodePNGCompressSettings allows it. Uses Windows threads on Windows and POSIX threads (link with -pthread) elsewhere.*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+/*pass -DLODEPNG_NO_COMPILE_THREADS to the compiler to use only the calling thread,
+or comment out LODEPNG_COMPILE_THREADS below*/
+#define LODEPNG_COMPILE_THREADS
+#endif
+
+/*Decode PNG files from a read-only memory mapping of the file (mmap, or a file mapping on Windows) rather than
+reading them into a buffer first, for the file decode functions. Files that can't be mapped, such as pipes, are
+read as usual. Only used with LODEPNG_COMPILE_DISK.*/
+#ifndef LODEPNG_NO_COMPILE_MMAP
+/*pass -DLODEPNG_NO_COMPILE_MMAP to the compiler to always read files with fread,
+or comment out LODEPNG_COMPILE_MMAP below*/
+#define LODEPNG_COMPILE_MMAP
+#endif
+
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -184,6 +212,13 @@ NOTE: Wide-character filenames are not supported, you can use an external method
 to handle such files and decode in-memory.*/
 unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h,
                                const char* filename);
+
+/*Same as lodepng_decode_file, but decodes into memory given by the caller, like lodepng_decode_into.
+
+NOTE: Wide-character filenames are not supported, you can use an external method
+to handle such files and decode in-memory.*/
+unsigned lodepng_decode_file_into(unsigned char* out, size_t outsize, size_t stride, unsigned* w, unsigned* h,
+                                  const char* filename, LodePNGColorType colortype, unsigned bitdepth);
 #endif /*LODEPNG_COMPILE_DISK*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -356,6 +391,22 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*zlib style compression level, 1 (fastest) to 9 (smallest), which replaces the four settings above with its own,
+  see the table in the documentation of the settings further below. 0 uses the four settings above. Default: 0*/
+  unsigned level;
+  /*the amount of threads, including the calling one, for zlib compression, 0 for one per processor. With other
+  than 1, data larger than 256 KiB is deflated in segments of 256 KiB, each using the last window of data before
+  it as its dictionary, on multiple threads, which makes it slightly larger. The result is the same for any amount
+  of threads other than 1. The PNG encoder also uses it to choose the filters of the scanlines and for the segments
+  of segment_rows in LodePNGEncoderSettings on multiple threads, which gives the same result as one. Default: 1*/
+  unsigned num_threads;
+  /*LZ77 that only looks for runs, much faster on images with flat areas such as screen captures, to record frames in
+  real time: matches at distance 1, and at distance rle_distance if that's not 0. It replaces the other LZ77
+  settings and the level. Default: 0*/
+  unsigned rle;
+  /*the distance of the other matches with rle. The PNG encoder sets it to the size of a filtered scanline if it's
+  0, so that rows that are the same as the one above are matched as well. Default: 0*/
+  unsigned rle_distance;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -481,6 +532,23 @@ typedef struct LodePNGInfo {
   unsigned interlace_method;  /*interlace method of the original file: 0=none, 1=Adam7*/
   LodePNGColorMode color;     /*color type and bits, palette and transparency of the PNG file*/
 
+  /*
+  Segment index (sgIX chunk, private to LodePNG)
+
+  A PNG encoded with segment_rows set in the encoder settings has its zlib data split into segments of that many
+  scanlines, which are compressed independently and end with a full flush, and the first scanline of each has a
+  filter type that doesn't use the scanline before it. The sgIX chunk gives the position of each segment in the
+  zlib data (the IDAT chunk data together, including the 2-byte zlib header), so that the decoder can inflate and
+  unfilter them on multiple threads, if num_threads in LodePNGDecoderSettings allows more than one. The PNG
+  remains valid for any other decoder.
+
+  The decoder sets these if the PNG has the chunk before its IDAT chunks, but uses them only after checking that
+  they match the zlib data, and else decodes the normal way. The encoder ignores them, it writes its own.
+  */
+  unsigned segment_rows; /*the amount of scanlines per segment, 0 if there is no segment index*/
+  unsigned* segment_offsets; /*the position of the start of each segment in the zlib data*/
+  unsigned segment_count; /*the amount of segments and of segment_offsets*/
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*
   Suggested background color chunk (bKGD)
@@ -741,6 +809,23 @@ typedef struct LodePNGDecoderSettings {
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*the amount of threads, including the calling one, for decoding PNGs that have a segment index (sgIX chunk).
+  1 decodes without extra threads, 0 uses one per processor. Threads are only started when this is set to other
+  than 1. Default: 1*/
+  unsigned num_threads;
+
+  /*Decode only a part of the image, or a smaller version of it, such as for a preview or a low detail texture.
+  Only the rows region_y0 up to but not including region_y1 are output, where region_y1 0 means the bottom of the
+  image. With reduce 1, 2 or 3 the output is 1/2, 1/4 or 1/8 of the size in both directions, and the region grows
+  to whole squares of 2x2, 4x4 or 8x8 pixels. Each output pixel is the average of its square (clipped to the
+  image), or its top left pixel for palette and less than 8 bit output. For Adam7 interlaced images it's always the
+  top left pixel, which lets decoding stop after pass 5, 3 or 1. The w and h that the decode functions give are
+  the size of the output. The data after what the region needs is not decompressed, so errors in it, including a
+  wrong adler32 checksum, are not found. Default: 0, 0 and 0, for the whole image*/
+  unsigned region_y0;
+  unsigned region_y1;
+  unsigned reduce;
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
 
@@ -783,7 +868,11 @@ typedef enum LodePNGFilterStrategy {
   */
   LFS_BRUTE_FORCE,
   /*use predefined_filters buffer: you specify the filter type for each scanline*/
-  LFS_PREDEFINED
+  LFS_PREDEFINED,
+  /*Estimate the compressed size of the filters with the smallest sums from the statistics of the bytes of the
+  scanlines before. Usually smaller than MINSUM and ENTROPY, within about 1% of BRUTE_FORCE, at about the speed of
+  MINSUM.*/
+  LFS_ESTIMATE
 } LodePNGFilterStrategy;
 
 /*Gives characteristics about the integer RGBA colors of the image (count, alpha channel usage, bit depth, ...),
@@ -844,6 +933,13 @@ typedef struct LodePNGEncoderSettings {
   NOTE: enabling this may worsen compression if auto_convert is used to choose
   optimal color mode, because it cannot use grayscale color modes in this case*/
   unsigned force_palette;
+
+  /*if not 0, compress the image in independent segments of this many scanlines, and add a segment index (sgIX
+  chunk, see LodePNGInfo) so that the LodePNG decoder can decode them on multiple threads. This makes the PNG
+  slightly larger, so use a few hundred kilobytes of image data per segment or more, such as 256 scanlines for a
+  1024 pixels wide RGBA image. Not used for interlaced images, images with less than a byte per pixel whose
+  scanlines don't end at a byte boundary, or with a custom zlib or deflate function. Default: 0*/
+  unsigned segment_rows;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -893,6 +989,77 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Same as lodepng_decode, but decodes into memory given by the caller rather than allocating the image, such as
+a reused buffer or a mapped OpenGL pixel unpack buffer. The decoder only writes to it.
+out: the memory to decode into, of outsize bytes.
+stride: the distance in bytes from the start of one row to the next, at least a row of the output (in the color
+  mode of state->info_raw, or of the PNG if color_convert is off). Each row then starts at a byte boundary.
+  If 0, the rows follow each other without gaps like in the output of lodepng_decode.
+If the image doesn't fit in out, returns error 117 before decoding, with its size in *w and *h, so that the
+caller can use lodepng_get_raw_size to know how much memory is needed. Memory needed while decoding is only
+a few rows, except for interlaced images, conversions to palette, and PNGs with a custom zlib decompressor or
+with a segment index (see LodePNGInfo) that is decoded on multiple threads, which are decoded whole first.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, size_t stride, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize);
+
+/*
+Incremental decoder, for when the PNG file arrives in parts, such as when reading it from a file or pipe. The
+parts can have any size. The image data is decompressed as it arrives, so only a small part of the file is
+kept in memory. Usage: create it with lodepng_push_decoder_new, give it all the data with
+lodepng_push_decoder_write, then get the image with lodepng_push_decoder_finish, and finally delete it.
+The state gives the settings and receives the PNG info like with lodepng_decode, and must stay alive
+until the decoder is deleted. A state should be used for one decoder at a time.
+*/
+typedef struct LodePNGPushDecoder LodePNGPushDecoder;
+
+/*Returns NULL if out of memory.*/
+LodePNGPushDecoder* lodepng_push_decoder_new(LodePNGState* state);
+void lodepng_push_decoder_delete(LodePNGPushDecoder* decoder);
+
+/*Gives the next part of the PNG file. Returns error code, which is also stored in state->error. After an
+error, further calls do nothing and return the same error.*/
+unsigned lodepng_push_decoder_write(LodePNGPushDecoder* decoder, const unsigned char* in, size_t insize);
+
+/*
+Sets a function that receives each row of the output image, from top to bottom, as soon as it is decoded.
+The row is in the color mode that lodepng_push_decoder_finish outputs, starting at a byte boundary even if
+the rows of the output image don't. If the callback returns nonzero, decoding stops with error 116. With
+a callback, lodepng_push_decoder_finish doesn't output the image, and for non-interlaced PNGs the decoder then
+only keeps a few rows in memory, so images of any size can be decoded. Must be set before writing data.
+*/
+void lodepng_push_decoder_set_row_callback(LodePNGPushDecoder* decoder,
+                                           unsigned (*callback)(const unsigned char* row, unsigned y, void* context),
+                                           void* context);
+
+/*
+Decodes into memory given by the caller, as described at lodepng_decode_into, rather than keeping the image.
+lodepng_push_decoder_finish then doesn't output the image, and the rows don't go to a row callback. The image
+must fit, else writing the header gives error 117. Must be set before writing data.
+*/
+void lodepng_push_decoder_set_output(LodePNGPushDecoder* decoder, unsigned char* out, size_t outsize,
+                                     size_t stride);
+
+/*
+Returns how many rows of the output image, from the top, are complete so far. They can be read with
+lodepng_push_decoder_image, and have the color mode that lodepng_push_decoder_finish outputs. Rows are
+unfiltered and converted to that color mode as soon as they are decompressed, without keeping the
+image in the color mode of the PNG. For Adam7 interlaced images, and when converting to a palette,
+no rows are complete until lodepng_push_decoder_finish is done.
+*/
+unsigned lodepng_push_decoder_rows_done(const LodePNGPushDecoder* decoder);
+/*Returns the image so far, or NULL if no rows are complete yet or there is a row callback.
+Only valid until the next call to the decoder.*/
+const unsigned char* lodepng_push_decoder_image(const LodePNGPushDecoder* decoder);
+
+/*
+To call when all data was given: checks that the PNG was complete, and outputs the image like lodepng_decode.
+The out buffer is allocated with the same allocator and must be freed by the caller. It is NULL if there is a
+row callback.
+*/
+unsigned lodepng_push_decoder_finish(LodePNGPushDecoder* decoder, unsigned char** out, unsigned* w, unsigned* h);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
@@ -915,6 +1082,58 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Incremental encoder, for images that are produced a row at a time, such as frames being recorded or images too
+large to keep in memory. Each row is converted, filtered and compressed soon after it's given, and the PNG is
+written out in IDAT chunks as it grows, so only a few hundred kilobytes are kept in memory, whatever the image size.
+Usage: create it with lodepng_push_encoder_new, set where the PNG goes with lodepng_push_encoder_set_write_callback
+or lodepng_push_encoder_set_file, give all rows from top to bottom with lodepng_push_encoder_write_row, then call
+lodepng_push_encoder_finish, and finally delete it.
+The state gives the settings and info like with lodepng_encode, and must stay alive until the encoder is deleted.
+Differences with lodepng_encode: auto_convert is not done, the PNG gets exactly the color mode of info_png, which
+must be set. Interlacing is not possible (error 120). The segment_rows setting and a custom zlib or deflate function
+are not used. The zlib data is compressed in parts of 256 KiB, like lodepng_encode does when num_threads allows
+more than one thread, so with those settings the zlib data is the same.
+*/
+typedef struct LodePNGPushEncoder LodePNGPushEncoder;
+
+/*Returns NULL if out of memory.*/
+LodePNGPushEncoder* lodepng_push_encoder_new(LodePNGState* state, unsigned w, unsigned h);
+void lodepng_push_encoder_delete(LodePNGPushEncoder* encoder);
+
+/*
+Sets the function that receives the PNG file, in parts in order. To write to a file descriptor, let the
+callback write the data to it. If the callback returns nonzero, encoding stops with error 122. Must be set
+before writing rows.
+*/
+void lodepng_push_encoder_set_write_callback(LodePNGPushEncoder* encoder,
+                                             unsigned (*callback)(const unsigned char* data, size_t size,
+                                                                  void* context),
+                                             void* context);
+
+#ifdef LODEPNG_COMPILE_DISK
+/*Writes the PNG to the file, overwriting it, instead of to a callback. The file is closed by
+lodepng_push_encoder_finish, or when deleting the encoder. Returns error 79 if it can't be opened.*/
+unsigned lodepng_push_encoder_set_file(LodePNGPushEncoder* encoder, const char* filename);
+#endif /*LODEPNG_COMPILE_DISK*/
+
+/*Sets the maximum size of the data of the IDAT chunks, which is also how much compressed data is kept before
+it is written. Default: 65536*/
+void lodepng_push_encoder_set_chunk_size(LodePNGPushEncoder* encoder, size_t size);
+
+/*
+Gives the next row of the image, in the color mode of state->info_raw, starting at a byte boundary even if the
+rows of the image don't. The chunks before the image data are written at the first row. Returns error code,
+which is also stored in state->error. After an error, further calls do nothing and return the same error.
+Giving more than h rows is error 121.
+*/
+unsigned lodepng_push_encoder_write_row(LodePNGPushEncoder* encoder, const unsigned char* row);
+
+/*To call after all h rows were given: compresses the rest of the image and writes the last chunks.*/
+unsigned lodepng_push_encoder_finish(LodePNGPushEncoder* encoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -1465,6 +1684,36 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) level: zlib style compression level, from 1 (fastest) to 9 (smallest), which
+   replaces windowsize, minmatch, nicematch and lazymatching with its own. The
+   default, 0, uses those as they are set. Level 1 finds LZ77 matches with a
+   single-probe hash table without chains, levels 2-7 follow longer and longer
+   hash chains, and 8 and 9 long chains with lazy matching, so that each level
+   is slower and smaller than the one below it. Encoding a 1000x1000
+   screenshot-like RGB image and the 1000x1000 RGBA photo GreenTriangle/bg.png
+   on one x86 core, with the default filter strategy (whose time is included,
+   it doesn't depend on the level):
+
+   level   screenshot          photo
+     0     117 ms  230.3 KB    575 ms  1183.2 KB
+     1      29 ms  249.7 KB     64 ms  1227.5 KB
+     2      71 ms  236.5 KB    252 ms  1213.7 KB
+     3      89 ms  231.4 KB    286 ms  1197.3 KB
+     4     132 ms  227.2 KB    549 ms  1182.5 KB
+     5     142 ms  224.4 KB    771 ms  1167.6 KB
+     6     178 ms  222.4 KB   1174 ms  1155.2 KB
+     7     247 ms  221.5 KB   1730 ms  1146.6 KB
+     8     328 ms  221.0 KB   2275 ms  1141.8 KB
+     9     481 ms  219.3 KB   4593 ms  1129.0 KB
+*) rle: LZ77 that only looks for runs of the same byte and, in PNGs that aren't
+   interlaced, for bytes that are the same as in the scanline above (at
+   rle_distance, which the encoder sets to the size of a filtered scanline if
+   it's 0). That's much faster on images with large flat areas, such as screen
+   captures of 2D scenes, for recording frames in real time, but compresses
+   photos and detailed images badly. It replaces the other LZ77 settings and the
+   level. A 1280x720 RGBA frame of a flat smiley scene encodes in 13 ms with rle
+   and the default filter strategy, or 6 ms with LFS_TWO, to 10-13 KB, compared
+   to 54 ms and 12 KB with the default settings.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
@@ -1872,6 +2121,7 @@ state.decoder.ignore_crc: ignore CRC checksums
 state.decoder.ignore_critical: ignore unknown critical chunks
 state.decoder.ignore_end: ignore missing IEND chunk. May fail if this corruption causes other errors
 state.decoder.color_convert: convert internal PNG color to chosen one
+state.decoder.num_threads: decode PNGs with a segment index on multiple threads
 state.decoder.read_text_chunks: whether to read in text metadata chunks
 state.decoder.remember_unknown_chunks: whether to read in unknown chunks
 state.info_raw.colortype: desired color type for decoded image
@@ -1887,6 +2137,9 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.level: compression level 1-9 instead of the four settings above
+state.encoder.zlibsettings.num_threads: compress on multiple threads
+state.encoder.zlibsettings.rle: fast LZ77 of runs only, for flat images
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
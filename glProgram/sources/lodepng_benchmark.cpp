@@ -0,0 +1,545 @@
+/*
+LodePNG Benchmark
+
+Measures the speed of the stages of lodepng.cpp, decoding and encoding, on a corpus of images, and writes the
+results as JSON to stdout so that runs of different commits can be compared. A summary table goes to stderr.
+
+This file includes lodepng.cpp, to time its internal stages such as unfilter and filter separately, so build it on
+its own, from this directory:
+
+  g++ -O3 -pthread lodepng_benchmark.cpp -o lodepng_benchmark
+
+Usage:
+
+  ./lodepng_benchmark [--reps N] [--bg path/to/bg.png] [--filter strategy] [file.png ...] > results.json
+
+The corpus is made from GreenTriangle/bg.png (or --bg): the file itself, and re-encodings of it with other color
+types, bit depths, sizes and Adam7 interlacing. PNG files given on the command line are added as they are.
+
+Each stage is run several times and the fastest time is reported (N times with --reps, otherwise enough for
+about 20 million pixels per decode stage and 2 million per encode stage). Per stage the JSON has the time in ms,
+the bytes the stage processes (compressed data for read, inflate and CRC, the raw image for the others), MB/s of
+those bytes (MB is 10^6 bytes) and ns per pixel. decode.total and encode.total are the whole lodepng_decode32 and
+lodepng_encode in memory, with the default settings, except for the filter strategy of the encode stages, which
+--filter sets to zero, minsum, entropy, brute_force or estimate (default: minsum). encoded_bytes is the size of the
+PNG that encode.total gives, to compare the strategies. encode.huffman is only the computation of the Huffman code
+lengths, lodepng_huffman_code_lengths, for the lit/len, distance and code length trees of each deflate block that
+encode.deflate makes.
+
+Finally the whole corpus is decoded with lodepng_decode32 on 1, 2, 4, ... threads up to the amount of processors,
+one image per job like Texture::load in framework.h does, to see how decoding many textures at once scales. The
+JSON has the time in ms and the speedup over one thread for each amount of threads.
+
+Same license as LodePNG.
+*/
+
+#include "lodepng.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Stage {
+  const char* name;
+  double ms;
+  size_t bytes;
+};
+
+struct Image {
+  std::string name;
+  std::vector<unsigned char> png;
+};
+
+struct Result {
+  std::string name;
+  unsigned w, h;
+  LodePNGColorType colortype;
+  unsigned bitdepth, interlace;
+  size_t png_size;
+  size_t encoded_size;
+  std::vector<Stage> stages;
+};
+
+struct ThreadResult {
+  unsigned threads;
+  double ms;
+};
+
+double now_ms() {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*the fastest of reps runs of f, which returns a lodepng error code*/
+template<typename F>
+double best_ms(unsigned reps, F f) {
+  double best = 1e300;
+  for(unsigned i = 0; i != reps; ++i) {
+    double start = now_ms();
+    unsigned error = f();
+    double time = now_ms() - start;
+    if(error) {
+      fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+      exit(1);
+    }
+    if(time < best) best = time;
+  }
+  return best;
+}
+
+unsigned clamp_reps(double reps, unsigned lo, unsigned hi) {
+  return reps < lo ? lo : reps > hi ? hi : (unsigned)reps;
+}
+
+std::string json_string(const std::string& s) {
+  std::string result = "\"";
+  for(size_t i = 0; i != s.size(); ++i) {
+    if(s[i] == '"' || s[i] == '\\') result += '\\';
+    result += s[i];
+  }
+  return result + "\"";
+}
+
+const char* colortype_name(LodePNGColorType colortype) {
+  switch(colortype) {
+    case LCT_GREY: return "grey";
+    case LCT_RGB: return "rgb";
+    case LCT_PALETTE: return "palette";
+    case LCT_GREY_ALPHA: return "grey_alpha";
+    case LCT_RGBA: return "rgba";
+    default: return "invalid";
+  }
+}
+
+/*encodes RGBA8 pixels as a PNG of the given color type, a palette gets the colors of the image (at most 256)*/
+std::vector<unsigned char> encode(const std::vector<unsigned char>& rgba, unsigned w, unsigned h,
+                                  LodePNGColorType colortype, unsigned bitdepth, unsigned interlace) {
+  lodepng::State state;
+  std::vector<unsigned char> png;
+  state.encoder.auto_convert = 0;
+  state.info_png.color.colortype = colortype;
+  state.info_png.color.bitdepth = bitdepth;
+  state.info_png.interlace_method = interlace;
+  if(colortype == LCT_PALETTE) {
+    LodePNGColorStats stats;
+    lodepng_color_stats_init(&stats);
+    lodepng_compute_color_stats(&stats, rgba.data(), w, h, &state.info_raw);
+    if(stats.numcolors > (1u << bitdepth)) {
+      fprintf(stderr, "too many colors for a palette of %u bits\n", bitdepth);
+      exit(1);
+    }
+    for(unsigned i = 0; i != stats.numcolors; ++i) {
+      const unsigned char* p = &stats.palette[i * 4];
+      lodepng_palette_add(&state.info_png.color, p[0], p[1], p[2], p[3]);
+    }
+  }
+  unsigned error = lodepng::encode(png, rgba, w, h, state);
+  if(error) {
+    fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+    exit(1);
+  }
+  return png;
+}
+
+/*rounds the colors to levels per channel and makes them opaque, so that the image fits in a palette*/
+std::vector<unsigned char> quantize(std::vector<unsigned char> rgba, unsigned r, unsigned g, unsigned b) {
+  unsigned levels[3] = {r, g, b};
+  for(size_t i = 0; i != rgba.size(); i += 4) {
+    for(unsigned c = 0; c != 3; ++c) {
+      unsigned step = (rgba[i + c] * (levels[c] - 1) + 127) / 255;
+      rgba[i + c] = (unsigned char)(step * 255 / (levels[c] - 1));
+    }
+    rgba[i + 3] = 255;
+  }
+  return rgba;
+}
+
+void make_corpus(std::vector<Image>& corpus, const std::string& path) {
+  std::vector<unsigned char> file, rgba, crop, tiled;
+  unsigned w, h, error;
+  error = lodepng::load_file(file, path);
+  if(!error) error = lodepng::decode(rgba, w, h, file);
+  if(error) {
+    fprintf(stderr, "cannot load %s: %s\n", path.c_str(), lodepng_error_text(error));
+    exit(1);
+  }
+  corpus.push_back({"bg.png", file});
+  corpus.push_back({"rgb8", encode(rgba, w, h, LCT_RGB, 8, 0)});
+  corpus.push_back({"grey8", encode(rgba, w, h, LCT_GREY, 8, 0)});
+  corpus.push_back({"grey_alpha8", encode(rgba, w, h, LCT_GREY_ALPHA, 8, 0)});
+  corpus.push_back({"rgba16", encode(rgba, w, h, LCT_RGBA, 16, 0)});
+  corpus.push_back({"palette8", encode(quantize(rgba, 6, 7, 6), w, h, LCT_PALETTE, 8, 0)});
+  corpus.push_back({"palette4", encode(quantize(rgba, 2, 4, 2), w, h, LCT_PALETTE, 4, 0)});
+  corpus.push_back({"rgba8_adam7", encode(rgba, w, h, LCT_RGBA, 8, 1)});
+  corpus.push_back({"palette8_adam7", encode(quantize(rgba, 6, 7, 6), w, h, LCT_PALETTE, 8, 1)});
+  /*a small texture, such as an icon, and a large one of 3x3 copies*/
+  unsigned cw = w < 64 ? w : 64, ch = h < 64 ? h : 64;
+  for(unsigned y = 0; y != ch; ++y) {
+    crop.insert(crop.end(), &rgba[(size_t)y * w * 4], &rgba[(size_t)y * w * 4] + cw * 4);
+  }
+  corpus.push_back({"rgba8_64x64", encode(crop, cw, ch, LCT_RGBA, 8, 0)});
+  for(unsigned y = 0; y != h * 3; ++y) {
+    for(unsigned x = 0; x != 3; ++x) {
+      tiled.insert(tiled.end(), &rgba[(size_t)(y % h) * w * 4], &rgba[(size_t)(y % h) * w * 4] + w * 4);
+    }
+  }
+  corpus.push_back({"rgb8_3x3", encode(tiled, w * 3, h * 3, LCT_RGB, 8, 0)});
+}
+
+/*the LodePNGFilterStrategy of a --filter name, or -1 if there is none by that name*/
+int filter_strategy(const std::string& name) {
+  static const char* names[] = {"zero", "one", "two", "three", "four", "minsum", "entropy", "brute_force",
+                                "predefined", "estimate"};
+  for(int i = 0; i != (int)(sizeof(names) / sizeof(*names)); ++i) {
+    if(name == names[i] && i != LFS_PREDEFINED) return i;
+  }
+  return -1;
+}
+
+/*the frequencies of the symbols of one Huffman tree of deflate, and the longest code it may have*/
+struct Histogram {
+  std::vector<unsigned> frequencies;
+  unsigned maxbitlen;
+};
+
+/*
+the histograms of the lit/len, distance and code length trees of each block that deflateDynamic makes of the data,
+split into blocks and LZ77 encoded as deflateSegment does with these settings. The code length histogram counts the
+lengths of the other two trees without repeat codes, which is close enough to time the code lengths computation.
+*/
+std::vector<Histogram> huffman_histograms(const unsigned char* data, size_t size,
+                                          const LodePNGCompressSettings* settings) {
+  std::vector<Histogram> result;
+  Hash hash;
+  uivector lz77;
+  size_t blocksize = size / 8u + 8u, start, i;
+  if(blocksize < 65536) blocksize = 65536;
+  if(blocksize > 262144) blocksize = 262144;
+  if(hash_init(&hash, settings->windowsize)) exit(1);
+  uivector_init(&lz77);
+  for(start = 0; start < size; start += blocksize) {
+    Histogram ll = {std::vector<unsigned>(286), 15}, d = {std::vector<unsigned>(30), 15};
+    Histogram cl = {std::vector<unsigned>(NUM_CODE_LENGTH_CODES), 7};
+    std::vector<unsigned> lengths(286);
+    lz77.size = 0;
+    if(encodeLZ77Settings(&lz77, &hash, data, start, size - start < blocksize ? size : start + blocksize, settings)) {
+      exit(1);
+    }
+    for(i = 0; i != lz77.size; ++i) {
+      ++ll.frequencies[lz77.data[i]];
+      if(lz77.data[i] > 256) {
+        ++d.frequencies[lz77.data[i + 2]];
+        i += 3;
+      }
+    }
+    ll.frequencies[256] = 1; /*the end code*/
+    if(lodepng_huffman_code_lengths(lengths.data(), ll.frequencies.data(), 286, 15)) exit(1);
+    for(i = 0; i != 286; ++i) ++cl.frequencies[lengths[i]];
+    if(lodepng_huffman_code_lengths(lengths.data(), d.frequencies.data(), 30, 15)) exit(1);
+    for(i = 0; i != 30; ++i) ++cl.frequencies[lengths[i]];
+    result.push_back(ll);
+    result.push_back(d);
+    result.push_back(cl);
+  }
+  uivector_cleanup(&lz77);
+  hash_cleanup(&hash);
+  return result;
+}
+
+Result benchmark(const Image& image, unsigned reps, LodePNGFilterStrategy strategy) {
+  Result result;
+  const std::vector<unsigned char>& png = image.png;
+  const char* temp = "lodepng_benchmark.tmp.png";
+  unsigned char* raw = 0;
+  unsigned w, h, error;
+  LodePNGState state;
+  LodePNGColorMode rgba8 = lodepng_color_mode_make(LCT_RGBA, 8);
+
+  /*the PNG's own color type, to time the color conversion separately*/
+  lodepng_state_init(&state);
+  state.decoder.color_convert = 0;
+  error = lodepng_decode(&raw, &w, &h, &state, png.data(), png.size());
+  if(error) {
+    fprintf(stderr, "%s: error %u: %s\n", image.name.c_str(), error, lodepng_error_text(error));
+    exit(1);
+  }
+  const LodePNGInfo& info = state.info_png;
+  size_t pixels = (size_t)w * h, raw_size = lodepng_get_raw_size(w, h, &info.color);
+  unsigned decode_reps = reps ? reps : clamp_reps(2e7 / pixels, 3, 1000);
+  unsigned encode_reps = reps ? reps : clamp_reps(2e6 / pixels, 1, 100);
+  result.name = image.name;
+  result.w = w;
+  result.h = h;
+  result.colortype = info.color.colortype;
+  result.bitdepth = info.color.bitdepth;
+  result.interlace = info.interlace_method;
+  result.png_size = png.size();
+
+  std::vector<unsigned char> idat;
+  for(const unsigned char* chunk = png.data() + 8; chunk + 12 <= png.data() + png.size();
+      chunk = lodepng_chunk_next_const(chunk, png.data() + png.size())) {
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      const unsigned char* data = lodepng_chunk_data_const(chunk);
+      idat.insert(idat.end(), data, data + lodepng_chunk_length(chunk));
+    }
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+  }
+  std::vector<unsigned char> scanlines, work, image_raw(raw_size), image_rgba(pixels * 4);
+  {
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    error = lodepng_zlib_decompress(&out, &outsize, idat.data(), idat.size(), &lodepng_default_decompress_settings);
+    if(error) exit(1);
+    scanlines.assign(out, out + outsize);
+    lodepng_free(out);
+  }
+
+  /*decoding*/
+  lodepng_save_file(png.data(), png.size(), temp);
+  result.stages.push_back({"decode.read", best_ms(decode_reps, [&]() {
+    unsigned char* buffer = 0;
+    size_t size = 0;
+    unsigned e = lodepng_load_file(&buffer, &size, temp);
+    lodepng_free(buffer);
+    return e;
+  }), png.size()});
+  remove(temp);
+  result.stages.push_back({"decode.crc", best_ms(decode_reps, [&]() {
+    volatile unsigned crc = lodepng_crc32(png.data(), png.size());
+    (void)crc;
+    return 0u;
+  }), png.size()});
+  result.stages.push_back({"decode.inflate", best_ms(decode_reps, [&]() {
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    unsigned e = lodepng_zlib_decompress(&out, &outsize, idat.data(), idat.size(),
+                                         &lodepng_default_decompress_settings);
+    lodepng_free(out);
+    return e;
+  }), idat.size()});
+  /*postProcessScanlines overwrites its input, so it gets a fresh copy each time, which is not timed*/
+  double unfilter_ms = 1e300;
+  for(unsigned i = 0; i != decode_reps; ++i) {
+    work = scanlines;
+    double t = best_ms(1, [&]() { return postProcessScanlines(image_raw.data(), work.data(), w, h, &info); });
+    if(t < unfilter_ms) unfilter_ms = t;
+  }
+  result.stages.push_back({"decode.unfilter", unfilter_ms, raw_size});
+  result.stages.push_back({"decode.convert", best_ms(decode_reps, [&]() {
+    return lodepng_convert(image_rgba.data(), image_raw.data(), &rgba8, &info.color, w, h);
+  }), raw_size});
+  result.stages.push_back({"decode.total", best_ms(decode_reps, [&]() {
+    unsigned char* out = 0;
+    unsigned ow, oh;
+    unsigned e = lodepng_decode32(&out, &ow, &oh, png.data(), png.size());
+    lodepng_free(out);
+    return e;
+  }), raw_size});
+
+  /*encoding, with the color type and interlacing of the PNG and the default settings*/
+  LodePNGEncoderSettings settings;
+  lodepng_encoder_settings_init(&settings);
+  settings.auto_convert = 0;
+  settings.filter_strategy = strategy;
+  std::vector<unsigned char> encoded;
+  result.stages.push_back({"encode.convert", best_ms(encode_reps, [&]() {
+    return lodepng_convert(image_raw.data(), image_rgba.data(), &info.color, &rgba8, w, h);
+  }), raw_size});
+  unsigned char* filtered = 0;
+  size_t filtered_size = 0;
+  result.stages.push_back({"encode.filter", best_ms(encode_reps, [&]() {
+    lodepng_free(filtered);
+    return preProcessScanlines(&filtered, &filtered_size, image_raw.data(), w, h, &info, &settings, 0);
+  }), raw_size});
+  std::vector<Histogram> histograms = huffman_histograms(filtered, filtered_size, &settings.zlibsettings);
+  result.stages.push_back({"encode.huffman", best_ms(encode_reps, [&]() {
+    unsigned lengths[286];
+    unsigned e = 0;
+    for(size_t i = 0; i != histograms.size() && !e; ++i) {
+      const Histogram& histogram = histograms[i];
+      e = lodepng_huffman_code_lengths(lengths, histogram.frequencies.data(), histogram.frequencies.size(),
+                                       histogram.maxbitlen);
+    }
+    return e;
+  }), raw_size});
+  result.stages.push_back({"encode.deflate", best_ms(encode_reps, [&]() {
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    unsigned e = lodepng_zlib_compress(&out, &outsize, filtered, filtered_size, &settings.zlibsettings);
+    lodepng_free(out);
+    return e;
+  }), raw_size});
+  lodepng_free(filtered);
+  result.stages.push_back({"encode.total", best_ms(encode_reps, [&]() {
+    LodePNGState encode_state;
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    lodepng_state_init(&encode_state);
+    encode_state.encoder.auto_convert = 0;
+    encode_state.encoder.filter_strategy = strategy;
+    lodepng_color_mode_copy(&encode_state.info_png.color, &info.color);
+    encode_state.info_png.interlace_method = info.interlace_method;
+    unsigned e = lodepng_encode(&out, &outsize, image_rgba.data(), w, h, &encode_state);
+    if(!e) encoded.assign(out, out + outsize);
+    lodepng_free(out);
+    lodepng_state_cleanup(&encode_state);
+    return e;
+  }), raw_size});
+  result.stages.push_back({"encode.crc", best_ms(decode_reps, [&]() {
+    volatile unsigned crc = lodepng_crc32(encoded.data(), encoded.size());
+    (void)crc;
+    return 0u;
+  }), encoded.size()});
+  result.encoded_size = encoded.size();
+
+  lodepng_free(raw);
+  lodepng_state_cleanup(&state);
+  return result;
+}
+
+/*decodes the whole corpus on 1, 2, 4, ... threads up to the amount of processors, each thread taking the next image
+that no thread decodes yet, like the jobs of the pool in framework.h*/
+std::vector<ThreadResult> benchmark_threads(const std::vector<Image>& corpus, unsigned reps) {
+  std::vector<ThreadResult> results;
+  std::vector<unsigned> counts;
+  unsigned processors = std::thread::hardware_concurrency();
+  if(processors == 0) processors = 1;
+  for(unsigned n = 1; n < processors; n *= 2) counts.push_back(n);
+  counts.push_back(processors);
+  for(size_t k = 0; k != counts.size(); ++k) {
+    unsigned threads = counts[k];
+    double ms = best_ms(reps ? reps : 3, [&]() {
+      std::atomic<size_t> next(0);
+      std::atomic<unsigned> error(0);
+      auto work = [&]() {
+        for(size_t i = next++; i < corpus.size(); i = next++) {
+          unsigned char* out = 0;
+          unsigned w, h;
+          unsigned e = lodepng_decode32(&out, &w, &h, corpus[i].png.data(), corpus[i].png.size());
+          lodepng_free(out);
+          if(e) error = e;
+        }
+      };
+      std::vector<std::thread> workers;
+      for(unsigned t = 1; t < threads; ++t) workers.emplace_back(work);
+      work();
+      for(size_t t = 0; t != workers.size(); ++t) workers[t].join();
+      return error.load();
+    });
+    results.push_back({threads, ms});
+  }
+  return results;
+}
+
+void print_json(const std::vector<Result>& results, const std::vector<ThreadResult>& thread_results,
+                const std::string& filter) {
+  printf("{\n  \"lodepng_version\": \"%s\",\n", LODEPNG_VERSION_STRING);
+  printf("  \"filter_strategy\": %s,\n", json_string(filter).c_str());
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  printf("  \"simd\": true,\n");
+#else
+  printf("  \"simd\": false,\n");
+#endif
+  printf("  \"images\": [\n");
+  for(size_t i = 0; i != results.size(); ++i) {
+    const Result& r = results[i];
+    printf("    {\n      \"name\": %s, \"width\": %u, \"height\": %u, \"color_type\": \"%s\", \"bit_depth\": %u, "
+           "\"interlace\": %u, \"png_bytes\": %lu, \"encoded_bytes\": %lu,\n      \"stages\": {\n",
+           json_string(r.name).c_str(), r.w, r.h, colortype_name(r.colortype), r.bitdepth, r.interlace,
+           (unsigned long)r.png_size, (unsigned long)r.encoded_size);
+    for(size_t j = 0; j != r.stages.size(); ++j) {
+      const Stage& s = r.stages[j];
+      double seconds = s.ms / 1000.0;
+      printf("        \"%s\": {\"ms\": %.4f, \"bytes\": %lu, \"mb_per_s\": %.2f, \"ns_per_pixel\": %.3f}%s\n",
+             s.name, s.ms, (unsigned long)s.bytes, seconds > 0 ? s.bytes / seconds / 1e6 : 0.0,
+             s.ms * 1e6 / ((double)r.w * r.h), j + 1 == r.stages.size() ? "" : ",");
+    }
+    printf("      }\n    }%s\n", i + 1 == results.size() ? "" : ",");
+  }
+  printf("  ],\n  \"decode_threads\": [\n");
+  for(size_t i = 0; i != thread_results.size(); ++i) {
+    const ThreadResult& t = thread_results[i];
+    printf("    {\"threads\": %u, \"ms\": %.4f, \"speedup\": %.2f}%s\n", t.threads, t.ms,
+           thread_results[0].ms / t.ms, i + 1 == thread_results.size() ? "" : ",");
+  }
+  printf("  ]\n}\n");
+}
+
+void print_table(const std::vector<Result>& results) {
+  size_t i, j;
+  fprintf(stderr, "%-16s", "ns/pixel");
+  for(j = 0; j != results[0].stages.size(); ++j) fprintf(stderr, " %9s", strchr(results[0].stages[j].name, '.') + 1);
+  fprintf(stderr, " %10s\n%-16s", "encoded", "");
+  for(j = 0; j != results[0].stages.size(); ++j) {
+    fprintf(stderr, " %9s", strncmp(results[0].stages[j].name, "decode", 6) ? "(encode)" : "(decode)");
+  }
+  fprintf(stderr, " %10s\n", "(bytes)");
+  for(i = 0; i != results.size(); ++i) {
+    fprintf(stderr, "%-16s", results[i].name.c_str());
+    for(j = 0; j != results[i].stages.size(); ++j) {
+      fprintf(stderr, " %9.3f", results[i].stages[j].ms * 1e6 / ((double)results[i].w * results[i].h));
+    }
+    fprintf(stderr, " %10lu\n", (unsigned long)results[i].encoded_size);
+  }
+}
+
+void print_thread_table(const std::vector<ThreadResult>& thread_results) {
+  fprintf(stderr, "\n%-16s %9s %9s\n", "decode corpus", "ms", "speedup");
+  for(size_t i = 0; i != thread_results.size(); ++i) {
+    fprintf(stderr, "%2u threads       %9.1f %9.2f\n", thread_results[i].threads, thread_results[i].ms,
+            thread_results[0].ms / thread_results[i].ms);
+  }
+}
+
+} /*namespace*/
+
+int main(int argc, char* argv[]) {
+  std::vector<Image> corpus;
+  std::vector<Result> results;
+  std::string bg = "GreenTriangle/bg.png";
+  std::string filter = "minsum";
+  unsigned reps = 0;
+  int i;
+  for(i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if(arg == "--reps" && i + 1 < argc) reps = (unsigned)atoi(argv[++i]);
+    else if(arg == "--bg" && i + 1 < argc) bg = argv[++i];
+    else if(arg == "--filter" && i + 1 < argc) filter = argv[++i];
+  }
+  if(filter_strategy(filter) < 0) {
+    fprintf(stderr, "unknown filter strategy %s\n", filter.c_str());
+    return 1;
+  }
+  make_corpus(corpus, bg);
+  for(i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if(arg == "--reps" || arg == "--bg" || arg == "--filter") {
+      ++i;
+    } else {
+      Image image;
+      unsigned error = lodepng::load_file(image.png, arg);
+      if(error) {
+        fprintf(stderr, "cannot load %s: %s\n", arg.c_str(), lodepng_error_text(error));
+        return 1;
+      }
+      image.name = arg;
+      corpus.push_back(image);
+    }
+  }
+  for(size_t k = 0; k != corpus.size(); ++k) {
+    fprintf(stderr, "%s...\n", corpus[k].name.c_str());
+    results.push_back(benchmark(corpus[k], reps, (LodePNGFilterStrategy)filter_strategy(filter)));
+  }
+  fprintf(stderr, "decoding on threads...\n");
+  std::vector<ThreadResult> thread_results = benchmark_threads(corpus, reps);
+  print_table(results);
+  print_thread_table(thread_results);
+  print_json(results, thread_results, filter);
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+LodePNG Checksum Test
+
+Checks the CRC32 and Adler32 code of lodepng.cpp that uses SIMD or CRC instructions against the plain table CRC
+and the Adler32 sums by their definition: each kernel on its own, and update_crc32 and update_adler32 for every
+length from 0 to 300 at 16 starting addresses, split in two at every point, and for large lengths that overflow the
+Adler32 sums.
+
+See lodepng_test.h for how to build and run it.
+
+Same license as LodePNG.
+*/
+
+#include "lodepng.cpp"
+#include "lodepng_test.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+/*the CRC register r updated with the bytes one at a time, with the plain lookup table*/
+unsigned table_crc_register(unsigned r, const unsigned char* data, size_t length) {
+  for(size_t i = 0; i != length; ++i) r = lodepng_crc32_table0[(r ^ data[i]) & 0xffu] ^ (r >> 8);
+  return r;
+}
+
+unsigned table_crc(unsigned crc, const unsigned char* data, size_t length) {
+  return table_crc_register(crc ^ 0xffffffffu, data, length) ^ 0xffffffffu;
+}
+
+/*Adler32 by its definition, the sums taken modulo 65521 after every byte*/
+unsigned scalar_adler(unsigned adler, const unsigned char* data, size_t length) {
+  unsigned s1 = adler & 0xffffu, s2 = adler >> 16;
+  for(size_t i = 0; i != length; ++i) {
+    s1 = (s1 + data[i]) % 65521u;
+    s2 = (s2 + s1) % 65521u;
+  }
+  return (s2 << 16) | s1;
+}
+
+void check(const char* name, unsigned got, unsigned expected, size_t length, size_t offset) {
+  if(!count_case(got == expected)) {
+    printf("%s differs: length %u, offset %u, %08x instead of %08x\n", name, (unsigned)length, (unsigned)offset, got,
+           expected);
+  }
+}
+
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+typedef void (*AdlerKernel)(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned blocks);
+
+/*runs an Adler32 kernel, which takes blocks of 32 bytes, from several starting sums*/
+void check_adler_kernel(const char* name, AdlerKernel kernel, const std::vector<unsigned char>& data) {
+  static const unsigned starts[] = {1u, 0xfff0fff0u, 0x12345678u % 65521u};
+  for(size_t offset = 0; offset != 16; ++offset) {
+    for(unsigned blocks = 1; offset + blocks * 32u <= data.size() && blocks <= 400u; blocks += blocks < 12 ? 1 : 37) {
+      for(size_t i = 0; i != sizeof(starts) / sizeof(*starts); ++i) {
+        unsigned adler = starts[i] % 65521u | ((starts[i] >> 16) % 65521u) << 16;
+        unsigned s1 = adler & 0xffffu, s2 = adler >> 16;
+        kernel(&s1, &s2, &data[offset], blocks);
+        check(name, (s2 << 16) | s1, scalar_adler(adler, &data[offset], blocks * 32u), blocks * 32u, offset);
+      }
+    }
+  }
+}
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_SIMD_NEON*/
+
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_CRC_ARM)
+typedef unsigned (*CrcKernel)(unsigned r, const unsigned char* data, size_t length);
+
+/*runs a CRC kernel on the lengths it supports, those of at least min_length in steps of step*/
+void check_crc_kernel(const char* name, CrcKernel kernel, size_t min_length, size_t step,
+                      const std::vector<unsigned char>& data) {
+  static const unsigned registers[] = {0xffffffffu, 0u, 0x12345678u};
+  for(size_t offset = 0; offset != 16; ++offset) {
+    for(size_t length = min_length; offset + length <= data.size() && length <= 1024u; length += step) {
+      for(size_t i = 0; i != sizeof(registers) / sizeof(*registers); ++i) {
+        check(name, kernel(registers[i], &data[offset], length),
+              table_crc_register(registers[i], &data[offset], length), length, offset);
+      }
+    }
+  }
+}
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_CRC_ARM*/
+
+/*update_crc32 and update_adler32 on the whole data and continued over every split of it*/
+void check_dispatch(const std::vector<unsigned char>& data, size_t offset, size_t length) {
+  const unsigned char* p = &data[offset];
+  unsigned crc = table_crc(0, p, length), adler = scalar_adler(1u, p, length);
+  check("lodepng_crc32", lodepng_crc32(p, length), crc, length, offset);
+  check("update_crc32", update_crc32(0, p, length), crc, length, offset);
+  check("update_adler32", update_adler32(1u, p, (unsigned)length), adler, length, offset);
+  for(size_t split = 0; split <= length; split += length > 300 ? length / 7 + 1 : 1) {
+    check("update_crc32 continued", update_crc32(update_crc32(0, p, split), p + split, length - split), crc, length,
+          offset);
+    check("update_adler32 continued",
+          update_adler32(update_adler32(1u, p, (unsigned)split), p + split, (unsigned)(length - split)), adler, length,
+          offset);
+  }
+}
+
+} /*namespace*/
+
+int main() {
+  std::vector<unsigned char> random(200000), ones(200000, 255);
+  for(size_t i = 0; i != random.size(); ++i) random[i] = (unsigned char)(random_number() >> 3);
+
+  for(int round = 0; round != 2; ++round) {
+    const std::vector<unsigned char>& data = round ? ones : random;
+#ifdef LODEPNG_SIMD_X86
+    if(lodepng_cpu_features() & LODEPNG_CPU_PCLMUL) check_crc_kernel("crc32PCLMUL", crc32PCLMUL, 64, 16, data);
+    else if(!round) printf("crc32PCLMUL skipped: not supported by this CPU\n");
+    if(lodepng_cpu_features() & LODEPNG_CPU_SSSE3) check_adler_kernel("adler32SSSE3", adler32SSSE3, data);
+    else if(!round) printf("adler32SSSE3 skipped: not supported by this CPU\n");
+    if(lodepng_cpu_features() & LODEPNG_CPU_AVX2) check_adler_kernel("adler32AVX2", adler32AVX2, data);
+    else if(!round) printf("adler32AVX2 skipped: not supported by this CPU\n");
+#endif /*LODEPNG_SIMD_X86*/
+#ifdef LODEPNG_SIMD_NEON
+    check_adler_kernel("adler32NEON", adler32NEON, data);
+#endif /*LODEPNG_SIMD_NEON*/
+#ifdef LODEPNG_CRC_ARM
+    check_crc_kernel("crc32ARM", crc32ARM, 0, 1, data);
+#endif /*LODEPNG_CRC_ARM*/
+    for(size_t offset = 0; offset != 16; ++offset) {
+      for(size_t length = 0; length <= 300; ++length) check_dispatch(data, offset, length);
+    }
+    /*beyond the 5552 bytes and 173 blocks after which the sums are reduced*/
+    check_dispatch(data, 3, 5552);
+    check_dispatch(data, 1, 5553 + 32 * 173);
+    check_dispatch(data, 0, data.size());
+    check_dispatch(data, 7, data.size() - 7);
+  }
+  return report();
+}
@@ -0,0 +1,289 @@
+/*
+LodePNG Convert Test
+
+Checks the SIMD color conversions of lodepng.cpp against its scalar code, getPixelColorRGBA8 one pixel at a time:
+lodepng_convert to RGBA8 and RGB8, getPixelColorsRGBA8 and getPixelColorsRGB8, and each x86 and NEON kernel on its
+own, for every input color type and bit depth, with and without a color key, palettes of every size, and widths of 1
+to 70 pixels and a few beyond the 256 that 16-bit input is narrowed in at a time.
+
+See lodepng_test.h for how to build and run it.
+
+Same license as LodePNG.
+*/
+
+#include "lodepng.cpp"
+#include "lodepng_test.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+/*writes value to the pixel i of bitdepth bits*/
+void set_pixel(std::vector<unsigned char>& pixels, size_t i, unsigned bitdepth, unsigned value) {
+  size_t bit = i * bitdepth;
+  for(unsigned b = 0; b != bitdepth; ++b, ++bit) {
+    unsigned mask = 0x80u >> (bit & 7u);
+    if((value >> (bitdepth - 1u - b)) & 1u) pixels[bit / 8u] |= (unsigned char)mask;
+    else pixels[bit / 8u] &= (unsigned char)~mask;
+  }
+}
+
+/*
+random pixels, of which about a quarter is the color key, if there is one. Palette indices are within the palette,
+except for about a quarter of them in every other block of 16 pixels, so that the kernels see both blocks without and
+blocks with indices that have no color.
+*/
+std::vector<unsigned char> random_pixels(size_t numpixels, const LodePNGColorMode& mode) {
+  size_t bpp = lodepng_get_bpp(&mode), i;
+  std::vector<unsigned char> result((numpixels * bpp + 7u) / 8u);
+  for(i = 0; i != result.size(); ++i) result[i] = (unsigned char)(random_number() >> 3);
+  if(mode.colortype == LCT_PALETTE) {
+    for(i = 0; i != numpixels; ++i) {
+      unsigned index = random_number();
+      if(!(i & 16u) || (random_number() & 3u)) index %= (unsigned)mode.palettesize;
+      set_pixel(result, i, mode.bitdepth, index & ((1u << mode.bitdepth) - 1u));
+    }
+  }
+  if(!mode.key_defined) return result;
+  for(i = 0; i != numpixels; ++i) {
+    if(random_number() & 3u) continue;
+    if(mode.colortype == LCT_GREY && mode.bitdepth < 8) {
+      set_pixel(result, i, mode.bitdepth, mode.key_r);
+    } else {
+      unsigned key[3] = {mode.key_r, mode.key_g, mode.key_b};
+      unsigned channels = mode.colortype == LCT_GREY ? 1 : 3;
+      for(unsigned c = 0; c != channels; ++c) {
+        if(mode.bitdepth == 8) {
+          result[i * channels + c] = (unsigned char)key[c];
+        } else {
+          result[(i * channels + c) * 2u] = (unsigned char)(key[c] >> 8);
+          result[(i * channels + c) * 2u + 1u] = (unsigned char)key[c];
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/*the input modes to test: every color type and bit depth, with the color keys and palette sizes*/
+std::vector<LodePNGColorMode> modes() {
+  static const LodePNGColorType types[] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  std::vector<LodePNGColorMode> result;
+  for(size_t t = 0; t != sizeof(types) / sizeof(*types); ++t) {
+    for(unsigned bitdepth = 1; bitdepth <= 16; bitdepth *= 2) {
+      LodePNGColorMode mode = lodepng_color_mode_make(types[t], bitdepth);
+      if(checkColorValidity(types[t], bitdepth)) continue;
+      if(types[t] == LCT_PALETTE) {
+        /*sizes below 2^bitdepth leave indices without a color, and 16 and 17 are where the small palette kernels end*/
+        static const unsigned sizes[] = {1, 2, 3, 4, 15, 16, 17, 100, 255, 256};
+        for(size_t s = 0; s != sizeof(sizes) / sizeof(*sizes); ++s) {
+          if(sizes[s] > (1u << bitdepth)) continue;
+          LodePNGColorMode palette = mode;
+          palette.palette = 0;
+          palette.palettesize = 0;
+          for(unsigned i = 0; i != sizes[s]; ++i) {
+            lodepng_palette_add(&palette, (unsigned char)random_number(), (unsigned char)random_number(),
+                                (unsigned char)random_number(), (unsigned char)random_number());
+          }
+          result.push_back(palette);
+        }
+        continue;
+      }
+      result.push_back(mode);
+      if(types[t] == LCT_GREY || types[t] == LCT_RGB) {
+        unsigned highest = (1u << bitdepth) - 1u;
+        LodePNGColorMode key = mode;
+        key.key_defined = 1;
+        key.key_r = random_number() & highest;
+        key.key_g = random_number() & highest;
+        key.key_b = random_number() & highest;
+        result.push_back(key);
+        /*a key that no pixel can have, which the 8-bit kernels must not compare modulo 256*/
+        if(bitdepth == 8) {
+          key.key_r += 256u;
+          result.push_back(key);
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/*the pixels converted one at a time by the scalar code*/
+std::vector<unsigned char> expected_pixels(const std::vector<unsigned char>& in, size_t numpixels,
+                                           const LodePNGColorMode& mode, unsigned channels) {
+  std::vector<unsigned char> result(numpixels * channels);
+  for(size_t i = 0; i != numpixels; ++i) {
+    unsigned char rgba[4];
+    getPixelColorRGBA8(&rgba[0], &rgba[1], &rgba[2], &rgba[3], in.data(), i, &mode);
+    for(unsigned c = 0; c != channels; ++c) result[i * channels + c] = rgba[c];
+  }
+  return result;
+}
+
+std::string mode_name(const LodePNGColorMode& mode) {
+  static const char* names[] = {"grey", "?", "rgb", "palette", "grey_alpha", "?", "rgba"};
+  char buffer[100];
+  snprintf(buffer, sizeof(buffer), "%s%u", names[mode.colortype], mode.bitdepth);
+  std::string result = buffer;
+  if(mode.colortype == LCT_PALETTE) {
+    snprintf(buffer, sizeof(buffer), " of %u colors", (unsigned)mode.palettesize);
+    result += buffer;
+  }
+  if(mode.key_defined) {
+    snprintf(buffer, sizeof(buffer), " with key %u %u %u", mode.key_r, mode.key_g, mode.key_b);
+    result += buffer;
+  }
+  return result;
+}
+
+void check(const char* name, const std::vector<unsigned char>& got, const std::vector<unsigned char>& expected,
+           const LodePNGColorMode& mode, unsigned channels, size_t numpixels, unsigned error) {
+  if(!count_case(!error && got == expected)) {
+    size_t i;
+    for(i = 0; i != got.size() && got[i] == expected[i]; ++i) {}
+    printf("%s differs: %s to %s, %u pixels, error %u, first difference at pixel %u\n", name, mode_name(mode).c_str(),
+           channels == 4 ? "RGBA8" : "RGB8", (unsigned)numpixels, error, (unsigned)(i / channels));
+  }
+}
+
+/*
+a kernel, called like convertPixelsSIMD, for numpixels a multiple of 16. Returns 0 for the color modes it doesn't
+support.
+*/
+typedef unsigned (*Kernel)(unsigned char* out, const unsigned char* in, size_t numpixels,
+                           const LodePNGColorMode* mode, unsigned channels);
+
+struct KernelInfo {
+  const char* name;
+  bool supported;
+  Kernel kernel;
+};
+
+#ifdef LODEPNG_SIMD_X86
+unsigned grey_sse2(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode, unsigned c) {
+  if(c != 4 || mode->colortype != LCT_GREY || mode->bitdepth != 8) return 0;
+  greyToRGBA8SSE2(out, in, n, mode->key_defined && mode->key_r < 256 ? (int)mode->key_r : -1);
+  return 1;
+}
+unsigned grey_alpha_sse2(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode,
+                         unsigned c) {
+  if(c != 4 || mode->colortype != LCT_GREY_ALPHA || mode->bitdepth != 8) return 0;
+  greyAlphaToRGBA8SSE2(out, in, n);
+  return 1;
+}
+unsigned rgb_ssse3(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode, unsigned c) {
+  unsigned key = 0;
+  if(c != 4 || mode->colortype != LCT_RGB || mode->bitdepth != 8) return 0;
+  if(mode->key_defined && mode->key_r < 256 && mode->key_g < 256 && mode->key_b < 256) {
+    key = mode->key_r | (mode->key_g << 8u) | (mode->key_b << 16u) | 0xff000000u;
+  }
+  rgbToRGBA8SSSE3(out, in, n, key);
+  return 1;
+}
+unsigned rgba_ssse3(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode, unsigned c) {
+  if(c != 3 || mode->colortype != LCT_RGBA || mode->bitdepth != 8) return 0;
+  rgbaToRGB8SSSE3(out, in, n);
+  return 1;
+}
+unsigned grey_ssse3(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode, unsigned c) {
+  if(c != 3 || mode->colortype != LCT_GREY || mode->bitdepth != 8) return 0;
+  greyToRGB8SSSE3(out, in, n);
+  return 1;
+}
+unsigned palette16_ssse3(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode,
+                         unsigned c) {
+  if(c != 4 || mode->colortype != LCT_PALETTE) return 0;
+  if(mode->bitdepth != 4 && (mode->bitdepth != 8 || mode->palettesize > 16)) return 0;
+  palette16ToRGBA8SSSE3(out, in, n, mode->palette, mode->bitdepth);
+  return 1;
+}
+unsigned palette_avx2(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode,
+                      unsigned c) {
+  if(c != 4 || mode->colortype != LCT_PALETTE || mode->bitdepth != 8) return 0;
+  paletteToRGBA8AVX2(out, in, n, mode->palette);
+  return 1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+/*narrow16To8SIMD on its own, for 16-bit input of the same channels as the output, without key*/
+unsigned narrow16(unsigned char* out, const unsigned char* in, size_t n, const LodePNGColorMode* mode, unsigned c) {
+  if(mode->bitdepth != 16 || mode->key_defined || lodepng_get_channels(mode) != c) return 0;
+  narrow16To8SIMD(out, in, n * c);
+  return 1;
+}
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_SIMD_NEON*/
+
+std::vector<KernelInfo> kernels() {
+  std::vector<KernelInfo> result;
+#ifdef LODEPNG_SIMD_X86
+  unsigned features = lodepng_cpu_features();
+  bool ssse3 = (features & LODEPNG_CPU_SSSE3) != 0;
+  KernelInfo x86[] = {
+    {"greyToRGBA8SSE2", true, grey_sse2},
+    {"greyAlphaToRGBA8SSE2", true, grey_alpha_sse2},
+    {"rgbToRGBA8SSSE3", ssse3, rgb_ssse3},
+    {"rgbaToRGB8SSSE3", ssse3, rgba_ssse3},
+    {"greyToRGB8SSSE3", ssse3, grey_ssse3},
+    {"palette16ToRGBA8SSSE3", ssse3, palette16_ssse3},
+    {"paletteToRGBA8AVX2", (features & LODEPNG_CPU_AVX2) != 0, palette_avx2},
+  };
+  result.assign(x86, x86 + sizeof(x86) / sizeof(*x86));
+#endif /*LODEPNG_SIMD_X86*/
+#ifdef LODEPNG_SIMD_NEON
+  /*the NEON kernels are all in convertPixelsSIMD*/
+  KernelInfo neon = {"convertPixelsSIMD", true, convertPixelsSIMD};
+  result.push_back(neon);
+#endif /*LODEPNG_SIMD_NEON*/
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  KernelInfo narrow = {"narrow16To8SIMD", true, narrow16};
+  result.push_back(narrow);
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_SIMD_NEON*/
+  return result;
+}
+
+/*converts numpixels pixels with lodepng_convert, getPixelColorsRGBA8 or getPixelColorsRGB8 and the kernels*/
+void check_pixels(const LodePNGColorMode& mode, unsigned channels, size_t numpixels,
+                  const std::vector<KernelInfo>& list) {
+  std::vector<unsigned char> in = random_pixels(numpixels, mode);
+  std::vector<unsigned char> expected = expected_pixels(in, numpixels, mode, channels);
+  /*exactly sized, so that address sanitizer sees reads or writes past the end*/
+  std::vector<unsigned char> out(numpixels * channels);
+  LodePNGColorMode mode_out = lodepng_color_mode_make(channels == 4 ? LCT_RGBA : LCT_RGB, 8);
+  unsigned error = lodepng_convert(out.data(), in.data(), &mode_out, &mode, (unsigned)numpixels, 1);
+  check("lodepng_convert", out, expected, mode, channels, numpixels, error);
+  out.assign(out.size(), 0);
+  if(channels == 4) getPixelColorsRGBA8(out.data(), numpixels, in.data(), &mode);
+  else getPixelColorsRGB8(out.data(), numpixels, in.data(), &mode);
+  check(channels == 4 ? "getPixelColorsRGBA8" : "getPixelColorsRGB8", out, expected, mode, channels, numpixels, 0);
+  if(numpixels & 15u) return;
+  for(size_t k = 0; k != list.size(); ++k) {
+    if(!list[k].supported) continue;
+    out.assign(out.size(), 0);
+    if(!list[k].kernel(out.data(), in.data(), numpixels, &mode, channels)) continue;
+    check(list[k].name, out, expected, mode, channels, numpixels, 0);
+  }
+}
+
+} /*namespace*/
+
+int main() {
+  std::vector<KernelInfo> list = kernels();
+  std::vector<LodePNGColorMode> all = modes();
+  for(size_t k = 0; k != list.size(); ++k) {
+    if(!list[k].supported) printf("%s skipped: not supported by this CPU\n", list[k].name);
+  }
+  for(size_t m = 0; m != all.size(); ++m) {
+    for(unsigned channels = 3; channels <= 4; ++channels) {
+      for(size_t numpixels = 1; numpixels <= 70; ++numpixels) check_pixels(all[m], channels, numpixels, list);
+      check_pixels(all[m], channels, 256, list);
+      check_pixels(all[m], channels, 257, list);
+      check_pixels(all[m], channels, 1000, list);
+    }
+    lodepng_color_mode_cleanup(&all[m]);
+  }
+  return report();
+}
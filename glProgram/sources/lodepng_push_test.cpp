@@ -0,0 +1,349 @@
+/*
+LodePNG Push Test
+
+Checks the push decoder and the push encoder against lodepng_decode and lodepng_encode. PNGs of every color type and
+bit depth, plain and Adam7 interlaced, and of sizes from 1x1 up to over the 256 KiB parts that the encoder compresses
+at a time, are given to the push decoder in slices of random sizes, from single bytes to the whole file, which must
+output the same image as lodepng_decode: as a whole, through the row callback, and into memory with a row stride,
+with and without a region and reduce. The rows it has done so far must match at every step. The push encoder gets the
+rows of the same images, and must write the same zlib data as lodepng_encode, in IDAT chunks of random sizes.
+
+See lodepng_test.h for how to build and run it.
+
+Same license as LodePNG.
+*/
+
+#include "lodepng.cpp"
+#include "lodepng_test.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+/*the size in bytes of a row that starts at a byte boundary*/
+size_t row_bytes(unsigned w, const LodePNGColorMode& mode) {
+  return ((size_t)w * lodepng_get_bpp(&mode) + 7u) / 8u;
+}
+
+/*packs rows that each start at a byte boundary into the image without gaps that lodepng_encode takes*/
+std::vector<unsigned char> pack_rows(const std::vector<unsigned char>& rows, unsigned w, unsigned h,
+                                     const LodePNGColorMode& mode) {
+  size_t rowbits = (size_t)w * lodepng_get_bpp(&mode), stride = row_bytes(w, mode);
+  std::vector<unsigned char> image(lodepng_get_raw_size(w, h, &mode), 0);
+  for(size_t y = 0; y != h; ++y) {
+    for(size_t i = 0; i != rowbits; ++i) {
+      size_t bit = y * rowbits + i;
+      if((rows[y * stride + i / 8u] >> (7u - i % 8u)) & 1u) image[bit / 8u] |= (unsigned char)(0x80u >> (bit % 8u));
+    }
+  }
+  return image;
+}
+
+/*random rows, each starting at a byte boundary with its padding bits 0, of which many bytes repeat the byte a pixel
+before, so that the encoder finds LZ77 matches. Palette indices stay within the palette.*/
+std::vector<unsigned char> random_rows(unsigned w, unsigned h, const LodePNGColorMode& mode) {
+  size_t stride = row_bytes(w, mode), bytewidth = (lodepng_get_bpp(&mode) + 7u) / 8u;
+  unsigned rowbits = w * lodepng_get_bpp(&mode);
+  std::vector<unsigned char> rows((size_t)h * stride);
+  for(size_t i = 0; i != rows.size(); ++i) {
+    if(i % stride >= bytewidth && (random_number() & 3u)) rows[i] = rows[i - bytewidth];
+    else rows[i] = (unsigned char)(random_number() >> 3);
+    if(mode.colortype == LCT_PALETTE && mode.bitdepth == 8) rows[i] = (unsigned char)(rows[i] % mode.palettesize);
+  }
+  if(mode.colortype == LCT_PALETTE && mode.bitdepth < 8) {
+    for(size_t y = 0; y != h; ++y) {
+      for(unsigned x = 0; x != w; ++x) {
+        unsigned bit = x * mode.bitdepth, shift = 8u - mode.bitdepth - bit % 8u;
+        unsigned char& byte = rows[y * stride + bit / 8u];
+        unsigned index = ((byte >> shift) & ((1u << mode.bitdepth) - 1u)) % (unsigned)mode.palettesize;
+        byte = (unsigned char)((byte & ~(((1u << mode.bitdepth) - 1u) << shift)) | (index << shift));
+      }
+    }
+  }
+  for(size_t y = 0; rowbits % 8u && y != h; ++y) {
+    rows[y * stride + stride - 1] &= (unsigned char)(0xff00u >> rowbits % 8u);
+  }
+  return rows;
+}
+
+/*the concatenated data of the IDAT chunks of a PNG*/
+std::vector<unsigned char> idat_data(const std::vector<unsigned char>& png) {
+  std::vector<unsigned char> data;
+  const unsigned char* end = png.data() + png.size();
+  const unsigned char* chunk = png.size() > 8 ? png.data() + 8 : end;
+  for(; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk, end)) {
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      const unsigned char* begin = lodepng_chunk_data_const(chunk);
+      data.insert(data.end(), begin, begin + lodepng_chunk_length(chunk));
+    }
+  }
+  return data;
+}
+
+std::string mode_name(const LodePNGColorMode& mode) {
+  static const char* names[] = {"grey", "?", "RGB", "palette", "grey alpha", "?", "RGBA"};
+  char buffer[100];
+  snprintf(buffer, sizeof(buffer), "%s %u bit", names[mode.colortype], mode.bitdepth);
+  return buffer;
+}
+
+/*the settings of one push decode, and what it collected*/
+struct PushRun {
+  size_t max_slice; /*the slices are from 1 to this many bytes*/
+  bool callback; /*get the rows through the row callback*/
+  size_t stride; /*if not 0, decode into out with this stride*/
+  size_t row_size; /*the size of the rows of the row callback*/
+  std::vector<unsigned char> out;
+  std::vector<unsigned char> rows; /*from the row callback*/
+  unsigned next_y;
+  bool rows_in_order;
+};
+
+unsigned collect_row(const unsigned char* row, unsigned y, void* context) {
+  PushRun* run = (PushRun*)context;
+  if(y != run->next_y) run->rows_in_order = false;
+  run->rows.insert(run->rows.end(), row, row + run->row_size);
+  ++run->next_y;
+  return 0;
+}
+
+/*
+decodes png with the push decoder in slices, with the decoder settings of reference, into a new state. expected is
+the output of lodepng_decode, of expected_w pixels wide, to check the rows done after each slice, which sets
+partial_ok. Returns the error, and the image in image.
+*/
+unsigned push_decode(PushRun& run, std::vector<unsigned char>& image, unsigned& w, unsigned& h,
+                     const LodePNGState& reference, const std::vector<unsigned char>& png,
+                     const std::vector<unsigned char>& expected, unsigned expected_w, bool& partial_ok) {
+  LodePNGState state;
+  LodePNGPushDecoder* decoder;
+  unsigned char* out = 0;
+  unsigned error = 0, rows_before = 0;
+  size_t pos = 0;
+  partial_ok = true;
+  lodepng_state_init(&state);
+  lodepng_state_copy(&state, &reference);
+  decoder = lodepng_push_decoder_new(&state);
+  if(!decoder) return 83;
+  if(run.callback) lodepng_push_decoder_set_row_callback(decoder, collect_row, &run);
+  if(run.stride) lodepng_push_decoder_set_output(decoder, run.out.data(), run.out.size(), run.stride);
+  while(pos != png.size() && !error) {
+    size_t size = 1 + random_number() % run.max_slice;
+    unsigned rows;
+    if(size > png.size() - pos) size = png.size() - pos;
+    error = lodepng_push_decoder_write(decoder, png.data() + pos, size);
+    pos += size;
+    rows = lodepng_push_decoder_rows_done(decoder);
+    if(rows < rows_before) partial_ok = false;
+    if(rows != rows_before && !run.callback && !run.stride && !error) {
+      /*the whole bytes of the rows done so far, the last one can be shared with the next row*/
+      const LodePNGColorMode& mode = state.decoder.color_convert ? state.info_raw : state.info_png.color;
+      size_t bytes = (size_t)rows * expected_w * lodepng_get_bpp(&mode) / 8u;
+      if(!lodepng_push_decoder_image(decoder) || bytes > expected.size() ||
+         memcmp(lodepng_push_decoder_image(decoder), expected.data(), bytes) != 0) {
+        partial_ok = false;
+      }
+    }
+    rows_before = rows;
+  }
+  if(!error) error = lodepng_push_decoder_finish(decoder, &out, &w, &h);
+  if(out) image.assign(out, out + lodepng_get_raw_size(w, h, state.decoder.color_convert ? &state.info_raw
+                                                                                         : &state.info_png.color));
+  else image.clear();
+  lodepng_free(out);
+  lodepng_push_decoder_delete(decoder);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+/*checks the push decoder on png, with the output color mode and region of state, against lodepng_decode*/
+void check_decode(const std::vector<unsigned char>& png, LodePNGState& state, const std::string& name) {
+  static const size_t max_slices[] = {1, 7, 300, 5000, (size_t)1 << 30};
+  unsigned char* out = 0;
+  unsigned w = 0, h = 0, error;
+  std::vector<unsigned char> expected, into;
+  const LodePNGColorMode* mode;
+  size_t stride, i;
+  char settings[100];
+
+  error = lodepng_decode(&out, &w, &h, &state, png.data(), png.size());
+  mode = state.decoder.color_convert ? &state.info_raw : &state.info_png.color;
+  if(out) expected.assign(out, out + lodepng_get_raw_size(w, h, mode));
+  lodepng_free(out);
+  snprintf(settings, sizeof(settings), "to %s, rows %u-%u, reduce %u",
+           state.decoder.color_convert ? mode_name(state.info_raw).c_str() : "the PNG mode",
+           state.decoder.region_y0, state.decoder.region_y1, state.decoder.reduce);
+  if(!count_case(error == 0)) {
+    printf("%s: lodepng_decode %s gives error %u\n", name.c_str(), settings, error);
+    return;
+  }
+
+  /*what rows that each start at a byte boundary must look like, with the padding bytes of a larger stride*/
+  stride = row_bytes(w, *mode) + random_number() % 5u;
+  into.assign(stride * h, 0xa5);
+  error = lodepng_decode_into(into.data(), into.size(), stride, &w, &h, &state, png.data(), png.size());
+  if(!count_case(error == 0)) {
+    printf("%s: lodepng_decode_into %s gives error %u\n", name.c_str(), settings, error);
+    return;
+  }
+
+  for(i = 0; i != sizeof(max_slices) / sizeof(*max_slices); ++i) {
+    for(int output = 0; output != 3; ++output) {
+      PushRun run;
+      std::vector<unsigned char> image;
+      unsigned pw = 0, ph = 0;
+      bool partial_ok, ok;
+      run.max_slice = max_slices[i];
+      run.callback = output == 1;
+      run.stride = output == 2 ? stride : 0;
+      run.row_size = row_bytes(w, *mode);
+      run.next_y = 0;
+      run.rows_in_order = true;
+      if(run.stride) run.out.assign(stride * h, 0xa5);
+      error = push_decode(run, image, pw, ph, state, png, expected, w, partial_ok);
+      if(output == 0) {
+        ok = !error && pw == w && ph == h && image == expected;
+      } else if(output == 1) {
+        std::vector<unsigned char> rows;
+        for(size_t y = 0; y != h; ++y) {
+          rows.insert(rows.end(), into.begin() + y * stride, into.begin() + y * stride + row_bytes(w, *mode));
+        }
+        ok = !error && image.empty() && run.next_y == h && run.rows_in_order && run.rows == rows;
+      } else {
+        ok = !error && image.empty() && run.out == into;
+      }
+      if(!count_case(ok && partial_ok)) {
+        printf("%s differs: %s, slices up to %u bytes, %s, error %u%s\n", name.c_str(), settings,
+               (unsigned)max_slices[i], output == 0 ? "whole image" : output == 1 ? "row callback" : "with stride",
+               error, partial_ok ? "" : ", rows done so far differ");
+      }
+    }
+  }
+}
+
+unsigned append_data(const unsigned char* data, size_t size, void* context) {
+  std::vector<unsigned char>* png = (std::vector<unsigned char>*)context;
+  png->insert(png->end(), data, data + size);
+  return 0;
+}
+
+/*
+checks the push encoder on rows, against lodepng_encode with the same settings, which with more than one thread also
+compresses in parts of 256 KiB and so must give the same zlib data, and checks that the PNG decodes to the rows
+*/
+void check_encode(const std::vector<unsigned char>& rows, unsigned w, unsigned h, const LodePNGColorMode& mode,
+                  const std::vector<unsigned char>& png, const std::string& name) {
+  std::vector<unsigned char> pushed, decoded;
+  LodePNGState state;
+  LodePNGPushEncoder* encoder;
+  unsigned error = 0, dw = 0, dh = 0;
+  unsigned char* out = 0;
+  size_t stride = row_bytes(w, mode), y, chunk_size = 1 + random_number() * 4u;
+
+  lodepng_state_init(&state);
+  lodepng_color_mode_copy(&state.info_raw, &mode);
+  lodepng_color_mode_copy(&state.info_png.color, &mode);
+  state.encoder.zlibsettings.num_threads = 2;
+  encoder = lodepng_push_encoder_new(&state, w, h);
+  if(!encoder) error = 83;
+  if(!error) {
+    lodepng_push_encoder_set_write_callback(encoder, append_data, &pushed);
+    lodepng_push_encoder_set_chunk_size(encoder, chunk_size);
+    for(y = 0; y != h && !error; ++y) error = lodepng_push_encoder_write_row(encoder, &rows[y * stride]);
+    if(!error) error = lodepng_push_encoder_finish(encoder);
+    lodepng_push_encoder_delete(encoder);
+  }
+  lodepng_state_cleanup(&state);
+
+  lodepng_state_init(&state);
+  state.decoder.color_convert = 0;
+  if(!error) error = lodepng_decode(&out, &dw, &dh, &state, pushed.data(), pushed.size());
+  if(out) decoded.assign(out, out + lodepng_get_raw_size(dw, dh, &state.info_png.color));
+  lodepng_free(out);
+  if(!count_case(!error && dw == w && dh == h && decoded == pack_rows(rows, w, h, mode) &&
+                 lodepng_color_mode_equal(&state.info_png.color, &mode) && idat_data(pushed) == idat_data(png))) {
+    printf("%s differs: push encoder with IDAT chunks of %u bytes, error %u%s\n", name.c_str(), (unsigned)chunk_size,
+           error, !error && idat_data(pushed) != idat_data(png) ? ", other zlib data than lodepng_encode" : "");
+  }
+  lodepng_state_cleanup(&state);
+}
+
+/*makes a random image in the mode, encodes it with lodepng_encode, and checks the push decoder and encoder on it*/
+void check_image(LodePNGColorMode& mode, unsigned w, unsigned h, unsigned interlace) {
+  static const LodePNGColorType outputs[] = {LCT_RGBA, LCT_RGB, LCT_GREY_ALPHA, LCT_RGBA};
+  static const unsigned output_bitdepths[] = {8, 8, 8, 16};
+  std::string name = mode_name(mode);
+  std::vector<unsigned char> rows = random_rows(w, h, mode), image = pack_rows(rows, w, h, mode), png;
+  LodePNGState state;
+  unsigned char* out = 0;
+  size_t outsize = 0, i;
+  unsigned error;
+  char size[50];
+
+  lodepng_state_init(&state);
+  lodepng_color_mode_copy(&state.info_raw, &mode);
+  lodepng_color_mode_copy(&state.info_png.color, &mode);
+  state.encoder.auto_convert = 0;
+  state.encoder.zlibsettings.num_threads = 2;
+  state.info_png.interlace_method = interlace;
+  error = lodepng_encode(&out, &outsize, image.data(), w, h, &state);
+  if(out) png.assign(out, out + outsize);
+  lodepng_free(out);
+  lodepng_state_cleanup(&state);
+  snprintf(size, sizeof(size), ", %ux%u%s", w, h, interlace ? " interlaced" : "");
+  name += size;
+  if(!count_case(error == 0)) {
+    printf("%s: lodepng_encode gives error %u\n", name.c_str(), error);
+    return;
+  }
+
+  /*the mode of the PNG and conversions to other modes, each for the whole image and a random region*/
+  for(i = 0; i <= sizeof(outputs) / sizeof(*outputs); ++i) {
+    for(int region = 0; region != 2; ++region) {
+      lodepng_state_init(&state);
+      if(i == 0) state.decoder.color_convert = 0;
+      else {
+        state.info_raw.colortype = outputs[i - 1];
+        state.info_raw.bitdepth = output_bitdepths[i - 1];
+      }
+      if(region) {
+        state.decoder.region_y0 = random_number() % h;
+        state.decoder.region_y1 = state.decoder.region_y0 + 1 + random_number() % (h - state.decoder.region_y0);
+        state.decoder.reduce = random_number() % 4u;
+      }
+      check_decode(png, state, name);
+      lodepng_state_cleanup(&state);
+    }
+  }
+  if(!interlace) check_encode(rows, w, h, mode, png, name);
+}
+
+} /*namespace*/
+
+int main() {
+  static const LodePNGColorType types[] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  static const unsigned sizes[][2] = {{1, 1}, {1, 9}, {7, 3}, {13, 17}, {64, 40}, {257, 5}, {300, 300}};
+  for(size_t t = 0; t != sizeof(types) / sizeof(*types); ++t) {
+    for(unsigned bitdepth = 1; bitdepth <= 16; bitdepth *= 2) {
+      LodePNGColorMode mode = lodepng_color_mode_make(types[t], bitdepth);
+      if(checkColorValidity(types[t], bitdepth)) continue;
+      if(types[t] == LCT_PALETTE) {
+        unsigned colors = 1 + random_number() % (1u << bitdepth), c;
+        for(c = 0; c != colors; ++c) {
+          lodepng_palette_add(&mode, (unsigned char)random_number(), (unsigned char)random_number(),
+                              (unsigned char)random_number(), (unsigned char)random_number());
+        }
+      }
+      for(size_t s = 0; s != sizeof(sizes) / sizeof(*sizes); ++s) {
+        /*the large image, of more than one 256 KiB part, only in RGB and RGBA 8 bit, to keep the test fast*/
+        if(sizes[s][0] == 300 && (bitdepth != 8 || (types[t] != LCT_RGB && types[t] != LCT_RGBA))) continue;
+        for(unsigned interlace = 0; interlace != 2; ++interlace) check_image(mode, sizes[s][0], sizes[s][1], interlace);
+      }
+      lodepng_color_mode_cleanup(&mode);
+    }
+  }
+  return report();
+}
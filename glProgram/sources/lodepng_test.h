@@ -0,0 +1,47 @@
+/*
+LodePNG Test
+
+What the lodepng_*_test.cpp files share. Each of them includes lodepng.cpp, to call its internal functions, and then
+this header, so build each on its own, from this directory, such as:
+
+  g++ -O2 -pthread lodepng_unfilter_test.cpp -o lodepng_unfilter_test
+
+A test prints the cases that differ and exits with 1 if there are any. Kernels for instructions that the CPU doesn't
+have are skipped, and say so.
+
+Same license as LodePNG.
+*/
+
+#ifndef LODEPNG_TEST_H
+#define LODEPNG_TEST_H
+
+#include <cstdio>
+
+namespace {
+
+unsigned random_state = 1;
+
+/*a random number from 0 to 32767, the same sequence on every run so that a failure can be reproduced*/
+unsigned random_number() {
+  random_state = random_state * 1103515245u + 12345u;
+  return (random_state >> 16) & 0x7fff;
+}
+
+unsigned cases = 0, failures = 0;
+
+/*counts a case, and a failure if it didn't pass. Returns passed, so that the caller can print what differs.*/
+bool count_case(bool passed) {
+  ++cases;
+  if(!passed) ++failures;
+  return passed;
+}
+
+/*prints the totals, and returns the exit code for main*/
+int report() {
+  printf("%u cases, %u failures\n", cases, failures);
+  return failures ? 1 : 0;
+}
+
+} /*namespace*/
+
+#endif /*LODEPNG_TEST_H*/
@@ -0,0 +1,187 @@
+/*
+LodePNG Unfilter Test
+
+Checks that the SIMD unfilter kernels of lodepng.cpp give exactly the same scanlines as its scalar code. Each
+kernel, and unfilterScanline which dispatches to them, is run for every filter type, bytewidth 1 to 8 and widths
+of 1 up to 70 pixels, which includes odd widths and widths below the vector size, with and without a previous
+scanline, and with recon and scanline both at the same and at different memory.
+
+See lodepng_test.h for how to build and run it.
+
+Same license as LodePNG.
+*/
+
+#include "lodepng.cpp"
+#include "lodepng_test.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+/*a kernel of one filter type, called like unfilterScanline. Returns 0 for bytewidths it doesn't support.*/
+typedef unsigned (*Kernel)(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                           size_t bytewidth, size_t length);
+
+struct KernelInfo {
+  const char* name;
+  unsigned char filter_type;
+  bool needs_precon;
+  bool supported;
+  Kernel kernel;
+};
+
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+bool simd_bytewidth(size_t bytewidth) {
+  return bytewidth == 3 || bytewidth == 4 || bytewidth == 6 || bytewidth == 8;
+}
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_SIMD_NEON*/
+
+#ifdef LODEPNG_SIMD_X86
+unsigned sub_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char*, size_t bw, size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterSubSSE2(recon, scanline, bw, n);
+  return 1;
+}
+unsigned up_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t, size_t n) {
+  unfilterUpSSE2(recon, scanline, precon, n);
+  return 1;
+}
+unsigned up_avx2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t, size_t n) {
+  unfilterUpAVX2(recon, scanline, precon, n);
+  return 1;
+}
+unsigned average_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bw,
+                      size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterAverageSSE2(recon, scanline, precon, bw, n);
+  return 1;
+}
+unsigned paeth_sse2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bw,
+                    size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterPaethSSE2(recon, scanline, precon, bw, n);
+  return 1;
+}
+unsigned paeth_ssse3(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bw,
+                     size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterPaethSSSE3(recon, scanline, precon, bw, n);
+  return 1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+unsigned sub_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char*, size_t bw, size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterSubNEON(recon, scanline, bw, n);
+  return 1;
+}
+unsigned up_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t, size_t n) {
+  unfilterUpNEON(recon, scanline, precon, n);
+  return 1;
+}
+unsigned average_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bw,
+                      size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterAverageNEON(recon, scanline, precon, bw, n);
+  return 1;
+}
+unsigned paeth_neon(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bw,
+                    size_t n) {
+  if(!simd_bytewidth(bw)) return 0;
+  unfilterPaethNEON(recon, scanline, precon, bw, n);
+  return 1;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+std::vector<KernelInfo> kernels() {
+  std::vector<KernelInfo> result;
+#ifdef LODEPNG_SIMD_X86
+  unsigned features = lodepng_cpu_features();
+  KernelInfo x86[] = {
+    {"unfilterSubSSE2", 1, false, true, sub_sse2},
+    {"unfilterUpSSE2", 2, true, true, up_sse2},
+    {"unfilterUpAVX2", 2, true, (features & LODEPNG_CPU_AVX2) != 0, up_avx2},
+    {"unfilterAverageSSE2", 3, true, true, average_sse2},
+    {"unfilterPaethSSE2", 4, true, true, paeth_sse2},
+    {"unfilterPaethSSSE3", 4, true, (features & LODEPNG_CPU_SSSE3) != 0, paeth_ssse3},
+  };
+  result.assign(x86, x86 + sizeof(x86) / sizeof(*x86));
+#endif /*LODEPNG_SIMD_X86*/
+#ifdef LODEPNG_SIMD_NEON
+  KernelInfo neon[] = {
+    {"unfilterSubNEON", 1, false, true, sub_neon},
+    {"unfilterUpNEON", 2, true, true, up_neon},
+    {"unfilterAverageNEON", 3, true, true, average_neon},
+    {"unfilterPaethNEON", 4, true, true, paeth_neon},
+  };
+  result.assign(neon, neon + sizeof(neon) / sizeof(*neon));
+#endif /*LODEPNG_SIMD_NEON*/
+  return result;
+}
+
+/*random bytes, often the extremes and the values around the middle where the predictors have their ties*/
+unsigned char random_byte() {
+  static const unsigned char special[] = {0, 1, 2, 127, 128, 129, 253, 254, 255};
+  unsigned r = random_number();
+  if(r & 1) return special[(r >> 1) % sizeof(special)];
+  return (unsigned char)(r >> 4);
+}
+
+/*runs one scanline through the kernel, or unfilterScanline if kernel is NULL, and through the scalar code*/
+void check(const char* name, Kernel kernel, unsigned char filter_type, size_t bytewidth, size_t width,
+           bool with_precon, bool in_place) {
+  size_t length = width * bytewidth, i;
+  /*exactly sized, so that address sanitizer sees reads or writes past the end*/
+  std::vector<unsigned char> scanline(length), precon(length), expected(length), recon(length);
+  for(i = 0; i != length; ++i) scanline[i] = random_byte();
+  for(i = 0; i != length; ++i) precon[i] = random_byte();
+  const unsigned char* p = with_precon ? precon.data() : 0;
+  unsigned error = unfilterScanlineScalar(expected.data(), scanline.data(), p, bytewidth, filter_type, length);
+  if(in_place) recon = scanline;
+  const unsigned char* in = in_place ? recon.data() : scanline.data();
+  if(kernel) {
+    if(!kernel(recon.data(), in, p, bytewidth, length)) return;
+  } else {
+    error |= unfilterScanline(recon.data(), in, p, bytewidth, filter_type, length);
+  }
+  if(!count_case(!error && recon == expected)) {
+    for(i = 0; i != length && recon[i] == expected[i]; ++i) {}
+    printf("%s differs: filter %u, bytewidth %u, width %u, %s, %s, error %u, first difference at byte %u\n", name,
+           filter_type, (unsigned)bytewidth, (unsigned)width, with_precon ? "precon" : "no precon",
+           in_place ? "in place" : "separate", error, (unsigned)i);
+  }
+}
+
+} /*namespace*/
+
+int main() {
+  std::vector<KernelInfo> list = kernels();
+  for(size_t k = 0; k <= list.size(); ++k) {
+    /*the last round is unfilterScanline, for all filter types*/
+    const KernelInfo* info = k < list.size() ? &list[k] : 0;
+    if(info && !info->supported) {
+      printf("%s skipped: not supported by this CPU\n", info->name);
+      continue;
+    }
+    unsigned before = cases;
+    for(unsigned char filter_type = 0; filter_type != 5; ++filter_type) {
+      if(info && filter_type != info->filter_type) continue;
+      for(size_t bytewidth = 1; bytewidth <= 8; ++bytewidth) {
+        for(size_t width = 1; width <= 70; ++width) {
+          for(int precon = 0; precon != 2; ++precon) {
+            if(info && info->needs_precon && !precon) continue;
+            for(int in_place = 0; in_place != 2; ++in_place) {
+              check(info ? info->name : "unfilterScanline", info ? info->kernel : 0, filter_type, bytewidth, width,
+                    precon != 0, in_place != 0);
+            }
+          }
+        }
+      }
+    }
+    printf("%s: %u cases\n", info ? info->name : "unfilterScanline", cases - before);
+  }
+  return report();
+}